@@ -0,0 +1,205 @@
+--[[
+ LYAML binding for Lua 5.1, 5.2, 5.3 & 5.4
+ Copyright (C) 2013-2020 Gary V. Vaughan
+]]
+--[[--
+ Deterministic YAML corpora for the benchmarks in `bench/run.lua`.
+
+ Each generator takes a size, roughly the number of nodes to write, and
+ returns the same YAML string for the same size on every Lua
+ implementation, so that results from different runs can be compared.
+
+ @module corpus
+]]
+
+local concat = table.concat
+local format = string.format
+local rep = string.rep
+
+
+-- Park-Miller minimal standard generator, whose products stay exact in
+-- the doubles of Lua 5.1 and 5.2 as well as in 64-bit integers.
+local function Random(seed)
+   local state = seed
+   return function(n)
+      state = (state * 16807) % 2147483647
+      return state % n + 1
+   end
+end
+
+
+local WORDS = {
+   'alpha', 'bravo', 'charlie', 'delta', 'echo', 'foxtrot', 'golf',
+   'hotel', 'india', 'juliet', 'kilo', 'lima', 'mike', 'november',
+   'oscar', 'papa', 'quebec', 'romeo', 'sierra', 'tango', 'uniform',
+   'victor', 'whiskey', 'xray', 'yankee', 'zulu',
+}
+
+
+-- Return a plain scalar of a random type.
+local function scalar(random)
+   local kind = random(8)
+   if kind == 1 then
+      return tostring(random(100000) - 50000)
+   elseif kind == 2 then
+      return format('%d.%d', random(1000), random(1000))
+   elseif kind == 3 then
+      return random(2) == 1 and 'true' or 'false'
+   elseif kind == 4 then
+      return '~'
+   elseif kind == 5 then
+      return format("'%s %s'", WORDS[random(#WORDS)], WORDS[random(#WORDS)])
+   end
+   return WORDS[random(#WORDS)] .. '-' .. random(1000)
+end
+
+
+-- Return a sentence of about N words.
+local function sentence(random, n)
+   local words = {}
+   for i = 1, n do
+      words[i] = WORDS[random(#WORDS)]
+   end
+   return concat(words, ' ')
+end
+
+
+local generators = {
+   -- One mapping with SIZE keys.
+   wide_map = function(size)
+      local random, lines = Random(1), {}
+      for i = 1, size do
+         lines[i] = format('key_%06d: %s', i, scalar(random))
+      end
+      return concat(lines, '\n') .. '\n'
+   end,
+
+   -- Block mappings and sequences nested 64 deep, repeated to make up
+   -- SIZE nodes.
+   deep_nesting = function(size)
+      local random, lines = Random(2), {}
+      for _ = 1, math.max(1, math.floor(size / 64)) do
+         for depth = 0, 63 do
+            local indent = rep('  ', depth)
+            if depth % 2 == 0 then
+               lines[#lines + 1] = indent .. WORDS[random(#WORDS)] .. ':'
+            else
+               lines[#lines + 1] = indent .. '- ' .. scalar(random)
+               lines[#lines + 1] = indent .. '-'
+            end
+         end
+         lines[#lines + 1] = rep('  ', 64) .. scalar(random)
+         lines[#lines + 1] = '---'
+      end
+      lines[#lines] = nil
+      return concat(lines, '\n') .. '\n'
+   end,
+
+   -- A sequence of SIZE / 16 literal block scalars, 16 lines each.
+   long_literals = function(size)
+      local random, lines = Random(3), {}
+      for _ = 1, math.max(1, math.floor(size / 16)) do
+         lines[#lines + 1] = '- |'
+         for _ = 1, 16 do
+            lines[#lines + 1] = '  ' .. sentence(random, 10)
+         end
+      end
+      return concat(lines, '\n') .. '\n'
+   end,
+
+   -- Rows of 16 integers and floats in flow sequences.
+   numeric_arrays = function(size)
+      local random, lines = Random(4), {}
+      for _ = 1, math.max(1, math.floor(size / 16)) do
+         local row = {}
+         for j = 1, 16 do
+            local n = random(2000000) - 1000000
+            if j % 4 == 0 then
+               row[j] = format('%d.%03de%d', n, random(1000) - 1, random(10))
+            elseif j % 4 == 1 then
+               row[j] = format('0x%X', random(65536) - 1)
+            else
+               row[j] = tostring(n)
+            end
+         end
+         lines[#lines + 1] = '- [' .. concat(row, ', ') .. ']'
+      end
+      return concat(lines, '\n') .. '\n'
+   end,
+
+   -- A few anchored mappings, and SIZE aliases to them.
+   anchors = function(size)
+      local random, lines = Random(5), {'anchors:'}
+      local n = math.max(1, math.floor(size / 100))
+      for i = 1, n do
+         lines[#lines + 1] = format('  - &node%d {name: %s, id: %d}', i,
+                                    WORDS[random(#WORDS)], i)
+      end
+      lines[#lines + 1] = 'aliases:'
+      for _ = 1, size do
+         lines[#lines + 1] = format('  - *node%d', random(n))
+      end
+      return concat(lines, '\n') .. '\n'
+   end,
+
+   -- SIZE / 4 mappings, each merging one of a few anchored defaults.
+   merges = function(size)
+      local random, lines = Random(6), {'defaults:'}
+      local n = math.max(1, math.floor(size / 100))
+      for i = 1, n do
+         lines[#lines + 1] = format('  - &default%d', i)
+         lines[#lines + 1] = format('    adapter: %s', WORDS[random(#WORDS)])
+         lines[#lines + 1] = format('    pool: %d', random(64))
+         lines[#lines + 1] = format('    timeout: %d', random(10000))
+      end
+      lines[#lines + 1] = 'entries:'
+      for i = 1, math.max(1, math.floor(size / 4)) do
+         lines[#lines + 1] = format('  - <<: *default%d', random(n))
+         lines[#lines + 1] = format('    database: db_%d', i)
+         lines[#lines + 1] = format('    pool: %d', random(64))
+      end
+      return concat(lines, '\n') .. '\n'
+   end,
+
+   -- A stream of SIZE / 8 small documents.
+   multi_document = function(size)
+      local random, lines = Random(7), {}
+      for i = 1, math.max(1, math.floor(size / 8)) do
+         lines[#lines + 1] = '---'
+         lines[#lines + 1] = format('id: %d', i)
+         lines[#lines + 1] = format('name: %s', WORDS[random(#WORDS)])
+         lines[#lines + 1] = format('score: %s', scalar(random))
+         lines[#lines + 1] = format('tags: [%s, %s]', WORDS[random(#WORDS)],
+                                    WORDS[random(#WORDS)])
+         lines[#lines + 1] = format('note: %s', sentence(random, 6))
+      end
+      return concat(lines, '\n') .. '\n'
+   end,
+}
+
+
+--- Names of the generators, in the order they are run.
+-- @table names
+local names = {
+   'wide_map', 'deep_nesting', 'long_literals', 'numeric_arrays',
+   'anchors', 'merges', 'multi_document',
+}
+
+
+--- Return the corpus NAME of the given SIZE.
+-- @string name one of `names`
+-- @int size roughly the number of nodes to write
+-- @treturn string YAML stream
+local function generate(name, size)
+   local generator = generators[name]
+   if generator == nil then
+      error(format("unknown corpus '%s'", name), 2)
+   end
+   return generator(size)
+end
+
+
+return {
+   generate = generate,
+   names = names,
+}
@@ -0,0 +1,240 @@
+--[[
+ LYAML binding for Lua 5.1, 5.2, 5.3 & 5.4
+ Copyright (C) 2013-2020 Gary V. Vaughan
+]]
+--[[--
+ Measure the throughput of `lyaml.load`, `lyaml.dump`, `yaml.parser` and
+ `yaml.scanner` on the corpora from `bench/corpus.lua`.
+
+ Run it from the top of the source tree, after building with luke:
+
+     lua bench/run.lua [--size=N] [--iterations=N] [--corpus=NAME,...]
+                       [--op=OP,...] [--save=DIR]
+
+ Each corpus and operation writes one line of JSON to standard output,
+ with the Lua and lyaml versions, the size of the input, and:
+
+   - `mb_per_s`, megabytes of YAML loaded, dumped or parsed per second
+     of CPU time
+   - `events_per_s`, parser events (scanner tokens, for `scanner`) per
+     second
+   - `peak_kb`, the largest Lua heap size seen at the end of each
+     garbage collection cycle and each iteration
+   - `alloc_kb`, kilobytes allocated by one iteration with the garbage
+     collector stopped
+   - `live_kb`, kilobytes still referenced by the result of one
+     iteration
+   - `gc_cycles`, garbage collection cycles completed per iteration
+
+ so that the output of runs on different versions can be compared
+ line by line.  `--save=DIR` also writes each corpus to `DIR/NAME.yaml`.
+]]
+
+do
+   -- use the modules in the source tree, like spec/spec_helper.lua
+   local luke, objdir = io.popen './build-aux/luke --value=objdir'
+   if luke then
+      objdir = luke:read '*a':match "^objdir='(.*)'"
+      luke:close()
+   end
+
+   package.path = './bench/?.lua;./lib/?.lua;./lib/?/init.lua;' ..
+      package.path
+   if objdir then
+      package.cpath = './' .. objdir .. '/?.so;./' .. objdir .. '/?.dll;' ..
+         package.cpath
+   end
+end
+
+local corpus = require 'corpus'
+local lyaml = require 'lyaml'
+local yaml = require 'yaml'
+
+local clock = os.clock
+local concat = table.concat
+local format = string.format
+local gsub = string.gsub
+
+
+local OPS = {'load', 'dump', 'parser', 'scanner'}
+
+
+-- Return a table of the --name=value options in ARGS.
+local function getopts(args)
+   local opts = {size = '2000', iterations = '5'}
+   for _, arg in ipairs(args) do
+      local name, value = arg:match '^%-%-([%w_]+)=(.*)$'
+      if name == nil then
+         io.stderr:write(format("run.lua: unrecognised argument '%s'\n", arg))
+         os.exit(2)
+      end
+      opts[name] = value
+   end
+   return opts
+end
+
+
+-- Split a comma separated list, or return DEFAULT if S is nil.
+local function list(s, default)
+   if s == nil then
+      return default
+   end
+   local r = {}
+   for item in s:gmatch '[^,]+' do
+      r[#r + 1] = item
+   end
+   return r
+end
+
+
+-- Return V formatted as a JSON value.
+local function json(v)
+   if type(v) == 'number' then
+      if v ~= v or v == math.huge or v == -math.huge then
+         return 'null'
+      elseif v == math.floor(v) and math.abs(v) < 2^53 then
+         return format('%.0f', v)
+      end
+      return format('%.6g', v)
+   elseif type(v) == 'string' then
+      return '"' .. gsub(v, '[%c"\\]', function(c)
+         return format('\\u%04x', c:byte())
+      end) .. '"'
+   end
+   return tostring(v)
+end
+
+
+-- Write RECORD as a single line JSON object, with fields in KEYS order.
+local function emit(record, keys)
+   local fields = {}
+   for _, k in ipairs(keys) do
+      fields[#fields + 1] = json(k) .. ':' .. json(record[k])
+   end
+   io.write('{', concat(fields, ','), '}\n')
+   io.flush()
+end
+
+
+-- Call F with a function that is called after every garbage collection
+-- cycle, until the returned function is called to stop it.
+local function ongc(f)
+   local stopped = false
+   local function arm()
+      -- an unreferenced finalizable object is collected by the next cycle
+      local sentinel
+      if newproxy then
+         sentinel = newproxy(true)
+         getmetatable(sentinel).__gc = function()
+            if not stopped then f(); arm() end
+         end
+      else
+         setmetatable({}, {__gc = function()
+            if not stopped then f(); arm() end
+         end})
+      end
+   end
+   arm()
+   return function() stopped = true end
+end
+
+
+-- Return the number of events, or tokens, in S.
+local function count(iterate, s)
+   local n = 0
+   for _ in iterate(s) do
+      n = n + 1
+   end
+   return n
+end
+
+
+-- Return the function to benchmark for OP on S, and the number of bytes
+-- and events it processes each time.
+local function prepare(op, s, events)
+   if op == 'load' then
+      return function() return lyaml.load(s, {all=true}) end, #s, events
+   elseif op == 'dump' then
+      local documents = lyaml.load(s, {all=true})
+      local fn = function() return lyaml.dump(documents) end
+      return fn, #fn(), events
+   elseif op == 'parser' then
+      return function() return count(yaml.parser, s) end, #s, events
+   elseif op == 'scanner' then
+      return function() return count(yaml.scanner, s) end, #s,
+         count(yaml.scanner, s)
+   end
+   io.stderr:write(format("run.lua: unknown operation '%s'\n", op))
+   os.exit(2)
+end
+
+
+-- Return the measurements of ITERATIONS calls to FN.
+local function measure(fn, iterations)
+   local r = {}
+
+   -- heap allocated by one call, and retained by its result
+   collectgarbage 'collect'
+   collectgarbage 'stop'
+   local before = collectgarbage 'count'
+   local result = fn()
+   r.alloc_kb = collectgarbage 'count' - before
+   collectgarbage 'restart'
+   collectgarbage 'collect'
+   r.live_kb = collectgarbage 'count' - before
+   result = nil
+
+   -- time, collections and peak heap size over every call
+   collectgarbage 'collect'
+   local cycles, peak = 0, collectgarbage 'count'
+   local stop = ongc(function()
+      cycles = cycles + 1
+      peak = math.max(peak, collectgarbage 'count')
+   end)
+   local start = clock()
+   for _ = 1, iterations do
+      fn()
+      peak = math.max(peak, collectgarbage 'count')
+   end
+   r.seconds = clock() - start
+   stop()
+
+   r.gc_cycles = cycles / iterations
+   r.peak_kb = peak
+   return r
+end
+
+
+local KEYS = {
+   'lua', 'lyaml', 'corpus', 'op', 'size', 'iterations', 'bytes', 'events',
+   'seconds', 'mb_per_s', 'events_per_s', 'peak_kb', 'alloc_kb', 'live_kb',
+   'gc_cycles',
+}
+
+local opts = getopts(arg)
+local size = tonumber(opts.size)
+local iterations = tonumber(opts.iterations)
+local luaversion = jit and jit.version or _VERSION
+
+for _, name in ipairs(list(opts.corpus, corpus.names)) do
+   local s = corpus.generate(name, size)
+   local events = count(yaml.parser, s)
+
+   if opts.save then
+      local h = assert(io.open(opts.save .. '/' .. name .. '.yaml', 'wb'))
+      h:write(s)
+      h:close()
+   end
+
+   for _, op in ipairs(list(opts.op, OPS)) do
+      local fn, bytes, n = prepare(op, s, events)
+      fn()	-- warm up
+
+      local r = measure(fn, iterations)
+      r.lua, r.lyaml, r.corpus, r.op = luaversion, yaml.version, name, op
+      r.size, r.iterations, r.bytes, r.events = size, iterations, bytes, n
+      r.mb_per_s = bytes * iterations / 1048576 / r.seconds
+      r.events_per_s = n * iterations / r.seconds
+      emit(r, KEYS)
+   end
+end
@@ -0,0 +1,663 @@
+/*
+ * compiler.c, compact binary form of loaded YAML documents for lyaml
+ *
+ * Copyright (C) 2013-2020 Gary V. Vaughan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* A compiled stream is the list of documents returned by a load, written
+   out as a byte string that rebuilds the same tables without parsing or
+   resolving any YAML:
+
+      "\033LYAML" FORMAT
+      string count, then the length and bytes of each string
+      document count, then one node for each document
+
+   Every count, length and index is an unsigned LEB128 varint.  A node
+   is a tag byte followed by its payload:
+
+      NODE_NULL, NODE_FALSE, NODE_TRUE	nothing
+      NODE_INTEGER			zigzag encoded varint
+      NODE_FLOAT			8 byte little-endian IEEE double
+      NODE_STRING			index into the string table
+      NODE_SEQUENCE			element count, then each element
+      NODE_MAPPING			pair count, then each key and value
+      NODE_TABLE			index of a table already written
+
+   Each distinct string is stored once, and a table reached again through
+   an alias is written as a reference to its first appearance, so shared
+   and recursive tables come back shared and recursive.
+
+   Neither direction recurses: values still to be written wait on a
+   pending list, and tables still being filled in on a stack of frames,
+   so the depth of nesting is only limited by memory. */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lyaml.h"
+
+
+#define COMPILED_MAGIC		"\033LYAML"
+#define COMPILED_FORMAT		1
+
+enum {
+   NODE_NULL,
+   NODE_FALSE,
+   NODE_TRUE,
+   NODE_INTEGER,
+   NODE_FLOAT,
+   NODE_STRING,
+   NODE_SEQUENCE,
+   NODE_MAPPING,
+   NODE_TABLE
+};
+
+typedef struct {
+   lua_State	 *outputL;	/* thread holding the node buffer */
+   luaL_Buffer	  buff;
+   int		  strings;	/* string -> index, and index -> string */
+   int		  tables;	/* table -> index */
+   int		  pending;	/* values still to be written, last first */
+   lua_Integer	  nstrings;
+   lua_Integer	  ntables;
+   int		  npending;
+} lyaml_compiler;
+
+/* A table still being filled in by the decompiler. */
+typedef struct {
+   int		  table;	/* index in the table list */
+   int		  mapping;	/* otherwise a sequence */
+   lua_Integer	  left;		/* nodes still to be read into it */
+   lua_Integer	  n;		/* sequences: elements read so far */
+} lyaml_decompiler_frame;
+
+typedef struct {
+   const unsigned char *p;	/* next unread byte */
+   const unsigned char *end;
+   int		  strings;	/* index -> string */
+   int		  tables;	/* index -> table */
+   int		  keys;		/* frame depth -> key awaiting its value */
+   lua_Integer	  nstrings;
+   lua_Integer	  ntables;
+
+   /* open tables, in a userdatum at index framebuf */
+   lyaml_decompiler_frame *frames;
+   int		  framebuf;
+   int		  depth;
+   int		  nframes;
+} lyaml_decompiler;
+
+
+static void
+compiler_varint (luaL_Buffer *b, uint64_t n)
+{
+   while (n >= 0x80)
+   {
+      luaL_addchar (b, (char) ((n & 0x7f) | 0x80));
+      n >>= 7;
+   }
+   luaL_addchar (b, (char) n);
+}
+
+static void
+compiler_integer (lyaml_compiler *compiler, int64_t n)
+{
+   luaL_addchar (&compiler->buff, NODE_INTEGER);
+   compiler_varint (&compiler->buff,
+                    ((uint64_t) n << 1) ^ (uint64_t) (n >> 63));
+}
+
+static void
+compiler_float (lyaml_compiler *compiler, double d)
+{
+   uint64_t bits;
+   int i;
+
+   memcpy (&bits, &d, sizeof bits);
+   luaL_addchar (&compiler->buff, NODE_FLOAT);
+   for (i = 0; i < 8; i++, bits >>= 8)
+      luaL_addchar (&compiler->buff, (char) (bits & 0xff));
+}
+
+static void
+compiler_number (lua_State *L, lyaml_compiler *compiler, int idx)
+{
+#if LUA_VERSION_NUM > 502
+   if (lua_isinteger (L, idx))
+   {
+      compiler_integer (compiler, (int64_t) lua_tointeger (L, idx));
+      return;
+   }
+#else
+   {
+      /* whole numbers are kept compact when they can be exact */
+      lua_Number n = lua_tonumber (L, idx);
+
+      if (n == floor (n) && fabs (n) <= 9007199254740992.0 &&
+          !(n == 0 && signbit (n)))
+      {
+         compiler_integer (compiler, (int64_t) n);
+         return;
+      }
+   }
+#endif
+   compiler_float (compiler, (double) lua_tonumber (L, idx));
+}
+
+static void
+compiler_string (lua_State *L, lyaml_compiler *compiler, int idx)
+{
+   lua_Integer n;
+
+   lua_pushvalue (L, idx);
+   lua_rawget    (L, compiler->strings);
+   if (lua_isnil (L, -1))
+   {
+      n = ++compiler->nstrings;
+      lua_pushvalue   (L, idx);
+      lua_pushinteger (L, n);
+      lua_rawset      (L, compiler->strings);
+      lua_pushvalue   (L, idx);
+      lua_rawseti     (L, compiler->strings, (int) n);
+   }
+   else
+      n = lua_tointeger (L, -1);
+   lua_pop (L, 1);
+
+   luaL_addchar (&compiler->buff, NODE_STRING);
+   compiler_varint (&compiler->buff, (uint64_t) (n - 1));
+}
+
+/* Return the number of pairs in the table at IDX, setting *ISSEQ if their
+   keys are exactly the integers from 1 up to that number. */
+static lua_Integer
+compiler_count (lua_State *L, int idx, int *isseq)
+{
+   lua_Integer n = 0;
+   lua_Number k, max = 0;
+
+   *isseq = 1;
+   lua_pushnil (L);
+   while (lua_next (L, idx) != 0)
+   {
+      lua_pop (L, 1);
+      n++;
+      if (!*isseq)
+         continue;
+      if (lua_type (L, -1) != LUA_TNUMBER ||
+          (k = lua_tonumber (L, -1)) < 1 || k != floor (k))
+         *isseq = 0;
+      else if (k > max)
+         max = k;
+   }
+
+   /* distinct whole keys from 1 up, with none past the count */
+   if (max != (lua_Number) n)
+      *isseq = 0;
+   return n;
+}
+
+/* Add the value on top of the stack to the pending list. */
+static void
+compiler_push (lua_State *L, lyaml_compiler *compiler)
+{
+   lua_rawseti (L, compiler->pending, ++compiler->npending);
+}
+
+/* Write the header of the table at IDX, and add its contents to the
+   pending list to be written next. */
+static void
+compiler_table (lua_State *L, lyaml_compiler *compiler, int idx)
+{
+   lua_Integer n, i;
+   int isseq, lo, hi;
+
+   lyaml_materialize (L, idx);
+   if (lyaml_isnull (L, idx))
+   {
+      luaL_addchar (&compiler->buff, NODE_NULL);
+      return;
+   }
+
+   /* a table seen before is only referred back to */
+   lua_pushvalue (L, idx);
+   lua_rawget    (L, compiler->tables);
+   if (!lua_isnil (L, -1))
+   {
+      luaL_addchar (&compiler->buff, NODE_TABLE);
+      compiler_varint (&compiler->buff, (uint64_t) (lua_tointeger (L, -1) - 1));
+      lua_pop (L, 1);
+      return;
+   }
+   lua_pop (L, 1);
+
+   lua_pushvalue   (L, idx);
+   lua_pushinteger (L, ++compiler->ntables);
+   lua_rawset      (L, compiler->tables);
+
+   n = compiler_count (L, idx, &isseq);
+   luaL_addchar (&compiler->buff, isseq ? NODE_SEQUENCE : NODE_MAPPING);
+   compiler_varint (&compiler->buff, (uint64_t) n);
+
+   /* the last of the pending values is written first */
+   if (isseq)
+   {
+      for (i = n; i >= 1; i--)
+      {
+         lua_rawgeti   (L, idx, (int) i);
+         compiler_push (L, compiler);
+      }
+      return;
+   }
+
+   /* add each key and value in the order lua_next returns them, then
+      reverse them in place */
+   lo = compiler->npending + 1;
+   lua_pushnil (L);
+   while (lua_next (L, idx) != 0)
+   {
+      lua_pushvalue (L, -2);
+      compiler_push (L, compiler);
+      compiler_push (L, compiler);
+   }
+   for (hi = compiler->npending; lo < hi; lo++, hi--)
+   {
+      lua_rawgeti (L, compiler->pending, lo);
+      lua_rawgeti (L, compiler->pending, hi);
+      lua_rawseti (L, compiler->pending, lo);
+      lua_rawseti (L, compiler->pending, hi);
+   }
+}
+
+/* Append the value at IDX to the node buffer, or just the header of a
+   table whose contents are then pending. */
+static void
+compiler_node (lua_State *L, lyaml_compiler *compiler, int idx)
+{
+   int itsa = lua_type (L, idx);
+
+   if (itsa == LUA_TBOOLEAN)
+      luaL_addchar (&compiler->buff,
+                    lua_toboolean (L, idx) ? NODE_TRUE : NODE_FALSE);
+   else if (itsa == LUA_TNUMBER)
+      compiler_number (L, compiler, idx);
+   else if (itsa == LUA_TSTRING)
+      compiler_string (L, compiler, idx);
+   else if (itsa == LUA_TTABLE)
+      compiler_table (L, compiler, idx);
+   else /* unsupported Lua type */
+      luaL_error (L, "cannot compile object of type '%s'",
+                  lua_typename (L, itsa));
+}
+
+/* Append the document at IDX to the node buffer, with all the values
+   inside it. */
+static void
+compiler_document (lua_State *L, lyaml_compiler *compiler, int idx)
+{
+   lua_pushvalue (L, idx);
+   compiler_push (L, compiler);
+   while (compiler->npending > 0)
+   {
+      lua_rawgeti   (L, compiler->pending, compiler->npending);
+      lua_pushnil   (L);
+      lua_rawseti   (L, compiler->pending, compiler->npending--);
+      compiler_node (L, compiler, lua_gettop (L));
+      lua_pop       (L, 1);
+   }
+}
+
+/* Return the compiled form of the list of documents in the first
+   argument slot. */
+int
+Pcompile (lua_State *L)
+{
+   lyaml_compiler compiler;
+   luaL_Buffer b;
+   lua_Integer n, i;
+
+   luaL_checktype (L, 1, LUA_TTABLE);
+   lua_settop (L, 1);
+
+   memset (&compiler, 0, sizeof compiler);
+   lua_newtable (L);
+   compiler.strings = lua_gettop (L);
+   lua_newtable (L);
+   compiler.tables = lua_gettop (L);
+   lua_newtable (L);
+   compiler.pending = lua_gettop (L);
+
+   /* the node buffer lives in a separate thread, out of the way of the
+      stack slots used while walking the documents */
+   compiler.outputL = lua_newthread (L);
+   luaL_buffinit (compiler.outputL, &compiler.buff);
+
+   n = (lua_Integer) lua_objlen (L, 1);
+   for (i = 1; i <= n; i++)
+   {
+      lua_rawgeti       (L, 1, (int) i);
+      compiler_document (L, &compiler, lua_gettop (L));
+      lua_pop           (L, 1);
+   }
+   luaL_pushresult (&compiler.buff);
+
+   luaL_buffinit (L, &b);
+   luaL_addstring (&b, COMPILED_MAGIC);
+   luaL_addchar   (&b, COMPILED_FORMAT);
+   compiler_varint (&b, (uint64_t) compiler.nstrings);
+   for (i = 1; i <= compiler.nstrings; i++)
+   {
+      const char *s;
+      size_t len;
+
+      lua_rawgeti (L, compiler.strings, (int) i);
+      s = lua_tolstring (L, -1, &len);
+      lua_pop (L, 1);	/* still anchored in the string table */
+      compiler_varint (&b, (uint64_t) len);
+      luaL_addlstring (&b, s, len);
+   }
+   compiler_varint (&b, (uint64_t) n);
+   lua_xmove (compiler.outputL, L, 1);
+   luaL_addvalue (&b);
+   luaL_pushresult (&b);
+   return 1;
+}
+
+
+static void
+decompiler_corrupt (lua_State *L)
+{
+   luaL_error (L, "corrupt compiled YAML");
+}
+
+static uint64_t
+decompiler_varint (lua_State *L, lyaml_decompiler *d)
+{
+   uint64_t n = 0;
+   int shift;
+
+   for (shift = 0; shift < 64; shift += 7)
+   {
+      unsigned char c;
+
+      if (d->p == d->end)
+         break;
+      c = *d->p++;
+      n |= (uint64_t) (c & 0x7f) << shift;
+      if ((c & 0x80) == 0)
+         return n;
+   }
+   decompiler_corrupt (L);
+   return 0;
+}
+
+/* Return a count read from D, which can't exceed the bytes left when each
+   of the things counted takes at least one. */
+static lua_Integer
+decompiler_count (lua_State *L, lyaml_decompiler *d)
+{
+   uint64_t n = decompiler_varint (L, d);
+
+   if (n > (uint64_t) (d->end - d->p) || n > INT32_MAX)
+      decompiler_corrupt (L);
+   return (lua_Integer) n;
+}
+
+/* Open a frame for the table just read, which has LEFT nodes to be read
+   into it. */
+static void
+decompiler_push_frame (lua_State *L, lyaml_decompiler *d, int mapping,
+                       lua_Integer left)
+{
+   lyaml_decompiler_frame *frame;
+
+   if (d->depth == d->nframes)
+   {
+      /* a new userdatum, so that the old one is still collected if an
+         error is raised later */
+      int n = 2 * d->nframes;
+      lyaml_decompiler_frame *frames = (lyaml_decompiler_frame *)
+         lua_newuserdata (L, n * sizeof (*frames));
+
+      memcpy (frames, d->frames, d->nframes * sizeof (*frames));
+      lua_replace (L, d->framebuf);
+      d->frames = frames;
+      d->nframes = n;
+   }
+
+   frame = d->frames + d->depth++;
+   frame->table = (int) d->ntables;
+   frame->mapping = mapping;
+   frame->left = left;
+   frame->n = 0;
+}
+
+/* Push the next node read from D.  A table is pushed empty, and its
+   contents are read into it by decompiler_document. */
+static void
+decompiler_node (lua_State *L, lyaml_decompiler *d)
+{
+   lua_Integer n, i;
+   uint64_t u;
+   int tag;
+
+   if (d->p == d->end)
+      decompiler_corrupt (L);
+
+   switch ((tag = *d->p++))
+   {
+      case NODE_NULL:
+         lyaml_pushnull (L);
+         break;
+
+      case NODE_FALSE:
+      case NODE_TRUE:
+         lua_pushboolean (L, tag == NODE_TRUE);
+         break;
+
+      case NODE_INTEGER:
+         u = decompiler_varint (L, d);
+         u = (u >> 1) ^ (~(u & 1) + 1);
+#if LUA_VERSION_NUM > 502
+         lua_pushinteger (L, (lua_Integer) (int64_t) u);
+#else
+         lua_pushnumber (L, (lua_Number) (int64_t) u);
+#endif
+         break;
+
+      case NODE_FLOAT:
+      {
+         double f;
+
+         if (d->end - d->p < 8)
+            decompiler_corrupt (L);
+         for (u = 0, i = 7; i >= 0; i--)
+            u = (u << 8) | d->p[i];
+         d->p += 8;
+         memcpy (&f, &u, sizeof f);
+         lua_pushnumber (L, (lua_Number) f);
+         break;
+      }
+
+      case NODE_STRING:
+         u = decompiler_varint (L, d);
+         if (u >= (uint64_t) d->nstrings)
+            decompiler_corrupt (L);
+         lua_rawgeti (L, d->strings, (int) u + 1);
+         break;
+
+      case NODE_TABLE:
+         u = decompiler_varint (L, d);
+         if (u >= (uint64_t) d->ntables)
+            decompiler_corrupt (L);
+         lua_rawgeti (L, d->tables, (int) u + 1);
+         break;
+
+      case NODE_SEQUENCE:
+      case NODE_MAPPING:
+         n = decompiler_count (L, d);
+         if (tag == NODE_SEQUENCE)
+            lua_createtable (L, (int) n, 0);
+         else
+            lua_createtable (L, 0, (int) n);
+
+         /* register before filling, for aliases back to this table */
+         lua_pushvalue (L, -1);
+         lua_rawseti   (L, d->tables, (int) ++d->ntables);
+         if (n > 0)
+            decompiler_push_frame (L, d, tag == NODE_MAPPING,
+                                   tag == NODE_MAPPING ? 2 * n : n);
+         break;
+
+      default:
+         decompiler_corrupt (L);
+   }
+}
+
+/* Add the node on top of the stack to the table in the frame at DEPTH,
+   or keep it aside until its value is read if it is a mapping key. */
+static void
+decompiler_add (lua_State *L, lyaml_decompiler *d, int depth)
+{
+   lyaml_decompiler_frame *frame = d->frames + depth - 1;
+
+   frame->left--;
+   if (frame->mapping && frame->left % 2 == 1)
+   {
+      lua_rawseti (L, d->keys, depth);
+      return;
+   }
+
+   lua_rawgeti (L, d->tables, frame->table);
+   if (frame->mapping)
+   {
+      lua_rawgeti   (L, d->keys, depth);
+      lua_pushvalue (L, -3);
+      lua_rawset    (L, -3);
+      lua_pushnil   (L);
+      lua_rawseti   (L, d->keys, depth);
+   }
+   else
+   {
+      lua_pushvalue (L, -2);
+      lua_rawseti   (L, -2, (int) ++frame->n);
+   }
+   lua_pop (L, 2);
+}
+
+/* Push the next document read from D, with all the nodes inside it. */
+static void
+decompiler_document (lua_State *L, lyaml_decompiler *d)
+{
+   int depth;
+
+   decompiler_node (L, d);
+   for (;;)
+   {
+      while (d->depth > 0 && d->frames[d->depth - 1].left == 0)
+         d->depth--;
+      if ((depth = d->depth) == 0)
+         break;
+      decompiler_node (L, d);
+      decompiler_add (L, d, depth);
+   }
+}
+
+/* Return the list of documents compiled into the string in the first
+   argument slot. */
+int
+Pload_compiled (lua_State *L)
+{
+   lyaml_decompiler d;
+   size_t len;
+   const char *s = luaL_checklstring (L, 1, &len);
+   lua_Integer n, i;
+
+   lua_settop (L, 1);
+   d.p     = (const unsigned char *) s;
+   d.end   = d.p + len;
+
+   if (len <= sizeof COMPILED_MAGIC - 1 ||
+       memcmp (s, COMPILED_MAGIC, sizeof COMPILED_MAGIC - 1) != 0)
+      return luaL_error (L, "not compiled YAML");
+   d.p += sizeof COMPILED_MAGIC - 1;
+   if (*d.p != COMPILED_FORMAT)
+      return luaL_error (L, "unsupported compiled YAML format %d", (int) *d.p);
+   d.p++;
+
+   d.nstrings = decompiler_count (L, &d);
+   lua_createtable (L, (int) d.nstrings, 0);
+   d.strings = lua_gettop (L);
+   for (i = 1; i <= d.nstrings; i++)
+   {
+      uint64_t l = decompiler_varint (L, &d);
+
+      if (l > (uint64_t) (d.end - d.p))
+         decompiler_corrupt (L);
+      lua_pushlstring (L, (const char *) d.p, (size_t) l);
+      lua_rawseti (L, d.strings, (int) i);
+      d.p += l;
+   }
+
+   lua_newtable (L);
+   d.tables  = lua_gettop (L);
+   d.ntables = 0;
+   lua_newtable (L);
+   d.keys    = lua_gettop (L);
+   d.nframes = 16;
+   d.frames  = (lyaml_decompiler_frame *)
+      lua_newuserdata (L, d.nframes * sizeof (*d.frames));
+   d.framebuf = lua_gettop (L);
+   d.depth   = 0;
+
+   n = decompiler_count (L, &d);
+   lua_createtable (L, (int) n, 0);
+   for (i = 1; i <= n; i++)
+   {
+      decompiler_document (L, &d);
+      lua_rawseti (L, -2, (int) i);
+   }
+   if (d.p != d.end)
+      decompiler_corrupt (L);
+   return 1;
+}
+
+
+/* Return the 64-bit FNV-1a hash of the string in the first argument slot,
+   as 16 hex digits.  This is quick enough to check a whole file before
+   using a compiled copy, but is no defence against deliberate collisions. */
+int
+Pdigest (lua_State *L)
+{
+   size_t len, i;
+   const unsigned char *s =
+      (const unsigned char *) luaL_checklstring (L, 1, &len);
+   uint64_t h = UINT64_C (0xcbf29ce484222325);
+   char hex[17];
+
+   for (i = 0; i < len; i++)
+      h = (h ^ s[i]) * UINT64_C (0x100000001b3);
+   for (i = 16; i-- > 0; h >>= 4)
+      hex[i] = "0123456789abcdef"[h & 0xf];
+   lua_pushlstring (L, hex, 16);
+   return 1;
+}
@@ -0,0 +1,1100 @@
+/*
+ * dumper.c, libyaml dumper binding for Lua
+ *
+ * Copyright (C) 2013-2020 Gary V. Vaughan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Walk Lua values and pass the equivalent events straight to the libyaml
+   emitter, without creating an event table for each node like the
+   `yaml.emitter` object requires.  This is a straight translation of the
+   Lua dumper in lib/lyaml/init.lua.
+
+   With the `sort_keys` option, the keys of each mapping are collected
+   and merge sorted here, rather than calling `table.sort` for every
+   mapping: booleans first, then numbers, then strings byte by byte,
+   unless a comparison function is given.  The `canonical` option sorts
+   keys that way and writes numbers with the same digits on every Lua
+   version, so equal inputs always dump to identical bytes.
+
+   A table is dumped as a sequence or a mapping, in block or flow style,
+   according to the `__yaml` field of its metatable if it has one.  If
+   not, it is a sequence when its keys are exactly the integers from 1 up
+   to its border.  That takes a `lua_next` walk over the table, stopping
+   at the first key that is not, before its start event can be written;
+   a sequence is then read a second time by index as it is dumped.  The
+   C API hides which keys are in the array part, so holes below the
+   border can only be found by visiting every key. */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lyaml.h"
+
+/* Slots in the dumper state table. */
+enum {
+   STATE_ANCHORS = 1,	/* value -> anchor name, until first dumped */
+   STATE_ALIASED,	/* value -> anchor name, after first dumped */
+   STATE_IMPLICIT,	/* implicit_scalar option, or nil for default */
+   STATE_OUTPUT,	/* thread holding the output buffer */
+   STATE_NAMES,		/* anchor names given in options, if auto_anchors */
+   STATE_COUNTS,	/* table -> references in the current document */
+   STATE_AUTO,		/* table -> generated anchor name, after first dumped */
+   STATE_COMPARE,	/* sort_keys comparison function, if any */
+   STATE_OPEN,		/* table -> true, while it is being dumped */
+   STATE_FRAMES		/* table, and current or sorted keys, of each frame */
+};
+
+/* Shapes of dumped tables, and their __yaml metatable field names. */
+enum {
+   SHAPE_MAP,
+   SHAPE_SEQ,
+   SHAPE_FLOW_MAP,
+   SHAPE_FLOW_SEQ
+};
+
+static const char *shape_names[] = {
+   "map", "seq", "flow_map", "flow_seq", NULL
+};
+
+/* Order of the types of mapping keys with the sort_keys option; keys of
+   any other type are left in the order `next` returns them, last. */
+enum {
+   KEY_BOOLEAN,
+   KEY_NUMBER,
+   KEY_STRING,
+   KEY_OTHER
+};
+
+/* A mapping key, and what it is sorted by. */
+typedef struct {
+   int		rank;		/* KEY_BOOLEAN, KEY_NUMBER... */
+   int		isint;		/* n is an integer subtype */
+   lua_Number	n;		/* booleans and numbers */
+   lua_Integer	i;		/* ...and the integers of Lua 5.3 */
+   const char  *s;		/* strings */
+   size_t	len;
+   int		pos;		/* index in the list of keys */
+} lyaml_key;
+
+/* A table being dumped.  Its elements are dumped one at a time, from an
+   explicit stack of these rather than by recursion, so that the depth of
+   nesting is only limited by memory. */
+typedef struct {
+   int		  mapping;	/* otherwise a sequence */
+   int		  value;	/* mappings: the current key's value is next */
+   lua_Integer	  i;		/* elements or sorted keys started so far */
+   lua_Integer	  n;		/* sequence border, or number of sorted keys */
+} lyaml_dump_frame;
+
+typedef struct {
+   yaml_emitter_t emitter;
+
+   /* output accumulator */
+   lua_State	 *outputL;
+   luaL_Buffer	  yamlbuff;
+   size_t	  yamllen;
+
+   /* output sink, instead of the accumulator */
+   lyaml_output	  output;
+
+   /* open tables */
+   lyaml_dump_frame *frames;
+   int		  depth;
+   int		  nframes;
+
+   /* auto_anchors option, and the last generated anchor number */
+   int		  auto_anchors;
+   int		  autoid;
+
+   /* sort_keys, with a comparison function in STATE_COMPARE, and
+      canonical options */
+   int		  sort_keys;
+   int		  compare;
+   int		  canonical;
+
+   /* counters for the stats option, or NULL */
+   lyaml_stats	 *stats;
+} lyaml_dumper;
+
+
+/* Emit EVENT, or raise an error if it was not INITIALIZED successfully. */
+static void
+dumper_emit (lua_State *L, lyaml_dumper *dumper, yaml_event_t *event,
+             int initialized)
+{
+   int r = 0;
+
+   if (initialized && dumper->stats)
+   {
+      double start = lyaml_clock ();
+
+      /* the emitter deletes the event */
+      lyaml_stats_event (dumper->stats, event);
+      r = yaml_emitter_emit (&dumper->emitter, event);
+      dumper->stats->libyaml += lyaml_clock () - start;
+   }
+   else if (initialized)
+      r = yaml_emitter_emit (&dumper->emitter, event);
+
+   if (r != 1)
+   {
+      yaml_emitter_t *E = &dumper->emitter;
+
+      /* pass errors from the output sink through untouched */
+      if (lyaml_output_error (L, &dumper->output))
+         lua_error (L);
+      luaL_error (L, "%s", E->problem ? E->problem : "LibYAML call failed");
+   }
+}
+
+/* Return the anchor name of the value at IDX if it has already been
+   dumped once, or NULL. */
+static const char *
+dumper_get_alias (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   const char *r;
+
+   lua_rawgeti   (L, state, STATE_ALIASED);
+   lua_pushvalue (L, idx);
+   lua_rawget    (L, -2);
+   r = lua_tostring (L, -1);
+   lua_pop (L, 2);
+
+   if (r == NULL && dumper->auto_anchors)
+   {
+      lua_rawgeti   (L, state, STATE_AUTO);
+      lua_pushvalue (L, idx);
+      lua_rawget    (L, -2);
+      r = lua_tostring (L, -1);
+      lua_pop (L, 2);
+   }
+   return r;
+}
+
+/* Return the anchor name of the value at IDX if it has one, and move it
+   to the aliased table so that later references are dumped as aliases.
+   The name is kept alive by the aliased table. */
+static const char *
+dumper_get_anchor (lua_State *L, int state, int idx)
+{
+   const char *r;
+
+   lua_rawgeti   (L, state, STATE_ANCHORS);
+   lua_pushvalue (L, idx);
+   lua_rawget    (L, -2);
+   if (lua_isnil (L, -1))
+   {
+      lua_pop (L, 2);
+      return NULL;
+   }
+
+   lua_pushvalue (L, idx);
+   lua_pushnil   (L);
+   lua_rawset    (L, -4);
+
+   lua_rawgeti   (L, state, STATE_ALIASED);
+   lua_pushvalue (L, idx);
+   lua_pushvalue (L, -3);
+   lua_rawset    (L, -3);
+   lua_pop (L, 1);
+
+   r = lua_tostring (L, -1);
+   lua_pop (L, 2);
+   return r;
+}
+
+/* With auto_anchors, return a new anchor name for the table at IDX if
+   the current document refers to it more than once, or NULL.  Names
+   given in the anchors option are skipped, and the name is kept alive
+   by the generated anchors table. */
+static const char *
+dumper_auto_anchor (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   char name[32];
+   const char *r;
+   int taken;
+
+   if (!dumper->auto_anchors)
+      return NULL;
+
+   lua_rawgeti   (L, state, STATE_COUNTS);
+   lua_pushvalue (L, idx);
+   lua_rawget    (L, -2);
+   taken = lua_tointeger (L, -1) > 1;
+   lua_pop (L, 2);
+   if (!taken)
+      return NULL;
+
+   lua_rawgeti (L, state, STATE_NAMES);
+   do
+   {
+      sprintf (name, "id%03d", ++dumper->autoid);
+      lua_getfield (L, -1, name);
+      taken = !lua_isnil (L, -1);
+      lua_pop (L, 1);
+   }
+   while (taken);
+   lua_pop (L, 1);
+
+   lua_rawgeti     (L, state, STATE_AUTO);
+   lua_pushvalue   (L, idx);
+   lua_pushstring  (L, name);
+   r = lua_tostring (L, -1);
+   lua_rawset      (L, -3);
+   lua_pop (L, 1);
+   return r;
+}
+
+/* Count a reference to the value at IDX in the table at COUNTS, and
+   add it to the list of tables at PENDING if it is a table not seen
+   before. */
+static void
+dumper_count_value (lua_State *L, int counts, int pending, int *npending,
+                    int idx)
+{
+   lua_Integer n;
+
+   if (lua_type (L, idx) != LUA_TTABLE || lyaml_isnull (L, idx))
+      return;
+
+   lua_pushvalue (L, idx);
+   lua_rawget    (L, counts);
+   n = lua_tointeger (L, -1) + 1;
+   lua_pop (L, 1);
+   lua_pushvalue   (L, idx);
+   lua_pushinteger (L, n);
+   lua_rawset      (L, counts);
+   if (n == 1)
+   {
+      lua_pushvalue (L, idx);
+      lua_rawseti   (L, pending, ++*npending);
+   }
+}
+
+/* Count the references to each table reachable from the value at IDX
+   in the table at COUNTS, looking inside each table only once, so that
+   shared tables can be anchored before they are first dumped. */
+static void
+dumper_count (lua_State *L, int counts, int idx)
+{
+   int pending, npending = 0, table;
+
+   lua_newtable (L);
+   pending = lua_gettop (L);
+   dumper_count_value (L, counts, pending, &npending, idx);
+   while (npending > 0)
+   {
+      lua_rawgeti (L, pending, npending);
+      lua_pushnil (L);
+      lua_rawseti (L, pending, npending--);
+      table = lua_gettop (L);
+
+      lyaml_materialize (L, table);
+      lua_pushnil (L);
+      while (lua_next (L, table) != 0)
+      {
+         dumper_count_value (L, counts, pending, &npending, table + 1);
+         dumper_count_value (L, counts, pending, &npending, table + 2);
+         lua_pop (L, 1);
+      }
+      lua_pop (L, 1);
+   }
+   lua_pop (L, 1);
+}
+
+static int
+dumper_alias (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   const char *alias = dumper_get_alias (L, dumper, state, idx);
+   yaml_event_t event;
+
+   if (alias == NULL)
+      return 0;
+
+   dumper_emit (L, dumper, &event,
+      yaml_alias_event_initialize (&event, (yaml_char_t *) alias));
+   return 1;
+}
+
+/* Return the style to write the string at IDX in: with the default
+   schema, from the single scan of lyaml_scalar_style; or else quoted if
+   the implicit_scalar option resolves it to something else, and literal
+   if it has newlines. */
+static int
+dumper_string_style (lua_State *L, int state, int idx)
+{
+   size_t len;
+   const char *s = lua_tolstring (L, idx, &len);
+   int r;
+
+   lua_rawgeti (L, state, STATE_IMPLICIT);
+   if (lua_isnil (L, -1))
+   {
+      lua_pop (L, 1);
+      return lyaml_scalar_style (L, s, len);
+   }
+
+   lua_pushvalue (L, idx);
+   lua_call      (L, 1, 1);
+   r = !lua_rawequal (L, -1, idx);
+   lua_pop (L, 1);
+   if (r)
+      return YAML_SINGLE_QUOTED_SCALAR_STYLE;
+   if (memchr (s, '\n', len) != NULL)
+      return YAML_LITERAL_SCALAR_STYLE;
+   return YAML_PLAIN_SCALAR_STYLE;
+}
+
+static int
+dumper_style (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   double start;
+   int r;
+
+   if (dumper->stats == NULL)
+      return dumper_string_style (L, state, idx);
+
+   start = lyaml_clock ();
+   r = dumper_string_style (L, state, idx);
+   dumper->stats->resolve += lyaml_clock () - start;
+   return r;
+}
+
+/* Push the number at IDX with the same digits on every Lua version: in
+   full if it is a whole number that fits, or else the shortest of 15, 16
+   or 17 significant digits that reads back as the same number. */
+static void
+dumper_push_number (lua_State *L, int idx)
+{
+   lua_Number n = lua_tonumber (L, idx);
+   char buf[64], *p;
+   int prec;
+
+#if LUA_VERSION_NUM >= 503
+   if (lua_isinteger (L, idx))
+   {
+      /* integers are written in full by tostring already */
+      lua_pushvalue (L, idx);
+      lua_tostring  (L, -1);
+      return;
+   }
+#endif
+   if (n == floor (n) && fabs (n) < 9007199254740992.0)	/* 2^53 */
+      snprintf (buf, sizeof (buf), "%.0f", n);
+   else
+   {
+      for (prec = 15; prec < 17; prec++)
+      {
+         snprintf (buf, sizeof (buf), "%.*g", prec, n);
+         if (strtod (buf, NULL) == n)
+            break;
+      }
+      if (prec == 17)
+         snprintf (buf, sizeof (buf), "%.17g", n);
+   }
+
+   /* whatever the decimal point of the current locale */
+   for (p = buf; *p != '\0'; p++)
+      if (!isdigit ((unsigned char) *p) && *p != '-' && *p != '+' && *p != 'e')
+         *p = '.';
+   lua_pushstring (L, buf);
+}
+
+static void
+dumper_null (lua_State *L, lyaml_dumper *dumper)
+{
+   yaml_event_t event;
+
+   dumper_emit (L, dumper, &event,
+      yaml_scalar_event_initialize (&event, NULL, NULL, (yaml_char_t *) "~",
+         1, 1, 1, YAML_PLAIN_SCALAR_STYLE));
+}
+
+static void
+dumper_scalar (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   yaml_scalar_style_t style = YAML_PLAIN_SCALAR_STYLE;
+   yaml_event_t event;
+   const char *anchor, *value;
+   size_t len;
+   int itsa = lua_type (L, idx);
+
+   if (dumper_alias (L, dumper, state, idx))
+      return;
+
+   anchor = dumper_get_anchor (L, state, idx);
+   if (itsa == LUA_TSTRING)
+   {
+      /* take care to round-trip strings that look like scalars */
+      style = (yaml_scalar_style_t) dumper_style (L, dumper, state, idx);
+      lua_pushvalue (L, idx);
+   }
+   else if (itsa == LUA_TNUMBER && lua_tonumber (L, idx) == HUGE_VAL)
+      lua_pushliteral (L, ".inf");
+   else if (itsa == LUA_TNUMBER && lua_tonumber (L, idx) == -HUGE_VAL)
+      lua_pushliteral (L, "-.inf");
+   else if (itsa == LUA_TNUMBER && lua_tonumber (L, idx) != lua_tonumber (L, idx))
+      lua_pushliteral (L, ".nan");
+   else if (itsa == LUA_TNUMBER && dumper->canonical)
+      dumper_push_number (L, idx);
+   else if (itsa == LUA_TNUMBER)
+   {
+      /* convert a copy, so that lua_next keys are not disturbed */
+      lua_pushvalue (L, idx);
+      lua_tostring  (L, -1);
+   }
+   else /* LUA_TBOOLEAN */
+      lua_pushstring (L, lua_toboolean (L, idx) ? "true" : "false");
+
+   value = lua_tolstring (L, -1, &len);
+   dumper_emit (L, dumper, &event,
+      yaml_scalar_event_initialize (&event, (yaml_char_t *) anchor, NULL,
+         (yaml_char_t *) value, (int) len, 1, 1, style));
+   lua_pop (L, 1);
+}
+
+/* Describe the key at IDX, the POSth in the list of keys, in KEY. */
+static void
+dumper_describe_key (lua_State *L, int idx, int pos, lyaml_key *key)
+{
+   memset ((void *) key, 0, sizeof (*key));
+   key->pos = pos;
+   switch (lua_type (L, idx))
+   {
+      case LUA_TBOOLEAN:
+         key->rank = KEY_BOOLEAN;
+         key->n = lua_toboolean (L, idx);
+         break;
+      case LUA_TNUMBER:
+         key->rank = KEY_NUMBER;
+         key->n = lua_tonumber (L, idx);
+#if LUA_VERSION_NUM >= 503
+         key->isint = lua_isinteger (L, idx);
+         key->i = lua_tointeger (L, idx);
+#endif
+         break;
+      case LUA_TSTRING:
+         key->rank = KEY_STRING;
+         key->s = lua_tolstring (L, idx, &key->len);
+         break;
+      default:
+         key->rank = KEY_OTHER;
+   }
+}
+
+/* Return 1 if key A sorts before key B, whose values are in the list of
+   keys at index KEYS. */
+static int
+dumper_key_less (lua_State *L, lyaml_dumper *dumper, int state, int keys,
+                 const lyaml_key *a, const lyaml_key *b)
+{
+   int r;
+
+   if (dumper->compare)
+   {
+      lua_rawgeti (L, state, STATE_COMPARE);
+      lua_rawgeti (L, keys, a->pos);
+      lua_rawgeti (L, keys, b->pos);
+      lua_call    (L, 2, 1);
+      r = lua_toboolean (L, -1);
+      lua_pop (L, 1);
+      return r;
+   }
+
+   if (a->rank != b->rank)
+      return a->rank < b->rank;
+   switch (a->rank)
+   {
+      case KEY_BOOLEAN:
+         return a->n < b->n;
+      case KEY_NUMBER:
+         if (a->isint && b->isint)
+            return a->i < b->i;
+         return a->n < b->n;
+      case KEY_STRING:
+         r = memcmp (a->s, b->s, a->len < b->len ? a->len : b->len);
+         return r < 0 || (r == 0 && a->len < b->len);
+      default:
+         return 0;
+   }
+}
+
+/* Stable merge sort of the N keys in KEY, using the N more after them
+   as scratch space. */
+static void
+dumper_sort_keys (lua_State *L, lyaml_dumper *dumper, int state, int keys,
+                  lyaml_key *key, int n)
+{
+   lyaml_key *from = key, *to = key + n, *t;
+   int width, lo, i, j, k, mid, hi;
+
+   for (width = 1; width < n; width *= 2)
+   {
+      for (lo = 0; lo < n; lo += 2 * width)
+      {
+         mid = lo + width < n ? lo + width : n;
+         hi  = lo + 2 * width < n ? lo + 2 * width : n;
+         for (i = lo, j = mid, k = lo; k < hi; k++)
+         {
+            if (i < mid && (j >= hi ||
+                !dumper_key_less (L, dumper, state, keys, &from[j], &from[i])))
+               to[k] = from[i++];
+            else
+               to[k] = from[j++];
+         }
+      }
+      t = from, from = to, to = t;
+   }
+   if (from != key)
+      memcpy (key, from, n * sizeof (*key));
+}
+
+/* Push a list of the keys of the mapping at IDX in the order of the
+   sort_keys option, and return how many there are. */
+static int
+dumper_sorted_keys (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   lyaml_key *key;
+   int keys, n = 0, i;
+
+   lua_newtable (L);
+   keys = lua_gettop (L);
+   lua_pushnil (L);
+   while (lua_next (L, idx) != 0)
+   {
+      lua_pop (L, 1);
+      lua_pushvalue (L, -1);
+      lua_rawseti (L, keys, ++n);
+   }
+
+   /* a userdatum, so that it is collected if a comparison fails */
+   key = (lyaml_key *) lua_newuserdata (L, 2 * (n ? n : 1) * sizeof (*key));
+   for (i = 0; i < n; i++)
+   {
+      lua_rawgeti (L, keys, i + 1);
+      dumper_describe_key (L, -1, i + 1, &key[i]);
+      lua_pop (L, 1);	/* strings are still held by the key list */
+   }
+   dumper_sort_keys (L, dumper, state, keys, key, n);
+
+   lua_createtable (L, n, 0);
+   for (i = 0; i < n; i++)
+   {
+      lua_rawgeti (L, keys, key[i].pos);
+      lua_rawseti (L, -2, i + 1);
+   }
+   lua_replace (L, keys);
+   lua_pop (L, 1);
+   return n;
+}
+
+/* Open a frame for the table at IDX, whose start event has just been
+   emitted, and return it. */
+static lyaml_dump_frame *
+dumper_push_frame (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   lyaml_dump_frame *frame;
+   int slot;
+
+   /* a table inside itself, without an anchor, would nest forever */
+   lua_rawgeti   (L, state, STATE_OPEN);
+   lua_pushvalue (L, idx);
+   lua_rawget    (L, -2);
+   if (!lua_isnil (L, -1))
+      luaL_error (L, "too many nested tables to dump");
+   lua_pop (L, 1);
+   lua_pushvalue   (L, idx);
+   lua_pushboolean (L, 1);
+   lua_rawset      (L, -3);
+   lua_pop (L, 1);
+
+   if (dumper->depth == dumper->nframes)
+   {
+      int n = dumper->nframes ? 2 * dumper->nframes : 16;
+      lyaml_dump_frame *frames = (lyaml_dump_frame *)
+         realloc (dumper->frames, n * sizeof (*frames));
+
+      if (frames == NULL)
+         luaL_error (L, "cannot allocate dumper stack");
+      dumper->frames = frames;
+      dumper->nframes = n;
+   }
+
+   frame = dumper->frames + dumper->depth++;
+   memset ((void *) frame, 0, sizeof (*frame));
+   slot = STATE_FRAMES + 2 * (dumper->depth - 1);
+   lua_pushvalue (L, idx);
+   lua_rawseti   (L, state, slot);
+   return frame;
+}
+
+/* Emit the end of the innermost open table, and close its frame. */
+static void
+dumper_pop_frame (lua_State *L, lyaml_dumper *dumper, int state)
+{
+   int slot = STATE_FRAMES + 2 * (dumper->depth - 1);
+   yaml_event_t event;
+
+   if (dumper->frames[dumper->depth - 1].mapping)
+      dumper_emit (L, dumper, &event, yaml_mapping_end_event_initialize (&event));
+   else
+      dumper_emit (L, dumper, &event, yaml_sequence_end_event_initialize (&event));
+
+   lua_rawgeti (L, state, STATE_OPEN);
+   lua_rawgeti (L, state, slot);
+   lua_pushnil (L);
+   lua_rawset  (L, -3);
+   lua_pop (L, 1);
+
+   lua_pushnil (L);
+   lua_rawseti (L, state, slot);
+   lua_pushnil (L);
+   lua_rawseti (L, state, slot + 1);
+   dumper->depth--;
+}
+
+/* Start the table at IDX as a mapping. */
+static void
+dumper_mapping (lua_State *L, lyaml_dumper *dumper, int state, int idx,
+                yaml_mapping_style_t style)
+{
+   lyaml_dump_frame *frame;
+   yaml_event_t event;
+   const char *anchor;
+
+   if (dumper_alias (L, dumper, state, idx))
+      return;
+
+   anchor = dumper_get_anchor (L, state, idx);
+   if (anchor == NULL)
+      anchor = dumper_auto_anchor (L, dumper, state, idx);
+   dumper_emit (L, dumper, &event,
+      yaml_mapping_start_event_initialize (&event, (yaml_char_t *) anchor,
+         NULL, 1, style));
+
+   frame = dumper_push_frame (L, dumper, state, idx);
+   frame->mapping = 1;
+   if (dumper->sort_keys)
+   {
+      frame->n = dumper_sorted_keys (L, dumper, state, idx);
+      lua_rawseti (L, state, STATE_FRAMES + 2 * dumper->depth - 1);
+   }
+}
+
+/* Start the table at IDX as a sequence of elements 1 to N, with nulls
+   for any holes left by a __yaml shape. */
+static void
+dumper_sequence (lua_State *L, lyaml_dumper *dumper, int state, int idx,
+                 lua_Integer n, yaml_sequence_style_t style)
+{
+   yaml_event_t event;
+   const char *anchor;
+
+   if (dumper_alias (L, dumper, state, idx))
+      return;
+
+   anchor = dumper_get_anchor (L, state, idx);
+   if (anchor == NULL)
+      anchor = dumper_auto_anchor (L, dumper, state, idx);
+   dumper_emit (L, dumper, &event,
+      yaml_sequence_start_event_initialize (&event, (yaml_char_t *) anchor,
+         NULL, 1, style));
+
+   dumper_push_frame (L, dumper, state, idx)->n = n;
+}
+
+/* Return the shape of the table at IDX, setting *N to its border.
+   Without a __yaml metatable field, something is only a sequence if its
+   keys are distinct whole numbers from 1 up to the border, and there are
+   as many of them as that. */
+static int
+dumper_shape (lua_State *L, int idx, lua_Integer *n)
+{
+   lua_Integer count = 0;
+   lua_Number k;
+   int shape;
+
+   *n = (lua_Integer) lua_objlen (L, idx);
+   if (luaL_getmetafield (L, idx, "__yaml"))
+   {
+      for (shape = 0; shape_names[shape] != NULL; shape++)
+         if (lua_type (L, -1) == LUA_TSTRING &&
+             STREQ (lua_tostring (L, -1), shape_names[shape]))
+            break;
+      if (shape_names[shape] == NULL)
+         luaL_error (L, "__yaml must be 'seq', 'map', 'flow_seq' or 'flow_map'");
+      lua_pop (L, 1);
+      return shape;
+   }
+
+   lua_pushnil (L);
+   while (lua_next (L, idx) != 0)
+   {
+      lua_pop (L, 1);
+      if (lua_type (L, -1) != LUA_TNUMBER ||
+          (k = lua_tonumber (L, -1)) < 1 || k > (lua_Number) *n ||
+          k != floor (k))
+      {
+         lua_pop (L, 1);
+         return SHAPE_MAP;
+      }
+      count++;
+   }
+   return count == *n ? SHAPE_SEQ : SHAPE_MAP;
+}
+
+/* Emit the events for the value at IDX, or just the start of it if it is
+   a table, whose contents are then dumped by dumper_step. */
+static void
+dumper_node (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   int itsa = lua_type (L, idx);
+   lua_Integer n;
+
+   if (lyaml_isnull (L, idx))
+      dumper_null (L, dumper);
+   else if (itsa == LUA_TSTRING || itsa == LUA_TBOOLEAN || itsa == LUA_TNUMBER)
+      dumper_scalar (L, dumper, state, idx);
+   else if (itsa == LUA_TTABLE)
+   {
+      lyaml_materialize (L, idx);
+      switch (dumper_shape (L, idx, &n))
+      {
+         case SHAPE_SEQ:
+            dumper_sequence (L, dumper, state, idx, n,
+                             YAML_BLOCK_SEQUENCE_STYLE);
+            break;
+         case SHAPE_FLOW_SEQ:
+            dumper_sequence (L, dumper, state, idx, n,
+                             YAML_FLOW_SEQUENCE_STYLE);
+            break;
+         case SHAPE_FLOW_MAP:
+            dumper_mapping (L, dumper, state, idx, YAML_FLOW_MAPPING_STYLE);
+            break;
+         default:
+            dumper_mapping (L, dumper, state, idx, YAML_BLOCK_MAPPING_STYLE);
+      }
+   }
+   else /* unsupported Lua type */
+      luaL_error (L, "cannot dump object of type '%s'", lua_typename (L, itsa));
+}
+
+/* Push the next key of the mapping in FRAME, whose table is at TABLE and
+   whose slots in the state table start at SLOT, and return 1; or return 0
+   if there are no more. */
+static int
+dumper_next_key (lua_State *L, lyaml_dumper *dumper, lyaml_dump_frame *frame,
+                 int state, int slot, int table)
+{
+   if (dumper->sort_keys)
+   {
+      if (frame->i == frame->n)
+         return 0;
+      lua_rawgeti (L, state, slot + 1);
+      lua_rawgeti (L, -1, (int) ++frame->i);
+      lua_remove  (L, -2);
+      return 1;
+   }
+
+   lua_rawgeti (L, state, slot + 1);
+   if (lua_next (L, table) == 0)
+      return 0;
+   lua_pop (L, 1);
+   lua_pushvalue (L, -1);
+   lua_rawseti   (L, state, slot + 1);
+   return 1;
+}
+
+/* Dump the next element of the innermost open table, or close it if
+   there are no more. */
+static void
+dumper_step (lua_State *L, lyaml_dumper *dumper, int state)
+{
+   lyaml_dump_frame *frame = dumper->frames + dumper->depth - 1;
+   int slot = STATE_FRAMES + 2 * (dumper->depth - 1);
+   int table = lua_gettop (L) + 1;
+
+   lua_rawgeti (L, state, slot);
+   if (!frame->mapping)
+   {
+      if (frame->i == frame->n)
+         dumper_pop_frame (L, dumper, state);
+      else
+      {
+         lua_rawgeti (L, table, (int) ++frame->i);
+         if (lua_isnil (L, -1))
+            dumper_null (L, dumper);
+         else
+            dumper_node (L, dumper, state, table + 1);
+      }
+   }
+   else if (frame->value)
+   {
+      frame->value = 0;
+      lua_rawgeti (L, state, slot + 1);
+      if (dumper->sort_keys)
+      {
+         lua_rawgeti (L, -1, (int) frame->i);
+         lua_remove  (L, -2);
+      }
+      lua_rawget (L, table);
+      dumper_node (L, dumper, state, table + 1);
+   }
+   else if (dumper_next_key (L, dumper, frame, state, slot, table))
+   {
+      frame->value = 1;
+      dumper_node (L, dumper, state, table + 1);
+   }
+   else
+      dumper_pop_frame (L, dumper, state);
+   lua_settop (L, table - 1);
+}
+
+/* Decompose the document at IDX into a stream of events. */
+static void
+dumper_document (lua_State *L, lyaml_dumper *dumper, int state, int idx)
+{
+   dumper_node (L, dumper, state, idx);
+   while (dumper->depth > 0)
+      dumper_step (L, dumper, state);
+}
+
+static int
+append_output (void *arg, unsigned char *buff, size_t len)
+{
+   lyaml_dumper *dumper = (lyaml_dumper *) arg;
+   luaL_addlstring (&dumper->yamlbuff, (char *) buff, len);
+   dumper->yamllen += len;
+   return 1;
+}
+
+static int
+dumper_gc (lua_State *L)
+{
+   lyaml_dumper *dumper = (lyaml_dumper *) lua_touserdata (L, 1);
+
+   if (dumper)
+   {
+      yaml_emitter_delete (&dumper->emitter);
+      lyaml_output_delete (L, &dumper->output);
+      free (dumper->frames);
+      dumper->frames = NULL;
+   }
+   return 0;
+}
+
+void
+dumper_init (lua_State *L)
+{
+   luaL_newmetatable (L, "lyaml.dumper");
+   lua_pushcfunction (L, dumper_gc);
+   lua_setfield      (L, -2, "__gc");
+}
+
+static int
+dumper_dump (lua_State *L)
+{
+   lyaml_dumper *dumper;
+   lyaml_tape *tape;
+   yaml_event_t event;
+   int state, i;
+
+   /* requires a list of documents or a tape, and an optional options
+      table */
+   if ((tape = lyaml_totape (L, 1)) == NULL)
+      luaL_checktype (L, 1, LUA_TTABLE);
+   if (!lua_isnoneornil (L, 2))
+      luaL_checktype (L, 2, LUA_TTABLE);
+   lua_settop (L, 2);
+
+   /* create a user datum to store the emitter */
+   dumper = (lyaml_dumper *) lua_newuserdata (L, sizeof (*dumper));
+   memset ((void *) dumper, 0, sizeof (*dumper));
+   dumper->output.sink = dumper->output.error = LUA_NOREF;
+   dumper->stats = lyaml_tostats (L);
+
+   /* set its metatable */
+   luaL_getmetatable (L, "lyaml.dumper");
+   lua_setmetatable  (L, -2);
+
+   /* try to initialize the emitter */
+   if (!yaml_emitter_initialize (&dumper->emitter))
+   {
+      if (!dumper->emitter.problem)
+         dumper->emitter.problem = "cannot initialize emitter";
+      return luaL_error (L, "%s", dumper->emitter.problem);
+   }
+   yaml_emitter_set_unicode (&dumper->emitter, 1);
+   yaml_emitter_set_width   (&dumper->emitter, 2);
+
+   /* create the state table, and copy in the options */
+   lua_createtable (L, STATE_FRAMES + 2 * 16, 0);
+   state = lua_gettop (L);
+   lua_newtable (L);
+   lua_rawseti  (L, state, STATE_OPEN);
+
+   lua_newtable (L);
+   if (lua_istable (L, 2))
+   {
+      lua_getfield (L, 2, "auto_anchors");
+      dumper->auto_anchors = lua_toboolean (L, -1);
+      lua_pop (L, 1);
+
+      lua_getfield (L, 2, "canonical");
+      dumper->canonical = lua_toboolean (L, -1);
+      lua_pop (L, 1);
+
+      lua_getfield (L, 2, "sort_keys");
+      if (lua_isfunction (L, -1))
+      {
+         dumper->sort_keys = dumper->compare = 1;
+         lua_rawseti (L, state, STATE_COMPARE);
+      }
+      else
+      {
+         if (!lua_isnil (L, -1) && !lua_isboolean (L, -1))
+            return luaL_error (L, "sort_keys must be a boolean or function");
+         dumper->sort_keys = lua_toboolean (L, -1) || dumper->canonical;
+         lua_pop (L, 1);
+      }
+
+      lua_getfield (L, 2, "anchors");
+      if (lua_istable (L, -1))
+      {
+         /* map values to their anchor names */
+         lua_pushnil (L);
+         while (lua_next (L, -2) != 0)
+         {
+            lua_pushvalue (L, -2);
+            lua_tostring  (L, -1);
+            lua_rawset    (L, -5);
+         }
+      }
+      if (dumper->auto_anchors)
+      {
+         /* generated names must not clash with these */
+         if (!lua_istable (L, -1))
+         {
+            lua_pop (L, 1);
+            lua_newtable (L);
+         }
+         lua_rawseti (L, state, STATE_NAMES);
+      }
+      else
+         lua_pop (L, 1);
+
+      lyaml_push_implicit (L, 2);
+      lua_rawseti  (L, state, STATE_IMPLICIT);
+   }
+   lua_rawseti  (L, state, STATE_ANCHORS);
+   lua_newtable (L);
+   lua_rawseti  (L, state, STATE_ALIASED);
+
+   /* Send output to the sink option... */
+   if (lua_istable (L, 2))
+      lua_getfield (L, 2, "sink");
+   else
+      lua_pushnil (L);
+   if (!lua_isnil (L, -1))
+      lyaml_output_set (L, lua_gettop (L), &dumper->emitter, &dumper->output,
+                        lyaml_flush_bytes (L, 2));
+   else
+   {
+      /* ...or create a thread for the YAML buffer, and keep it in the state
+         table so that it is not collected before we're done with it. */
+      dumper->outputL = lua_newthread (L);
+      luaL_buffinit (dumper->outputL, &dumper->yamlbuff);
+      lua_rawseti (L, state, STATE_OUTPUT);
+      yaml_emitter_set_output (&dumper->emitter, &append_output, dumper);
+   }
+   lua_pop (L, 1);
+
+   if (tape != NULL)
+   {
+      size_t t, n = lyaml_tape_length (tape);
+
+      /* replay the recorded events, stream start and end included */
+      for (t = 0; t < n; t++)
+         dumper_emit (L, dumper, &event,
+            lyaml_tape_initialize_event (tape, t, &event));
+   }
+   else
+   {
+      dumper_emit (L, dumper, &event,
+         yaml_stream_start_event_initialize (&event, YAML_UTF8_ENCODING));
+
+      for (i = 1;; i++)
+      {
+         lua_rawgeti (L, 1, i);
+         if (lua_isnil (L, -1))
+         {
+            lua_pop (L, 1);
+            break;
+         }
+
+         if (dumper->auto_anchors)
+         {
+            /* generated anchors only last until the end of the document */
+            lua_newtable (L);
+            dumper_count (L, lua_gettop (L), lua_gettop (L) - 1);
+            lua_rawseti  (L, state, STATE_COUNTS);
+            lua_newtable (L);
+            lua_rawseti  (L, state, STATE_AUTO);
+            dumper->autoid = 0;
+         }
+
+         dumper_emit (L, dumper, &event,
+            yaml_document_start_event_initialize (&event, NULL, NULL, NULL, 0));
+         dumper_document (L, dumper, state, lua_gettop (L));
+         dumper_emit (L, dumper, &event,
+            yaml_document_end_event_initialize (&event, 0));
+         lua_pop (L, 1);
+      }
+
+      dumper_emit (L, dumper, &event, yaml_stream_end_event_initialize (&event));
+   }
+
+   if (dumper->stats)
+      dumper->stats->bytes = dumper->output.bytes + dumper->yamllen;
+
+   if (dumper->output.sink != LUA_NOREF)
+   {
+      if (!lyaml_output_flush (&dumper->output))
+      {
+         lyaml_output_error (L, &dumper->output);
+         return lua_error (L);
+      }
+      return 0;
+   }
+
+   luaL_pushresult (&dumper->yamlbuff);
+   lua_xmove (dumper->outputL, L, 1);
+   return 1;
+}
+
+int
+Pdump (lua_State *L)
+{
+   return lyaml_stats_call (L, dumper_dump);
+}
@@ -35,42 +35,130 @@ typedef struct {
    lua_State	   *outputL;
    luaL_Buffer	    yamlbuff;
 
+   /* output sink, instead of the accumulator */
+   lyaml_output	    output;
+
    /* error handling */
    lua_State	   *errL;
    luaL_Buffer	    errbuff;
    int		    error;
 } lyaml_emitter;
 
+/* Names of the values of an enumerated event field, which can also be
+   given as the integer code exported by the yaml module. */
+typedef struct {
+   const char *name;
+   int	       code;
+} lyaml_code;
+
+static const lyaml_code event_types[] = {
+#define MENTRY(_s)	{#_s, YAML_##_s##_EVENT}
+   /* Minimize comparisons by putting more common types earlier. */
+   MENTRY( SCALAR		),
+   MENTRY( MAPPING_START	),
+   MENTRY( MAPPING_END		),
+   MENTRY( SEQUENCE_START	),
+   MENTRY( SEQUENCE_END		),
+   MENTRY( DOCUMENT_START	),
+   MENTRY( DOCUMENT_END		),
+   MENTRY( STREAM_START		),
+   MENTRY( STREAM_END		),
+   MENTRY( ALIAS		),
+#undef MENTRY
+   {NULL, 0}
+};
+
+static const lyaml_code encodings[] = {
+#define MENTRY(_s)	{#_s, YAML_##_s##_ENCODING}
+   MENTRY( UTF8		),
+   MENTRY( UTF16LE	),
+   MENTRY( UTF16BE	),
+   MENTRY( ANY		),
+#undef MENTRY
+   {NULL, 0}
+};
+
+static const lyaml_code scalar_styles[] = {
+#define MENTRY(_s)	{#_s, YAML_##_s##_SCALAR_STYLE}
+   MENTRY( PLAIN		),
+   MENTRY( SINGLE_QUOTED	),
+   MENTRY( DOUBLE_QUOTED	),
+   MENTRY( LITERAL		),
+   MENTRY( FOLDED		),
+   MENTRY( ANY			),
+#undef MENTRY
+   {NULL, 0}
+};
+
+/* sequences and mappings number their styles alike */
+static const lyaml_code collection_styles[] = {
+#define MENTRY(_s)	{#_s, YAML_##_s##_SEQUENCE_STYLE}
+   MENTRY( BLOCK	),
+   MENTRY( FLOW		),
+   MENTRY( ANY		),
+#undef MENTRY
+   {NULL, 0}
+};
+
 
-/* Emit a STREAM_START event. */
+/* Return the code of field K in the event table on top of the stack,
+   given by name or by number, or DFLT if it is not set.  Otherwise
+   report an invalid WHAT, and return -1. */
 static int
-emit_STREAM_START (lua_State *L, lyaml_emitter *emitter)
+emitter_getcode (lua_State *L, lyaml_emitter *emitter, const char *k,
+                 const lyaml_code *codes, int dflt, const char *what)
 {
-   yaml_event_t event;
-   yaml_encoding_t yaml_encoding;
-   const char *encoding = NULL;
+   int i, r = -1;
+
+   lua_pushstring (L, k);
+   lua_rawget     (L, -2);
+   if (lua_isnil (L, -1))
+      r = dflt;
+   else if (lua_type (L, -1) == LUA_TNUMBER)
+   {
+      lua_Integer n = lua_tointeger (L, -1);
 
-   RAWGET_STRDUP (encoding); lua_pop (L, 1);
+      for (i = 0; codes[i].name != NULL; i++)
+         if (codes[i].code == n && n == lua_tonumber (L, -1))
+            r = codes[i].code;
+   }
+   else if (lua_type (L, -1) == LUA_TSTRING)
+   {
+      const char *name = lua_tostring (L, -1);
+
+      for (i = 0; r < 0 && codes[i].name != NULL; i++)
+         if (STREQ (name, codes[i].name))
+            r = codes[i].code;
+   }
 
-#define MENTRY(_s) (STREQ (encoding, #_s)) { yaml_encoding = YAML_##_s##_ENCODING; }
-   if (encoding == NULL) { yaml_encoding = YAML_ANY_ENCODING; } else
-   if MENTRY( UTF8	) else
-   if MENTRY( UTF16LE	) else
-   if MENTRY( UTF16BE	) else
+   if (r < 0)
    {
+      const char *value = lua_tostring (L, -1);
+
       emitter->error++;
-      luaL_addsize (&emitter->errbuff,
-                    sprintf (luaL_prepbuffer (&emitter->errbuff),
-                             "invalid stream encoding '%s'", encoding));
+      luaL_addstring (&emitter->errbuff, "invalid ");
+      luaL_addstring (&emitter->errbuff, what);
+      luaL_addstring (&emitter->errbuff, " '");
+      luaL_addstring (&emitter->errbuff, value ? value : luaL_typename (L, -1));
+      luaL_addstring (&emitter->errbuff, "'");
    }
-#undef MENTRY
+   lua_pop (L, 1);
+   return r;
+}
+
 
-   if (encoding) free ((void *) encoding);
+/* Emit a STREAM_START event. */
+static int
+emit_STREAM_START (lua_State *L, lyaml_emitter *emitter)
+{
+   yaml_event_t event;
+   int encoding = emitter_getcode (L, emitter, "encoding", encodings,
+                                   YAML_ANY_ENCODING, "stream encoding");
 
    if (emitter->error != 0)
      return 0;
 
-   yaml_stream_start_event_initialize (&event, yaml_encoding);
+   yaml_stream_start_event_initialize (&event, (yaml_encoding_t) encoding);
    return yaml_emitter_emit (&emitter->emitter, &event);
 }
 
@@ -165,30 +253,20 @@ static int
 emit_MAPPING_START (lua_State *L, lyaml_emitter *emitter)
 {
    yaml_event_t event;
-   yaml_mapping_style_t yaml_style;
    yaml_char_t *anchor = NULL, *tag = NULL;
    int implicit = 1;
-   const char *style = NULL;
-
-   RAWGET_STRDUP (style);  lua_pop (L, 1);
+   int style = emitter_getcode (L, emitter, "style", collection_styles,
+                                YAML_ANY_MAPPING_STYLE, "mapping style");
 
-#define MENTRY(_s) (STREQ (style, #_s)) { yaml_style = YAML_##_s##_MAPPING_STYLE; }
-   if (style == NULL) { yaml_style = YAML_ANY_MAPPING_STYLE; } else
-   if MENTRY( BLOCK	) else
-   if MENTRY( FLOW	) else
-   {
-      emitter->error++;
-      luaL_addsize (&emitter->errbuff,
-                    sprintf (luaL_prepbuffer (&emitter->errbuff),
-                             "invalid mapping style '%s'", style));
-   }
-#undef MENTRY
+   if (style < 0)
+      return 0;
 
    RAWGET_YAML_CHARP (anchor); lua_pop (L, 1);
    RAWGET_YAML_CHARP (tag);    lua_pop (L, 1);
    RAWGET_BOOLEAN (implicit);  lua_pop (L, 1);
 
-   yaml_mapping_start_event_initialize (&event, anchor, tag, implicit, yaml_style);
+   yaml_mapping_start_event_initialize (&event, anchor, tag, implicit,
+      (yaml_mapping_style_t) style);
    return yaml_emitter_emit (&emitter->emitter, &event);
 }
 
@@ -208,30 +286,20 @@ static int
 emit_SEQUENCE_START (lua_State *L, lyaml_emitter *emitter)
 {
    yaml_event_t event;
-   yaml_sequence_style_t yaml_style;
    yaml_char_t *anchor = NULL, *tag = NULL;
    int implicit = 1;
-   const char *style = NULL;
-
-   RAWGET_STRDUP (style);  lua_pop (L, 1);
+   int style = emitter_getcode (L, emitter, "style", collection_styles,
+                                YAML_ANY_SEQUENCE_STYLE, "sequence style");
 
-#define MENTRY(_s) (STREQ (style, #_s)) { yaml_style = YAML_##_s##_SEQUENCE_STYLE; }
-   if (style == NULL) { yaml_style = YAML_ANY_SEQUENCE_STYLE; } else
-   if MENTRY( BLOCK	) else
-   if MENTRY( FLOW	) else
-   {
-      emitter->error++;
-      luaL_addsize (&emitter->errbuff,
-                    sprintf (luaL_prepbuffer (&emitter->errbuff),
-                             "invalid sequence style '%s'", style));
-   }
-#undef MENTRY
+   if (style < 0)
+      return 0;
 
    RAWGET_YAML_CHARP (anchor); lua_pop (L, 1);
    RAWGET_YAML_CHARP (tag);    lua_pop (L, 1);
    RAWGET_BOOLEAN (implicit);  lua_pop (L, 1);
 
-   yaml_sequence_start_event_initialize (&event, anchor, tag, implicit, yaml_style);
+   yaml_sequence_start_event_initialize (&event, anchor, tag, implicit,
+      (yaml_sequence_style_t) style);
    return yaml_emitter_emit (&emitter->emitter, &event);
 }
 
@@ -251,27 +319,13 @@ static int
 emit_SCALAR (lua_State *L, lyaml_emitter *emitter)
 {
    yaml_event_t event;
-   yaml_scalar_style_t yaml_style;
    yaml_char_t *anchor = NULL, *tag = NULL, *value;
    int length = 0, plain_implicit = 1, quoted_implicit = 1;
-   const char *style = NULL;
-
-   RAWGET_STRDUP (style);  lua_pop (L, 1);
+   int style = emitter_getcode (L, emitter, "style", scalar_styles,
+                                YAML_ANY_SCALAR_STYLE, "scalar style");
 
-#define MENTRY(_s) (STREQ (style, #_s)) { yaml_style = YAML_##_s##_SCALAR_STYLE; }
-   if (style == NULL) { yaml_style = YAML_ANY_SCALAR_STYLE; } else
-   if MENTRY( PLAIN		) else
-   if MENTRY( SINGLE_QUOTED	) else
-   if MENTRY( DOUBLE_QUOTED	) else
-   if MENTRY( LITERAL		) else
-   if MENTRY( FOLDED		) else
-   {
-      emitter->error++;
-      luaL_addsize (&emitter->errbuff,
-                    sprintf (luaL_prepbuffer (&emitter->errbuff),
-                             "invalid scalar style '%s'", style));
-   }
-#undef MENTRY
+   if (style < 0)
+      return 0;
 
    RAWGET_YAML_CHARP (anchor); lua_pop (L, 1);
    RAWGET_YAML_CHARP (tag);    lua_pop (L, 1);
@@ -280,7 +334,7 @@ emit_SCALAR (lua_State *L, lyaml_emitter *emitter)
    RAWGET_BOOLEAN (quoted_implicit);
 
    yaml_scalar_event_initialize (&event, anchor, tag, value, length,
-      plain_implicit, quoted_implicit, yaml_style);
+      plain_implicit, quoted_implicit, (yaml_scalar_style_t) style);
    return yaml_emitter_emit (&emitter->emitter, &event);
 }
 
@@ -299,65 +353,73 @@ emit_ALIAS (lua_State *L, lyaml_emitter *emitter)
 }
 
 
+/* Emit the event table on top of the stack.  Return 0 if it failed,
+   with the message in the error buffer, and set *FINALIZE after a
+   STREAM_END event.  Leaves the stack unbalanced. */
 static int
-emit (lua_State *L)
+emitter_event (lua_State *L, lyaml_emitter *emitter, int *finalize)
 {
-   lyaml_emitter *emitter;
    int yaml_ok = 0;
-   int finalize = 0;
-
-   luaL_argcheck (L, lua_istable (L, 1), 1, "expected table");
-
-   emitter = (lyaml_emitter *) lua_touserdata (L, lua_upvalueindex (1));
+   int type = emitter_getcode (L, emitter, "type", event_types,
+                               YAML_NO_EVENT, "event type");
 
+   switch (type)
    {
-     const char *type;
-
-     RAWGET_STRDUP (type); lua_pop (L, 1);
-
-     if (type == NULL)
-     {
-        emitter->error++;
-        luaL_addstring (&emitter->errbuff, "no type field in event table");
-     }
-#define MENTRY(_s) (STREQ (type, #_s)) { yaml_ok = emit_##_s (L, emitter); }
-     /* Minimize comparisons by putting more common types earlier. */
-     else if MENTRY( SCALAR		)
-     else if MENTRY( MAPPING_START	)
-     else if MENTRY( MAPPING_END	)
-     else if MENTRY( SEQUENCE_START	)
-     else if MENTRY( SEQUENCE_END	)
-     else if MENTRY( DOCUMENT_START	)
-     else if MENTRY( DOCUMENT_END	)
-     else if MENTRY( STREAM_START	)
-     else if MENTRY( STREAM_END		)
-     else if MENTRY( ALIAS		)
+#define MENTRY(_s)	\
+      case YAML_##_s##_EVENT: yaml_ok = emit_##_s (L, emitter); break
+      MENTRY( SCALAR		);
+      MENTRY( MAPPING_START	);
+      MENTRY( MAPPING_END	);
+      MENTRY( SEQUENCE_START	);
+      MENTRY( SEQUENCE_END	);
+      MENTRY( DOCUMENT_START	);
+      MENTRY( DOCUMENT_END	);
+      MENTRY( STREAM_START	);
+      MENTRY( STREAM_END	);
+      MENTRY( ALIAS		);
 #undef MENTRY
-     else
-     {
-        emitter->error++;
-        luaL_addsize (&emitter->errbuff,
-                      sprintf (luaL_prepbuffer (&emitter->errbuff),
-                               "invalid event type '%s'", type));
-     }
-
-     /* If the stream has finished, finalize the YAML output. */
-     if (type && STREQ (type, "STREAM_END"))
-       finalize = 1;
-
-     if (type) free ((void *) type);
+
+      case YAML_NO_EVENT:
+         emitter->error++;
+         luaL_addstring (&emitter->errbuff, "no type field in event table");
+         break;
+      default:
+         break;		/* already reported */
    }
 
+   /* If the stream has finished, finalize the YAML output... */
+   if (type == YAML_STREAM_END_EVENT)
+      *finalize = 1;
+
+   /* ...which means sending any output still pending to a sink. */
+   if (*finalize && yaml_ok && emitter->output.sink != LUA_NOREF)
+      yaml_ok = lyaml_output_flush (&emitter->output);
+
    /* Copy any yaml_emitter_t errors into the error buffer. */
    if (!emitter->error && !yaml_ok)
    {
-      if (emitter->emitter.problem)
+      if (lyaml_output_error (L, &emitter->output))
+      {
+        const char *msg = lua_tostring (L, -1);
+        luaL_addstring (&emitter->errbuff, msg ? msg : "write error");
+        lua_pop (L, 1);
+      }
+      else if (emitter->emitter.problem)
         luaL_addstring (&emitter->errbuff, emitter->emitter.problem);
       else
         luaL_addstring (&emitter->errbuff, "LibYAML call failed");
       emitter->error++;
    }
 
+   return emitter->error == 0;
+}
+
+
+/* Push the results of an emit call that has just emitted its last event,
+   and return how many there are. */
+static int
+emitter_result (lua_State *L, lyaml_emitter *emitter, int finalize)
+{
    /* Report errors back to the caller as `false, "error message"`. */
    if (emitter->error != 0)
    {
@@ -368,8 +430,9 @@ emit (lua_State *L)
       return 2;
    }
 
-   /* Return `true, "YAML string"` after accepting a STREAM_END event. */
-   if (finalize)
+   /* Return `true, "YAML string"` after accepting a STREAM_END event,
+      unless the output has already gone to a sink. */
+   if (finalize && emitter->output.sink == LUA_NOREF)
    {
       lua_pushboolean (L, 1);
       luaL_pushresult (&emitter->yamlbuff);
@@ -383,6 +446,69 @@ emit (lua_State *L)
 }
 
 
+static int
+emit (lua_State *L)
+{
+   lyaml_emitter *emitter;
+   int finalize = 0;
+
+   luaL_argcheck (L, lua_istable (L, 1), 1, "expected table");
+
+   emitter = (lyaml_emitter *) lua_touserdata (L, lua_upvalueindex (1));
+   if (emitter->output.sink != LUA_NOREF)
+      emitter->output.L = L;
+
+   lua_settop (L, 1);
+   emitter_event (L, emitter, &finalize);
+   return emitter_result (L, emitter, finalize);
+}
+
+
+/* emit_batch (events [, i [, j]]): emit the event tables events[i] to
+   events[j], which default to the whole list, in a single call.  Stops
+   at the first event that fails, and returns `false`, the error message
+   and that event's index; otherwise returns the same as `emit` would
+   for the last event. */
+static int
+emit_batch (lua_State *L)
+{
+   lyaml_emitter *emitter;
+   lua_Integer i, j;
+   int finalize = 0, top;
+
+   luaL_checktype (L, 1, LUA_TTABLE);
+   i = luaL_optinteger (L, 2, 1);
+   j = luaL_optinteger (L, 3, (lua_Integer) lua_objlen (L, 1));
+
+   emitter = (lyaml_emitter *) lua_touserdata (L, lua_upvalueindex (1));
+   if (emitter->output.sink != LUA_NOREF)
+      emitter->output.L = L;
+
+   lua_settop (L, 1);
+   top = lua_gettop (L);
+   for (; i <= j && emitter->error == 0; i++)
+   {
+      lua_rawgeti (L, 1, (int) i);
+      if (lua_istable (L, -1))
+         emitter_event (L, emitter, &finalize);
+      else
+      {
+         emitter->error++;
+         luaL_addstring (&emitter->errbuff, "expected table");
+      }
+      lua_settop (L, top);
+   }
+
+   if (emitter->error != 0)
+   {
+      emitter_result (L, emitter, finalize);
+      lua_pushinteger (L, i - 1);
+      return 3;
+   }
+   return emitter_result (L, emitter, finalize);
+}
+
+
 static int
 append_output (void *arg, unsigned char *buff, size_t len)
 {
@@ -398,7 +524,10 @@ emitter_gc (lua_State *L)
    lyaml_emitter *emitter = (lyaml_emitter *) lua_touserdata (L, 1);
 
    if (emitter)
+   {
       yaml_emitter_delete (&emitter->emitter);
+      lyaml_output_delete (L, &emitter->output);
+   }
 
    return 0;
 }
@@ -409,11 +538,17 @@ Pemitter (lua_State *L)
 {
    lyaml_emitter *emitter;
 
+   /* requires an optional options table */
+   if (!lua_isnoneornil (L, 1))
+      luaL_checktype (L, 1, LUA_TTABLE);
+   lua_settop (L, 1);
+
    lua_newtable (L);	/* object table */
 
    /* Create a user datum to store the emitter. */
    emitter = (lyaml_emitter *) lua_newuserdata (L, sizeof (*emitter));
-   emitter->error = 0;
+   memset ((void *) emitter, 0, sizeof (*emitter));
+   emitter->output.sink = emitter->output.error = LUA_NOREF;
 
    /* Initialize the emitter. */
    if (!yaml_emitter_initialize (&emitter->emitter))
@@ -424,7 +559,6 @@ Pemitter (lua_State *L)
    }
    yaml_emitter_set_unicode (&emitter->emitter, 1);
    yaml_emitter_set_width   (&emitter->emitter, 2);
-   yaml_emitter_set_output  (&emitter->emitter, &append_output, emitter);
 
    /* Set it's metatable, and ensure it is garbage collected properly. */
    luaL_newmetatable (L, "lyaml.emitter");
@@ -432,10 +566,25 @@ Pemitter (lua_State *L)
    lua_setfield      (L, -2, "__gc");
    lua_setmetatable  (L, -2);
 
-   /* Set the emit method of object as a closure over the user datum, and
-      return the whole object. */
+   /* Send output to the sink option, or accumulate it for STREAM_END. */
+   if (lua_istable (L, 1))
+      lua_getfield (L, 1, "sink");
+   else
+      lua_pushnil (L);
+   if (lua_isnil (L, -1))
+      yaml_emitter_set_output (&emitter->emitter, &append_output, emitter);
+   else
+      lyaml_output_set (L, lua_gettop (L), &emitter->emitter,
+                        &emitter->output, lyaml_flush_bytes (L, 1));
+   lua_pop (L, 1);
+
+   /* Set the emit and emit_batch methods of object as closures over the
+      user datum, and return the whole object. */
+   lua_pushvalue    (L, -1);
    lua_pushcclosure (L, emit, 1);
-   lua_setfield (L, -2, "emit");
+   lua_setfield (L, -3, "emit");
+   lua_pushcclosure (L, emit_batch, 1);
+   lua_setfield (L, -2, "emit_batch");
 
    /* Set up a separate thread to collect error messages; save the thread
       in the returned table so that it's not garbage collected when the
@@ -0,0 +1,359 @@
+/*
+ * input.c, libyaml parser input sources for lyaml
+ *
+ * Copyright (C) 2013-2020 Gary V. Vaughan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Feed a libyaml parser from a Lua string, an open Lua file handle, or a
+   reader function returning successive chunks of the stream.  libyaml
+   reads into its own fixed size raw buffer, so only the unconsumed part
+   of the current reader chunk is held in addition to that.
+
+   A named file is mapped into memory read-only where possible, and
+   parsed in place as if it were a string; pipes, devices and other
+   files that can't be mapped are read through a buffered FILE. */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+#include <lualib.h>
+
+#include "lyaml.h"
+
+
+/* Return the FILE * of the Lua file handle at IDX, or NULL if it isn't
+   one.  Raise an error if the handle has been closed. */
+FILE *
+lyaml_tofile (lua_State *L, int idx)
+{
+   void *p = lua_touserdata (L, idx);
+   int isfile;
+
+   if (p == NULL || !lua_getmetatable (L, idx))
+      return NULL;
+   luaL_getmetatable (L, LUA_FILEHANDLE);
+   isfile = lua_rawequal (L, -1, -2);
+   lua_pop (L, 2);
+   if (!isfile)
+      return NULL;
+
+#if LUA_VERSION_NUM > 501
+   if (((luaL_Stream *) p)->closef == NULL)
+#else
+   if (*(FILE **) p == NULL)
+#endif
+      luaL_argerror (L, idx, "attempt to use a closed file");
+   return *(FILE **) p;
+}
+
+/* Save the error message on top of the stack, to be raised after libyaml
+   has given up on the read. */
+static int
+input_seterror (lua_State *L, lyaml_input *input)
+{
+   luaL_unref (L, LUA_REGISTRYINDEX, input->error);
+   input->error = luaL_ref (L, LUA_REGISTRYINDEX);
+   return 0;
+}
+
+/* Count LEN more bytes handed to libyaml, and return 0 to fail the read
+   if that takes the input past its limit. */
+static int
+input_count (lyaml_input *input, size_t len)
+{
+   input->total += len;
+   return input->total <= input->limit;
+}
+
+static int
+input_file (void *data, unsigned char *buffer, size_t size, size_t *size_read)
+{
+   lyaml_input *input = (lyaml_input *) data;
+
+   *size_read = fread (buffer, 1, size, input->fp);
+   if (*size_read < size && ferror (input->fp))
+   {
+      lua_pushfstring (input->L, "read error: %s", strerror (errno));
+      return input_seterror (input->L, input);
+   }
+   return input_count (input, *size_read);
+}
+
+static int
+input_reader (void *data, unsigned char *buffer, size_t size, size_t *size_read)
+{
+   lyaml_input *input = (lyaml_input *) data;
+   lua_State *L = input->L;
+   const char *chunk;
+   size_t len;
+
+   *size_read = 0;
+
+   /* fetch a new chunk when the last one is used up */
+   if (input->chunk == LUA_NOREF)
+   {
+      lua_rawgeti (L, LUA_REGISTRYINDEX, input->source);
+      if (lua_pcall (L, 0, 1, 0) != 0)
+         return input_seterror (L, input);
+      if (lua_isnil (L, -1))
+      {
+         /* end of stream */
+         lua_pop (L, 1);
+         return 1;
+      }
+      if (lua_type (L, -1) != LUA_TSTRING)
+      {
+         lua_pop (L, 1);
+         lua_pushliteral (L, "reader function must return a string or nil");
+         return input_seterror (L, input);
+      }
+      lua_tolstring (L, -1, &input->chunklen);
+      input->chunk = luaL_ref (L, LUA_REGISTRYINDEX);
+      input->offset = 0;
+   }
+
+   lua_rawgeti (L, LUA_REGISTRYINDEX, input->chunk);
+   chunk = lua_tostring (L, -1);
+   len = input->chunklen - input->offset;
+   if (len > size)
+      len = size;
+   memcpy (buffer, chunk + input->offset, len);
+   lua_pop (L, 1);
+
+   input->offset += len;
+   *size_read = len;
+
+   /* an empty chunk ends the stream, just like the `load` reader */
+   if (input->offset == input->chunklen)
+   {
+      luaL_unref (L, LUA_REGISTRYINDEX, input->chunk);
+      input->chunk = LUA_NOREF;
+   }
+   return input_count (input, len);
+}
+
+
+static void
+input_init (lua_State *L, lyaml_input *input)
+{
+   input->L      = L;
+   input->fp     = NULL;
+   input->ownfp  = 0;
+   input->map    = NULL;
+   input->maplen = 0;
+   input->source = LUA_NOREF;
+   input->chunk  = LUA_NOREF;
+   input->error  = LUA_NOREF;
+   input->total  = 0;
+   input->limit  = SIZE_MAX;
+}
+
+
+/* Set the input of PARSER to the string, file handle or reader function
+   at IDX, which is kept alive in the registry until lyaml_input_delete. */
+void
+lyaml_input_set (lua_State *L, int idx, yaml_parser_t *parser,
+                 lyaml_input *input)
+{
+   input_init (L, input);
+
+   if (lua_isstring (L, idx))
+   {
+      size_t len;
+      const char *str = lua_tolstring (L, idx, &len);
+
+      yaml_parser_set_input_string (parser, (const unsigned char *) str, len);
+      input->total = len;
+   }
+   else if (lua_isfunction (L, idx))
+   {
+      yaml_parser_set_input (parser, input_reader, input);
+   }
+   else if ((input->fp = lyaml_tofile (L, idx)) != NULL)
+   {
+      yaml_parser_set_input (parser, input_file, input);
+   }
+   else
+      luaL_argerror (L, idx, "must provide a string, file or function argument");
+
+   lua_pushvalue (L, idx);
+   input->source = luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
+/* Set the input of PARSER to the file at PATH.  A regular file is
+   mapped read-only and handed to libyaml as a string, without copying;
+   anything else falls back to buffered reads.  The mapping or the open
+   file is released by lyaml_input_delete. */
+void
+lyaml_input_set_file (lua_State *L, const char *path, yaml_parser_t *parser,
+                      lyaml_input *input)
+{
+   FILE *fp;
+
+   input_init (L, input);
+
+   fp = fopen (path, "rb");
+   if (fp == NULL)
+      luaL_error (L, "cannot open %s: %s", path, strerror (errno));
+
+#ifndef _WIN32
+   {
+      struct stat st;
+
+      /* mmap can't map an empty file, which reads just as well anyway */
+      if (fstat (fileno (fp), &st) == 0 && S_ISREG (st.st_mode) &&
+          st.st_size > 0 && (uintmax_t) st.st_size <= SIZE_MAX)
+      {
+         void *map = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+                           fileno (fp), 0);
+         if (map != MAP_FAILED)
+         {
+            /* the mapping outlives the descriptor */
+            fclose (fp);
+            input->map    = map;
+            input->maplen = (size_t) st.st_size;
+            input->total  = input->maplen;
+            yaml_parser_set_input_string (parser,
+               (const unsigned char *) input->map, input->maplen);
+            return;
+         }
+      }
+   }
+#endif
+
+   input->fp    = fp;
+   input->ownfp = 1;
+   yaml_parser_set_input (parser, input_file, input);
+}
+
+/* Keep the tape at IDX alive until lyaml_input_delete, for a caller that
+   replays its events instead of using a parser. */
+void
+lyaml_input_set_tape (lua_State *L, int idx, lyaml_input *input)
+{
+   input_init (L, input);
+   lua_pushvalue (L, idx);
+   input->source = luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
+/* Return the size option NAME on top of the stack, rounded down, or
+   SIZE_MAX if it is too big for a size_t, such as `math.huge`.  Like the
+   Lua loader, accept any number, but not NaN or a negative one. */
+size_t
+lyaml_checksize (lua_State *L, const char *name)
+{
+   lua_Number n;
+
+   if (!lua_isnumber (L, -1))
+      luaL_error (L, "%s must be a number", name);
+   n = lua_tonumber (L, -1);
+   if (n != n)
+      luaL_error (L, "%s must be a number", name);
+   if (n < 0)
+      luaL_error (L, "%s must not be negative", name);
+   if (n >= (lua_Number) SIZE_MAX)
+      return SIZE_MAX;
+   return (size_t) n;
+}
+
+/* Return the limit option NAME from the options table at IDX, or -1 if
+   it isn't set or is too big to ever be reached. */
+lua_Integer
+lyaml_checklimit (lua_State *L, int idx, const char *name)
+{
+   lua_Integer n = -1;
+   size_t size;
+
+   lua_getfield (L, idx, name);
+   if (!lua_isnil (L, -1))
+   {
+      size = lyaml_checksize (L, name);
+      if (size != SIZE_MAX && (uintmax_t) size < (uintmax_t) LUA_MAXINTEGER)
+         n = (lua_Integer) size;
+   }
+   lua_pop (L, 1);
+   return n;
+}
+
+/* Apply the `max_input_bytes` option from the options table at IDX, if
+   any, to INPUT once its source has been set.  Strings and mapped files
+   are checked straight away; other sources fail the read that takes them
+   past the limit, which lyaml_input_overlimit then reports. */
+void
+lyaml_input_set_limit (lua_State *L, int idx, lyaml_input *input)
+{
+   lua_Integer n = lyaml_checklimit (L, idx, "max_input_bytes");
+
+   if (n < 0)
+      return;
+   if ((uintmax_t) n < SIZE_MAX)
+      input->limit = (size_t) n;
+   if (lyaml_input_overlimit (input))
+      luaL_error (L, "input exceeds max_input_bytes");
+}
+
+/* Return 1 if more than the max_input_bytes option allows has been
+   handed to libyaml. */
+int
+lyaml_input_overlimit (const lyaml_input *input)
+{
+   return input->total > input->limit;
+}
+
+/* If the last read failed, push the saved error value and return 1. */
+int
+lyaml_input_error (lua_State *L, lyaml_input *input)
+{
+   if (input->error == LUA_NOREF)
+      return 0;
+   lua_rawgeti (L, LUA_REGISTRYINDEX, input->error);
+   return 1;
+}
+
+/* Release the registry references, file and mapping held by INPUT. */
+void
+lyaml_input_delete (lua_State *L, lyaml_input *input)
+{
+   if (input->L == NULL)
+      return;	/* never set */
+   luaL_unref (L, LUA_REGISTRYINDEX, input->source);
+   luaL_unref (L, LUA_REGISTRYINDEX, input->chunk);
+   luaL_unref (L, LUA_REGISTRYINDEX, input->error);
+   input->source = input->chunk = input->error = LUA_NOREF;
+
+   if (input->ownfp && input->fp != NULL)
+      fclose (input->fp);
+   input->fp    = NULL;
+   input->ownfp = 0;
+#ifndef _WIN32
+   if (input->map != NULL)
+      munmap (input->map, input->maplen);
+#endif
+   input->map    = NULL;
+   input->maplen = 0;
+}
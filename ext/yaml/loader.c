@@ -0,0 +1,1977 @@
+/*
+ * loader.c, libyaml loader binding for Lua
+ *
+ * Copyright (C) 2013-2020 Gary V. Vaughan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Build Lua tables directly from libyaml parser events, without creating
+   an event table for each event like the `yaml.parser` iterator does.
+   This is a straight translation of the Lua loader in lib/lyaml/init.lua,
+   but it keeps the collections under construction on an explicit stack
+   instead of recursing for every node.
+
+   With the `lazy` option, collections nested inside the root of each
+   document are not built at all at first: the loader just notes the
+   bytes of the source string they span, and leaves an empty proxy
+   table in their place.  The first time a proxy is indexed, measured or
+   iterated, that part of the source is loaded and its contents copied
+   into the proxy, which then becomes an ordinary table. */
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lyaml.h"
+
+#define MERGE_TAG	"tag:yaml.org,2002:merge"
+
+/* Slots in the loader state table, which holds all the Lua values the
+   loader needs to keep track of between events. */
+enum {
+   STATE_ANCHORS = 1,	/* anchor name -> loaded node */
+   STATE_NODETYPES,	/* anchor name -> node type of loaded node */
+   STATE_EXPLICIT,	/* explicit_scalar option, or nil for default */
+   STATE_IMPLICIT,	/* implicit_scalar option, or nil for default */
+   STATE_CACHE,		/* scalar key -> resolved value, if scalar_cache */
+   STATE_LAZY,		/* lazy loading context, if lazy */
+   STATE_DOCUMENT,	/* root node of the current document */
+   STATE_SIZES,		/* anchored table -> nodes, if max_alias_expansions */
+   STATE_TAPE,		/* tape recorded in parallel, if threads */
+   STATE_FRAMES		/* container and pending key for each open frame */
+};
+
+/* Slots in the lazy loading context table, shared by every loader
+   working on the same source string. */
+enum {
+   LAZY_SOURCE = 1,	/* the whole source string */
+   LAZY_OPTIONS,	/* options for loading each proxy */
+   LAZY_RANGES,		/* proxy -> {first byte, last byte, column} */
+   LAZY_META		/* metatable of each proxy */
+};
+
+#define LAZY_NAME	"lyaml.lazy"
+
+/* With the deadline option, check the clock after this many events. */
+#define LOADER_CLOCK_EVENTS	256
+
+/* Returned by loader_next when it stops for the yield_every option. */
+#define LOADER_PAUSED		(-1)
+
+/* What the next node completes in an open mapping. */
+enum {
+   LOAD_KEY = 0,
+   LOAD_VALUE,
+   LOAD_MERGE
+};
+
+typedef struct {
+   yaml_event_type_t type;	/* SEQUENCE_START or MAPPING_START */
+   int		     state;	/* mappings: LOAD_KEY, LOAD_VALUE or LOAD_MERGE */
+   lua_Integer	     n;		/* sequences: number of elements so far */
+   lua_Integer	     size;	/* nodes so far, counting aliased ones */
+   char		     anchored;	/* the collection has an anchor */
+} lyaml_frame;
+
+typedef struct {
+   yaml_parser_t  parser;
+   yaml_event_t   event;
+   char		  validevent;
+   char		  started;	/* STREAM_START has been parsed */
+   char		  finished;	/* STREAM_END has been parsed */
+   int		  document_count;
+   lyaml_input	  input;
+
+   /* events replayed from a tape, instead of the parser */
+   const lyaml_tape *tape;
+   size_t	  tapepos;
+
+   /* counters for the stats option, or NULL */
+   lyaml_stats	 *stats;
+
+   /* limits for untrusted input, or -1 if not set */
+   lua_Integer	  max_depth;
+   lua_Integer	  max_nodes;
+   lua_Integer	  max_alias_expansions;
+   lua_Integer	  max_scalar_bytes;
+   char		  limited;	/* any of the above are set */
+   int		  level;	/* collections open in the event stream */
+   lua_Integer	  nodes;	/* nodes parsed so far */
+   lua_Integer	  expansions;	/* nodes repeated by aliases so far */
+
+   /* cooperative loading */
+   double	  deadline;	/* lyaml_clock time to give up at... */
+   char		  timed;	/* ...if the deadline option is set */
+   unsigned	  ticks;	/* events since the clock was checked */
+   lua_Integer	  yield_every;	/* events between pauses, or 0 */
+   lua_Integer	  budget;	/* events left before the next pause */
+
+   /* position of the last event, for diagnostics */
+   int		  line;
+   int		  column;
+
+   /* open collections */
+   lyaml_frame	 *frames;
+   int		  depth;
+   int		  nframes;
+
+   /* resolved scalar cache */
+   lua_Integer	  cache_size;	/* maximum number of entries, or 0 */
+   lua_Integer	  cache_count;
+   lua_Integer	  cache_hits;
+   lua_Integer	  cache_misses;
+
+   /* lazy loading */
+   char		  lazy;		/* lazy option, and UTF-8 input */
+   char		  lazydoc;	/* ...and no %TAG directives in this document */
+   const unsigned char *source;	/* the string being parsed */
+   size_t	  sourcelen;
+   size_t	  base;		/* add to offsets in source for LAZY_SOURCE */
+   size_t	  chars;	/* character index of... */
+   size_t	  bytes;	/* ...this byte offset in source */
+} lyaml_loader;
+
+
+static void
+loader_delete_event (lyaml_loader *loader)
+{
+   if (loader->validevent)
+   {
+      yaml_event_delete (&loader->event);
+      loader->validevent = 0;
+   }
+}
+
+/* Raise an error message prefixed by the position of the last event. */
+static int
+loader_error (lua_State *L, lyaml_loader *loader, const char *fmt, ...)
+{
+   va_list ap;
+
+   lua_pushfstring (L, "%d:%d: ", loader->line, loader->column);
+   va_start (ap, fmt);
+   lua_pushvfstring (L, fmt, ap);
+   va_end (ap);
+   lua_concat (L, 2);
+   return lua_error (L);
+}
+
+/* Push the result of calling `tostring` on the value at IDX. */
+static const char *
+loader_tostring (lua_State *L, int idx)
+{
+   lua_pushvalue (L, idx);
+   lua_getglobal (L, "tostring");
+   lua_insert    (L, -2);
+   lua_call      (L, 1, 1);
+   return lua_tostring (L, -1);
+}
+
+static const char *
+loader_typename (yaml_event_type_t type)
+{
+   switch (type)
+   {
+#define MENTRY(_s)	case YAML_##_s##_EVENT: return #_s
+      MENTRY( STREAM_START	);
+      MENTRY( STREAM_END	);
+      MENTRY( DOCUMENT_START	);
+      MENTRY( DOCUMENT_END	);
+      MENTRY( ALIAS		);
+      MENTRY( SCALAR		);
+      MENTRY( SEQUENCE_START	);
+      MENTRY( SEQUENCE_END	);
+      MENTRY( MAPPING_START	);
+      MENTRY( MAPPING_END	);
+#undef MENTRY
+      default:
+         return "NO";
+   }
+}
+
+#define OVERLIMIT(_n, _max)	((_max) >= 0 && (_n) > (_max))
+
+/* Raise an error at the event just parsed if it takes the stream past
+   the max_depth, max_nodes or max_scalar_bytes options.  This sees every
+   event, including those skipped over by lazy loading or `yaml.select`,
+   before anything is built from it. */
+static void
+loader_check_limits (lua_State *L, lyaml_loader *loader)
+{
+   switch (loader->event.type)
+   {
+      case YAML_SCALAR_EVENT:
+         if (OVERLIMIT ((lua_Integer) loader->event.data.scalar.length,
+                        loader->max_scalar_bytes))
+            loader_error (L, loader, "scalar exceeds max_scalar_bytes");
+         break;
+      case YAML_SEQUENCE_START_EVENT:
+      case YAML_MAPPING_START_EVENT:
+         if (OVERLIMIT (++loader->level, loader->max_depth))
+            loader_error (L, loader, "nesting exceeds max_depth");
+         break;
+      case YAML_SEQUENCE_END_EVENT:
+      case YAML_MAPPING_END_EVENT:
+         loader->level--;
+         return;
+      default:
+         return;
+   }
+   if (OVERLIMIT (++loader->nodes, loader->max_nodes))
+      loader_error (L, loader, "node count exceeds max_nodes");
+}
+
+/* With max_alias_expansions, add SIZE nodes to the innermost open
+   collection, so that aliases to it can be charged for all of them. */
+static void
+loader_grow (lyaml_loader *loader, lua_Integer size)
+{
+   if (loader->max_alias_expansions >= 0 && loader->depth > 0)
+      loader->frames[loader->depth - 1].size += size;
+}
+
+/* Fetch the next event from the parser, or the tape. */
+static void
+loader_parse (lua_State *L, lyaml_loader *loader)
+{
+   loader_delete_event (loader);
+   if (loader->tape != NULL)
+   {
+      /* the event points into the tape, and is never deleted */
+      if (!lyaml_tape_event (loader->tape, loader->tapepos++, &loader->event))
+         loader_error (L, loader, "unexpected end of tape");
+   }
+   else
+   {
+      yaml_parser_t *P = &loader->parser;
+      double start = loader->stats ? lyaml_clock () : 0;
+      int r = yaml_parser_parse (P, &loader->event);
+
+      if (loader->stats)
+      {
+         loader->stats->libyaml += lyaml_clock () - start;
+         loader->stats->bytes = P->offset;
+      }
+      if (r != 1)
+      {
+         if (lyaml_input_overlimit (&loader->input))
+            loader_error (L, loader, "input exceeds max_input_bytes");
+         /* pass errors from the input source through untouched */
+         if (lyaml_input_error (L, &loader->input))
+            lua_error (L);
+         loader_error (L, loader, "%s", P->problem ? P->problem : "A problem");
+      }
+      loader->validevent = 1;
+   }
+
+   if (loader->stats)
+      lyaml_stats_event (loader->stats, &loader->event);
+   loader->line   = (int) loader->event.start_mark.line + 1;
+   loader->column = (int) loader->event.start_mark.column + 1;
+   if (loader->limited)
+      loader_check_limits (L, loader);
+   if (loader->timed && ++loader->ticks % LOADER_CLOCK_EVENTS == 0 &&
+       lyaml_clock () > loader->deadline)
+      loader_error (L, loader, "load exceeded deadline");
+}
+
+/* Save the node on top of the stack for reference by future aliases. */
+static void
+loader_add_anchor (lua_State *L, int state, const yaml_char_t *anchor,
+                   yaml_event_type_t type)
+{
+   if (anchor == NULL)
+      return;
+
+   lua_rawgeti     (L, state, STATE_ANCHORS);
+   lua_pushyamlstr (anchor);
+   lua_pushvalue   (L, -3);
+   lua_rawset      (L, -3);
+   lua_pop         (L, 1);
+
+   lua_rawgeti     (L, state, STATE_NODETYPES);
+   lua_pushyamlstr (anchor);
+   lua_pushinteger (L, type);
+   lua_rawset      (L, -3);
+   lua_pop         (L, 1);
+}
+
+/* Push the Lua value of the current SCALAR event. */
+static void
+loader_resolve_scalar (lua_State *L, lyaml_loader *loader, int state)
+{
+#define EVENTF(_f)	(loader->event.data.scalar._f)
+   const char *value = (const char *) EVENTF (value);
+   const char *tag = (const char *) EVENTF (tag);
+   size_t length = EVENTF (length);
+   int r = 0;
+
+   /* Explicitly tagged values. */
+   if (tag != NULL)
+   {
+      lua_rawgeti (L, state, STATE_EXPLICIT);
+      if (lua_isnil (L, -1))
+      {
+         lua_pop (L, 1);
+         r = lyaml_resolve_explicit (L, tag, value, length);
+      }
+      else
+      {
+         lua_getfield (L, -1, tag);
+         lua_remove   (L, -2);
+         if (lua_isnil (L, -1))
+            lua_pop (L, 1);
+         else
+         {
+            lua_pushlstring (L, value, length);
+            lua_call        (L, 1, 1);
+            r = lua_isnil (L, -1) ? -1 : 1;
+            if (r < 0)
+               lua_pop (L, 1);
+         }
+      }
+      if (r < 0)
+         loader_error (L, loader, "invalid '%s' value: '%s'", tag, value);
+   }
+
+   /* Otherwise, implicit conversion according to value content. */
+   if (r == 0 && EVENTF (style) == YAML_PLAIN_SCALAR_STYLE)
+   {
+      lua_rawgeti (L, state, STATE_IMPLICIT);
+      if (lua_isnil (L, -1))
+      {
+         lua_pop (L, 1);
+         r = lyaml_resolve_implicit (L, value, length);
+      }
+      else
+      {
+         lua_pushlstring (L, value, length);
+         lua_call        (L, 1, 1);
+         r = 1;
+      }
+   }
+
+   if (r == 0)
+      lua_pushlstring (L, value, length);
+#undef EVENTF
+}
+
+/* Whether the resolved value on top of the stack can be shared between
+   scalars.  Tables and other mutable values returned by custom scalar
+   functions must be made afresh each time. */
+static int
+loader_cacheable (lua_State *L)
+{
+   switch (lua_type (L, -1))
+   {
+      case LUA_TBOOLEAN:
+      case LUA_TNUMBER:
+      case LUA_TSTRING:
+         return 1;
+      case LUA_TTABLE:
+         return lyaml_isnull (L, -1);
+      default:
+         return 0;
+   }
+}
+
+/* Push the Lua value of the current SCALAR event, reusing the value
+   resolved for an earlier scalar with the same tag, style and content
+   when the scalar_cache option is set.  Once the cache is full, it
+   keeps the values it has but takes no new ones. */
+static void
+loader_push_scalar (lua_State *L, lyaml_loader *loader, int state)
+{
+#define EVENTF(_f)	(loader->event.data.scalar._f)
+   const char *value = (const char *) EVENTF (value);
+   const char *tag = (const char *) EVENTF (tag);
+   int plain = (EVENTF (style) == YAML_PLAIN_SCALAR_STYLE);
+   int cache;
+
+   /* untagged quoted scalars are always strings */
+   if (loader->cache_size == 0 || (tag == NULL && !plain))
+   {
+      loader_resolve_scalar (L, loader, state);
+      return;
+   }
+
+   lua_rawgeti (L, state, STATE_CACHE);
+   cache = lua_gettop (L);
+
+   /* Plain scalars can't contain a NUL, so the key of an untagged plain
+      scalar is its value, and tagged scalars can't collide with them. */
+   if (tag == NULL)
+      lua_pushlstring (L, value, EVENTF (length));
+   else
+   {
+      luaL_Buffer b;
+
+      luaL_buffinit  (L, &b);
+      luaL_addstring (&b, tag);
+      luaL_addchar   (&b, '\0');
+      luaL_addchar   (&b, plain ? 'P' : 'Q');
+      luaL_addlstring (&b, value, EVENTF (length));
+      luaL_pushresult (&b);
+   }
+
+   lua_pushvalue (L, -1);
+   lua_rawget    (L, cache);
+   if (!lua_isnil (L, -1))
+      loader->cache_hits++;
+   else
+   {
+      lua_pop (L, 1);
+      loader->cache_misses++;
+      loader_resolve_scalar (L, loader, state);
+      if (loader->cache_count < loader->cache_size && loader_cacheable (L))
+      {
+         lua_pushvalue (L, -2);
+         lua_pushvalue (L, -2);
+         lua_rawset    (L, cache);
+         loader->cache_count++;
+      }
+   }
+
+   /* leave just the value */
+   lua_replace (L, cache);
+   lua_settop  (L, cache);
+#undef EVENTF
+}
+
+/* Push a table of scalar cache statistics. */
+static void
+loader_push_stats (lua_State *L, lyaml_loader *loader)
+{
+   lua_createtable (L, 0, 4);
+   RAWSET_INTEGER ("hits",   loader->cache_hits);
+   RAWSET_INTEGER ("misses", loader->cache_misses);
+   RAWSET_INTEGER ("count",  loader->cache_count);
+   RAWSET_INTEGER ("size",   loader->cache_size);
+}
+
+/* Copy each field of the table on top of the stack into the mapping
+   at index MAP, unless MAP already has a value for that key. */
+static void
+loader_merge (lua_State *L, int map)
+{
+   lua_pushnil (L);
+   while (lua_next (L, -2) != 0)
+   {
+      lua_pushvalue (L, -2);
+      lua_rawget    (L, map);
+      if (lua_isnil (L, -1))
+      {
+         lua_pop       (L, 1);
+         lua_pushvalue (L, -2);
+         lua_insert    (L, -2);
+         lua_rawset    (L, map);
+      }
+      else
+         lua_pop (L, 2);
+   }
+}
+
+/* Merge the node on top of the stack, of type TYPE, into the mapping in
+   the innermost frame, diagnosing with LABEL (the merge key tag, or the
+   key itself). */
+static void
+loader_merge_node (lua_State *L, lyaml_loader *loader, int map,
+                   const char *label, yaml_event_type_t type)
+{
+   int node = lua_gettop (L);
+
+   if (type == YAML_MAPPING_START_EVENT)
+   {
+      loader_merge (L, map);
+   }
+   else if (type == YAML_SEQUENCE_START_EVENT)
+   {
+      int i;
+
+      for (i = 1;; i++)
+      {
+         lua_rawgeti (L, node, i);
+         if (lua_isnil (L, -1))
+         {
+            lua_pop (L, 1);
+            break;
+         }
+         if (lua_type (L, -1) != LUA_TTABLE)
+            loader_error (L, loader, "invalid '%s' sequence element %d: %s",
+                          label, i, loader_tostring (L, -1));
+         loader_merge (L, map);
+         lua_pop (L, 1);
+      }
+   }
+   else
+   {
+      loader_error (L, loader, "invalid '%s' merge event: %s", label,
+                    type == YAML_SCALAR_EVENT ? loader_tostring (L, node)
+                                              : loader_typename (type));
+   }
+   lua_pop (L, 1);
+}
+
+/* Add the node on top of the stack, of type TYPE, to the innermost open
+   collection, or make it the document root if there is none.  If the node
+   came from a SCALAR event, TAG is its tag. */
+static void
+loader_add_node (lua_State *L, lyaml_loader *loader, int state,
+                 yaml_event_type_t type, const char *tag)
+{
+   lyaml_frame *frame;
+   int slot;
+
+   if (lua_isnil (L, -1))
+      loader_error (L, loader, "unexpected %s event",
+                    loader_typename (loader->event.type));
+
+   if (loader->depth == 0)
+   {
+      lua_rawseti (L, state, STATE_DOCUMENT);
+      return;
+   }
+
+   frame = loader->frames + loader->depth - 1;
+   slot = STATE_FRAMES + 2 * (loader->depth - 1);
+
+   if (frame->type == YAML_SEQUENCE_START_EVENT)
+   {
+      lua_rawgeti (L, state, slot);
+      lua_insert  (L, -2);
+      lua_rawseti (L, -2, ++frame->n);
+      lua_pop     (L, 1);
+   }
+   else if (frame->state == LOAD_KEY)
+   {
+      int merge = (tag != NULL && STREQ (tag, MERGE_TAG)) ||
+         (lua_type (L, -1) == LUA_TSTRING && STREQ (lua_tostring (L, -1), "<<"));
+
+      if (merge)
+      {
+         /* Save the merge key tag in place of the key, for diagnostics. */
+         if (tag != NULL)
+         {
+            lua_pop (L, 1);
+            lua_pushstring (L, tag);
+         }
+         frame->state = LOAD_MERGE;
+      }
+      else
+         frame->state = LOAD_VALUE;
+      lua_rawseti (L, state, slot + 1);
+   }
+   else if (frame->state == LOAD_VALUE)
+   {
+      lua_rawgeti (L, state, slot);
+      lua_rawgeti (L, state, slot + 1);
+      lua_pushvalue (L, -3);
+      lua_rawset  (L, -3);
+      lua_pop     (L, 2);
+
+      lua_pushnil (L);
+      lua_rawseti (L, state, slot + 1);
+      frame->state = LOAD_KEY;
+   }
+   else /* LOAD_MERGE */
+   {
+      int node = lua_gettop (L);
+
+      lua_rawgeti (L, state, slot);
+      lua_rawgeti (L, state, slot + 1);
+      lua_pushvalue (L, node);
+      loader_merge_node (L, loader, node + 1, lua_tostring (L, node + 2), type);
+      lua_pop (L, 3);
+
+      lua_pushnil (L);
+      lua_rawseti (L, state, slot + 1);
+      frame->state = LOAD_KEY;
+   }
+}
+
+/* Open a new collection of type TYPE, with an empty table on top of the
+   stack to hold its contents. */
+static void
+loader_push_frame (lua_State *L, lyaml_loader *loader, int state,
+                   yaml_event_type_t type)
+{
+   lyaml_frame *frame;
+
+   if (loader->depth == loader->nframes)
+   {
+      int n = loader->nframes ? 2 * loader->nframes : 16;
+      lyaml_frame *frames = (lyaml_frame *)
+         realloc (loader->frames, n * sizeof (*frames));
+
+      if (frames == NULL)
+         luaL_error (L, "cannot allocate loader stack");
+      loader->frames = frames;
+      loader->nframes = n;
+   }
+
+   frame = loader->frames + loader->depth++;
+   frame->type = type;
+   frame->state = LOAD_KEY;
+   frame->n = 0;
+   frame->size = 1;
+   frame->anchored = 0;
+
+   lua_rawseti (L, state, STATE_FRAMES + 2 * (loader->depth - 1));
+}
+
+/* Close the innermost collection, and add it to its parent. */
+static void
+loader_pop_frame (lua_State *L, lyaml_loader *loader, int state)
+{
+   int slot = STATE_FRAMES + 2 * (loader->depth - 1);
+   lyaml_frame *frame = loader->frames + loader->depth - 1;
+   yaml_event_type_t type = frame->type;
+   lua_Integer size = frame->size;
+
+   lua_rawgeti (L, state, slot);
+   lua_pushnil (L);
+   lua_rawseti (L, state, slot);
+
+   if (frame->anchored && loader->max_alias_expansions >= 0)
+   {
+      /* what each alias to this collection will cost */
+      lua_rawgeti     (L, state, STATE_SIZES);
+      lua_pushvalue   (L, -2);
+      lua_pushinteger (L, size);
+      lua_rawset      (L, -3);
+      lua_pop (L, 1);
+   }
+
+   loader->depth--;
+   loader_grow (loader, size);
+   loader_add_node (L, loader, state, type, NULL);
+}
+
+/* Start a new, empty anchor table for the next document. */
+static void
+loader_reset_anchors (lua_State *L, int state)
+{
+   lua_newtable (L);
+   lua_rawseti  (L, state, STATE_ANCHORS);
+   lua_newtable (L);
+   lua_rawseti  (L, state, STATE_NODETYPES);
+}
+
+/* Return the byte offset in the source string of libyaml's character
+   INDEX, which can only be found by counting UTF-8 sequences.  Marks
+   mostly come in order, so carry on from where the last call left off. */
+static size_t
+loader_offset (lyaml_loader *loader, size_t index)
+{
+   if (index < loader->chars)
+   {
+      loader->chars = 0;
+      loader->bytes = 0;
+   }
+   /* libyaml doesn't count a byte order mark */
+   if (loader->bytes == 0 && loader->sourcelen >= 3 &&
+       memcmp (loader->source, "\xef\xbb\xbf", 3) == 0)
+      loader->bytes = 3;
+
+   while (loader->chars < index && loader->bytes < loader->sourcelen)
+   {
+      unsigned char c = loader->source[loader->bytes];
+
+      loader->bytes += c < 0xc0 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+      loader->chars++;
+   }
+   return loader->bytes;
+}
+
+static int lazy_load (lua_State *L);
+
+/* Load the bytes FIRST to LAST of the lazy source string as a YAML
+   document, indented by COLUMN spaces to put the first line back where
+   it was, and push its root node.  With SHARED, anchors and aliases in
+   the range are resolved with the anchor tables in state table SHARED
+   of the current loader. */
+static void
+loader_load_range (lua_State *L, int ctx, size_t first, size_t last,
+                   size_t column, int shared)
+{
+   luaL_Buffer b;
+   const char *source;
+   size_t i;
+
+   lua_pushvalue   (L, ctx);
+   lua_pushinteger (L, (lua_Integer) (first - column));
+   if (shared)
+      lua_pushvalue (L, shared);
+   else
+      lua_pushnil   (L);
+   lua_pushcclosure (L, lazy_load, 3);
+
+   lua_rawgeti (L, ctx, LAZY_SOURCE);
+   source = lua_tostring (L, -1);
+   luaL_buffinit (L, &b);
+   for (i = 0; i < column; i++)
+      luaL_addchar (&b, ' ');
+   luaL_addlstring (&b, source + first, last - first);
+   luaL_pushresult (&b);
+   lua_remove (L, -2);
+
+   lua_rawgeti (L, ctx, LAZY_OPTIONS);
+   lua_call    (L, 2, 1);
+}
+
+/* If lazy loading applies to the collection just started, skip to the
+   end of it and add a proxy for it, or just the loaded collection if it
+   contains anchors or aliases, then return 1.  Otherwise return 0.  Keys,
+   merged mappings and the mappings in a merged sequence are always loaded
+   at once, since their fields are copied as soon as they are complete. */
+static int
+loader_skip (lua_State *L, lyaml_loader *loader, int state,
+             const yaml_char_t *anchor, const yaml_char_t *tag)
+{
+   yaml_mark_t mark = loader->event.start_mark;
+   yaml_event_type_t type = loader->event.type;
+   lyaml_frame *frame;
+   size_t first, last;
+   int nested = 1, shared = 0, ctx;
+
+   if (!loader->lazydoc || loader->depth == 0 || anchor != NULL || tag != NULL)
+      return 0;
+   frame = loader->frames + loader->depth - 1;
+   if (frame->type == YAML_MAPPING_START_EVENT && frame->state != LOAD_VALUE)
+      return 0;
+   if (frame->type == YAML_SEQUENCE_START_EVENT && loader->depth > 1 &&
+       frame[-1].type == YAML_MAPPING_START_EVENT &&
+       frame[-1].state == LOAD_MERGE)
+      return 0;
+
+   while (nested > 0)
+   {
+      loader_parse (L, loader);
+      switch (loader->event.type)
+      {
+         case YAML_SEQUENCE_START_EVENT:
+            shared |= loader->event.data.sequence_start.anchor != NULL;
+            nested++;
+            break;
+         case YAML_MAPPING_START_EVENT:
+            shared |= loader->event.data.mapping_start.anchor != NULL;
+            nested++;
+            break;
+         case YAML_SEQUENCE_END_EVENT:
+         case YAML_MAPPING_END_EVENT:
+            nested--;
+            break;
+         case YAML_SCALAR_EVENT:
+            shared |= loader->event.data.scalar.anchor != NULL;
+            break;
+         case YAML_ALIAS_EVENT:
+            shared = 1;
+            break;
+         default:
+            loader_error (L, loader, "invalid event: %s",
+                          loader_typename (loader->event.type));
+      }
+   }
+
+   first = loader_offset (loader, mark.index) + loader->base;
+   last = loader_offset (loader, loader->event.end_mark.index) + loader->base;
+
+   lua_rawgeti (L, state, STATE_LAZY);
+   ctx = lua_gettop (L);
+   if (shared)
+   {
+      /* anchors must be seen by the rest of the document straight away */
+      loader_load_range (L, ctx, first, last, mark.column, state);
+   }
+   else
+   {
+      lua_newtable (L);
+
+      lua_rawgeti     (L, ctx, LAZY_RANGES);
+      lua_pushvalue   (L, -2);
+      lua_createtable (L, 3, 0);
+      lua_pushinteger (L, (lua_Integer) first);
+      lua_rawseti     (L, -2, 1);
+      lua_pushinteger (L, (lua_Integer) last);
+      lua_rawseti     (L, -2, 2);
+      lua_pushinteger (L, (lua_Integer) mark.column);
+      lua_rawseti     (L, -2, 3);
+      lua_rawset      (L, -3);
+      lua_pop         (L, 1);
+
+      lua_rawgeti      (L, ctx, LAZY_META);
+      lua_setmetatable (L, -2);
+   }
+   lua_remove (L, ctx);
+
+   loader_add_node (L, loader, state, type, NULL);
+   return 1;
+}
+
+static void
+load_ALIAS (lua_State *L, lyaml_loader *loader, int state)
+{
+#define EVENTF(_f)	(loader->event.data.alias._f)
+   yaml_event_type_t type;
+
+   lua_rawgeti     (L, state, STATE_NODETYPES);
+   lua_pushyamlstr (EVENTF (anchor));
+   lua_rawget      (L, -2);
+   if (lua_isnil (L, -1))
+      loader_error (L, loader, "invalid reference: %s",
+                    (const char *) EVENTF (anchor));
+   type = (yaml_event_type_t) lua_tointeger (L, -1);
+   lua_pop (L, 2);
+
+   lua_rawgeti     (L, state, STATE_ANCHORS);
+   lua_pushyamlstr (EVENTF (anchor));
+   lua_rawget      (L, -2);
+   lua_remove      (L, -2);
+
+   if (loader->max_alias_expansions >= 0)
+   {
+      lua_Integer size = 1;
+
+      /* a collection that is still open, referred to from inside itself,
+         has no size yet; walking it never ends anyway */
+      if (lua_type (L, -1) == LUA_TTABLE)
+      {
+         lua_rawgeti   (L, state, STATE_SIZES);
+         lua_pushvalue (L, -2);
+         lua_rawget    (L, -2);
+         if (lua_isnumber (L, -1))
+            size = lua_tointeger (L, -1);
+         lua_pop (L, 2);
+      }
+      loader->expansions += size;
+      if (OVERLIMIT (loader->expansions, loader->max_alias_expansions))
+         loader_error (L, loader,
+                       "alias expansion exceeds max_alias_expansions");
+      loader_grow (loader, size);
+   }
+
+   loader_add_node (L, loader, state, type, NULL);
+#undef EVENTF
+}
+
+static void
+load_SCALAR (lua_State *L, lyaml_loader *loader, int state)
+{
+#define EVENTF(_f)	(loader->event.data.scalar._f)
+   if (loader->stats)
+   {
+      double start = lyaml_clock ();
+
+      loader_push_scalar (L, loader, state);
+      loader->stats->resolve += lyaml_clock () - start;
+   }
+   else
+      loader_push_scalar (L, loader, state);
+   loader_grow        (loader, 1);
+   loader_add_anchor  (L, state, EVENTF (anchor), YAML_SCALAR_EVENT);
+   loader_add_node    (L, loader, state, YAML_SCALAR_EVENT,
+                       (const char *) EVENTF (tag));
+#undef EVENTF
+}
+
+static void
+load_SEQUENCE_START (lua_State *L, lyaml_loader *loader, int state)
+{
+#define EVENTF(_f)	(loader->event.data.sequence_start._f)
+   if (loader_skip (L, loader, state, EVENTF (anchor), EVENTF (tag)))
+      return;
+   lua_newtable      (L);
+   loader_add_anchor (L, state, EVENTF (anchor), YAML_SEQUENCE_START_EVENT);
+   loader_push_frame (L, loader, state, YAML_SEQUENCE_START_EVENT);
+   loader->frames[loader->depth - 1].anchored = EVENTF (anchor) != NULL;
+#undef EVENTF
+}
+
+static void
+load_MAPPING_START (lua_State *L, lyaml_loader *loader, int state)
+{
+#define EVENTF(_f)	(loader->event.data.mapping_start._f)
+   if (loader_skip (L, loader, state, EVENTF (anchor), EVENTF (tag)))
+      return;
+   lua_newtable      (L);
+   loader_add_anchor (L, state, EVENTF (anchor), YAML_MAPPING_START_EVENT);
+   loader_push_frame (L, loader, state, YAML_MAPPING_START_EVENT);
+   loader->frames[loader->depth - 1].anchored = EVENTF (anchor) != NULL;
+#undef EVENTF
+}
+
+static void
+load_DOCUMENT_START (lua_State *L, lyaml_loader *loader, int state)
+{
+#define EVENTF(_f)	(loader->event.data.document_start._f)
+   (void) L;
+   (void) state;
+   loader->document_count++;
+
+   /* tag handles would be lost when loading a proxy's range by itself,
+      and aliases are only charged for as tables are built */
+   loader->lazydoc = loader->lazy && loader->max_alias_expansions < 0 &&
+      EVENTF (tag_directives.start) == EVENTF (tag_directives.end);
+#undef EVENTF
+}
+
+static void
+load_DOCUMENT_END (lua_State *L, lyaml_loader *loader, int state)
+{
+   /* forget this document's anchors, so nothing else refers to it */
+   loader_reset_anchors (L, state);
+   if (loader->max_alias_expansions >= 0)
+   {
+      lua_newtable (L);
+      lua_rawseti  (L, state, STATE_SIZES);
+   }
+}
+
+/* Parse and process events until the end of the next document, and leave
+   its root node in the STATE_DOCUMENT slot.  Return 0 at the end of the
+   stream instead; or with the yield_every option, LOADER_PAUSED once the
+   budget of events for this step has been used up. */
+static int
+loader_next (lua_State *L, lyaml_loader *loader, int state)
+{
+   if (loader->finished)
+      return 0;
+
+   if (!loader->started)
+   {
+      loader_parse (L, loader);
+      if (loader->event.type != YAML_STREAM_START_EVENT)
+         loader_error (L, loader, "expecting STREAM_START event, but got %s",
+                       loader_typename (loader->event.type));
+      loader->started = 1;
+
+      /* proxy ranges are found by counting UTF-8 characters */
+      if (loader->event.data.stream_start.encoding != YAML_UTF8_ENCODING)
+         loader->lazy = 0;
+   }
+
+   for (;;)
+   {
+      if (loader->yield_every > 0 && loader->budget-- <= 0)
+         return LOADER_PAUSED;
+      loader_parse (L, loader);
+      switch (loader->event.type)
+      {
+#define MENTRY(_s)		\
+         case YAML_##_s##_EVENT: load_##_s (L, loader, state); break
+         MENTRY( SCALAR		);
+         MENTRY( ALIAS		);
+         MENTRY( SEQUENCE_START	);
+         MENTRY( MAPPING_START	);
+         MENTRY( DOCUMENT_START	);
+#undef MENTRY
+
+         case YAML_DOCUMENT_END_EVENT:
+            load_DOCUMENT_END (L, loader, state);
+            return 1;
+
+         case YAML_SEQUENCE_END_EVENT:
+         case YAML_MAPPING_END_EVENT:
+            loader_pop_frame (L, loader, state);
+            break;
+
+         case YAML_STREAM_END_EVENT:
+            loader_delete_event (loader);
+            loader->finished = 1;
+            return 0;
+
+         default:
+            loader_error (L, loader, "invalid event: %s",
+                          loader_typename (loader->event.type));
+      }
+   }
+}
+
+static int
+loader_gc (lua_State *L)
+{
+   lyaml_loader *loader = (lyaml_loader *) lua_touserdata (L, 1);
+
+   if (loader)
+   {
+      loader_delete_event (loader);
+      yaml_parser_delete (&loader->parser);
+      lyaml_input_delete (L, &loader->input);
+      free (loader->frames);
+      loader->frames = NULL;
+   }
+   return 0;
+}
+
+void
+loader_init (lua_State *L)
+{
+   luaL_newmetatable (L, "lyaml.loader");
+   lua_pushcfunction (L, loader_gc);
+   lua_setfield      (L, -2, "__gc");
+}
+
+
+/* Load the contents of the lazy proxy at IDX, and turn it into an
+   ordinary table.  The lazy loading context is upvalue 1 of the running
+   metamethod. */
+static void
+lazy_materialize (lua_State *L, int idx)
+{
+   int ctx = lua_upvalueindex (1);
+   size_t first, last, column;
+
+   lua_rawgeti   (L, ctx, LAZY_RANGES);
+   lua_pushvalue (L, idx);
+   lua_rawget    (L, -2);
+   if (lua_isnil (L, -1))
+   {
+      lua_pop (L, 2);
+      return;
+   }
+   lua_rawgeti (L, -1, 1);
+   lua_rawgeti (L, -2, 2);
+   lua_rawgeti (L, -3, 3);
+   first  = (size_t) lua_tointeger (L, -3);
+   last   = (size_t) lua_tointeger (L, -2);
+   column = (size_t) lua_tointeger (L, -1);
+   lua_pop (L, 4);
+
+   loader_load_range (L, ctx, first, last, column, 0);
+   lua_pushnil (L);
+   while (lua_next (L, -2) != 0)
+   {
+      lua_pushvalue (L, -2);
+      lua_insert    (L, -2);
+      lua_rawset    (L, idx);
+   }
+   lua_pop (L, 1);
+
+   /* only forget the range once it has loaded without error */
+   lua_pushvalue (L, idx);
+   lua_pushnil   (L);
+   lua_rawset    (L, -3);
+   lua_pop       (L, 1);
+
+   lua_pushnil      (L);
+   lua_setmetatable (L, idx);
+}
+
+static int
+lazy_index (lua_State *L)
+{
+   lazy_materialize (L, 1);
+   lua_settop (L, 2);
+   lua_rawget (L, 1);
+   return 1;
+}
+
+static int
+lazy_newindex (lua_State *L)
+{
+   lazy_materialize (L, 1);
+   lua_settop (L, 3);
+   lua_rawset (L, 1);
+   return 0;
+}
+
+static int
+lazy_len (lua_State *L)
+{
+   lazy_materialize (L, 1);
+   lua_pushinteger (L, (lua_Integer) lua_objlen (L, 1));
+   return 1;
+}
+
+static int
+lazy_next (lua_State *L)
+{
+   luaL_checktype (L, 1, LUA_TTABLE);
+   lua_settop (L, 2);
+   if (lua_next (L, 1))
+      return 2;
+   lua_pushnil (L);
+   return 1;
+}
+
+static int
+lazy_pairs (lua_State *L)
+{
+   lazy_materialize (L, 1);
+   lua_pushcfunction (L, lazy_next);
+   lua_pushvalue     (L, 1);
+   lua_pushnil       (L);
+   return 3;
+}
+
+/* If the value at IDX is a lazy proxy, load its contents now, for the
+   benefit of code that uses lua_next or lua_rawget directly. */
+void
+lyaml_materialize (lua_State *L, int idx)
+{
+   int top = lua_gettop (L);
+
+   if (idx < 0)
+      idx = top + idx + 1;
+   if (lua_type (L, idx) != LUA_TTABLE || !lua_getmetatable (L, idx))
+      return;
+   lua_getfield (L, -1, "__name");
+   if (lua_type (L, -1) == LUA_TSTRING && STREQ (lua_tostring (L, -1), LAZY_NAME))
+      luaL_callmeta (L, idx, "__len");
+   lua_settop (L, top);
+}
+
+/* Start lazy loading with LOADER, whose source string is in the first
+   argument slot and starts at byte BASE of the lazy loading context CTX. */
+static void
+loader_set_lazy (lua_State *L, lyaml_loader *loader, int state, int ctx,
+                 size_t base)
+{
+   loader->source = (const unsigned char *)
+      lua_tolstring (L, 1, &loader->sourcelen);
+   loader->base = base;
+   loader->lazy = 1;
+
+   lua_pushvalue (L, ctx);
+   lua_rawseti   (L, state, STATE_LAZY);
+}
+
+/* Create a new lazy loading context for the string and options in the
+   first two argument slots, and start lazy loading with LOADER. */
+static void
+loader_new_lazy (lua_State *L, lyaml_loader *loader, int state)
+{
+   int ctx;
+
+   lua_createtable (L, 4, 0);
+   ctx = lua_gettop (L);
+
+   lua_pushvalue (L, 1);
+   lua_rawseti   (L, ctx, LAZY_SOURCE);
+
+   /* proxies are loaded one document at a time, with the same options */
+   lua_newtable (L);
+   lua_pushnil  (L);
+   while (lua_next (L, 2) != 0)
+   {
+      const char *k = lua_tostring (L, -2);
+
+      if (lua_type (L, -2) == LUA_TSTRING && (STREQ (k, "all") || STREQ (k, "lazy")))
+         lua_pop (L, 1);
+      else
+      {
+         lua_pushvalue (L, -2);
+         lua_insert    (L, -2);
+         lua_rawset    (L, -4);
+      }
+   }
+   lua_rawseti (L, ctx, LAZY_OPTIONS);
+
+   lua_newtable       (L);
+   lua_createtable    (L, 0, 1);
+   lua_pushliteral    (L, "k");
+   lua_setfield       (L, -2, "__mode");
+   lua_setmetatable   (L, -2);
+   lua_rawseti        (L, ctx, LAZY_RANGES);
+
+   lua_createtable (L, 0, 5);
+   lua_pushliteral (L, LAZY_NAME);
+   lua_setfield    (L, -2, "__name");
+#define MENTRY(_s)				\
+   lua_pushvalue    (L, ctx);			\
+   lua_pushcclosure (L, lazy_##_s, 1);		\
+   lua_setfield     (L, -2, "__" #_s)
+   MENTRY( index	);
+   MENTRY( newindex	);
+   MENTRY( len		);
+   MENTRY( pairs	);
+#undef MENTRY
+   lua_rawseti (L, ctx, LAZY_META);
+
+   loader_set_lazy (L, loader, state, ctx, 0);
+   lua_pop (L, 1);
+}
+
+/* Create a loader for the options table in the second argument slot,
+   reading from the file at PATH, or from the input in the first slot if
+   PATH is NULL; and push it followed by its state table.  Any further
+   arguments are left where they are, for the caller. */
+static lyaml_loader *
+loader_new (lua_State *L, const char *path)
+{
+   lyaml_loader *loader;
+   int state;
+
+   /* requires an input argument, and an optional options table */
+   if (!lua_isnoneornil (L, 2))
+      luaL_checktype (L, 2, LUA_TTABLE);
+   if (lua_gettop (L) < 2)
+      lua_settop (L, 2);
+
+   /* create a user datum to store the loader */
+   loader = (lyaml_loader *) lua_newuserdata (L, sizeof (*loader));
+   memset ((void *) loader, 0, sizeof (*loader));
+
+   /* set its metatable */
+   luaL_getmetatable (L, "lyaml.loader");
+   lua_setmetatable  (L, -2);
+
+   /* try to initialize the parser */
+   if (yaml_parser_initialize (&loader->parser) == 0)
+      luaL_error (L, "cannot initialize parser");
+
+   /* requires a file name, a tape, or a string, file handle or reader
+      function */
+   if (path != NULL)
+      lyaml_input_set_file (L, path, &loader->parser, &loader->input);
+   else if ((loader->tape = lyaml_totape (L, 1)) != NULL)
+      lyaml_input_set_tape (L, 1, &loader->input);
+   else
+      lyaml_input_set (L, 1, &loader->parser, &loader->input);
+
+   /* create the state table, and copy in the options */
+   lua_createtable (L, STATE_FRAMES + 2 * 16, 0);
+   state = lua_gettop (L);
+   loader->max_depth = loader->max_nodes = -1;
+   loader->max_alias_expansions = loader->max_scalar_bytes = -1;
+   if (lua_istable (L, 2))
+   {
+#define MENTRY(_s)					\
+      loader->_s = lyaml_checklimit (L, 2, #_s);	\
+      loader->limited |= loader->_s >= 0
+      MENTRY( max_depth			);
+      MENTRY( max_nodes			);
+      MENTRY( max_scalar_bytes		);
+#undef MENTRY
+      loader->max_alias_expansions =
+         lyaml_checklimit (L, 2, "max_alias_expansions");
+      if (loader->max_alias_expansions >= 0)
+      {
+         lua_newtable (L);
+         lua_rawseti  (L, state, STATE_SIZES);
+      }
+      lyaml_input_set_limit (L, 2, &loader->input);
+
+      lua_getfield (L, 2, "deadline");
+      if (!lua_isnil (L, -1))
+      {
+         if (!lua_isnumber (L, -1))
+            luaL_error (L, "deadline must be a number");
+         if (lua_tonumber (L, -1) < 0)
+            luaL_error (L, "deadline must not be negative");
+         loader->deadline = lyaml_clock () + lua_tonumber (L, -1);
+         loader->timed = 1;
+      }
+      lua_pop (L, 1);
+
+      lua_getfield (L, 2, "explicit_scalar");
+      lua_rawseti  (L, state, STATE_EXPLICIT);
+      lyaml_push_implicit (L, 2);
+      lua_rawseti  (L, state, STATE_IMPLICIT);
+
+      lua_getfield (L, 2, "scalar_cache");
+      if (!lua_isnil (L, -1))
+      {
+         /* a size too big to ever fill leaves the cache unbounded */
+         loader->cache_size = lyaml_checklimit (L, 2, "scalar_cache");
+         if (loader->cache_size < 0)
+            loader->cache_size = LUA_MAXINTEGER;
+      }
+      lua_pop (L, 1);
+      if (loader->cache_size > 0)
+      {
+         lua_newtable (L);
+         lua_rawseti  (L, state, STATE_CACHE);
+      }
+
+      lua_getfield (L, 2, "lazy");
+      if (lua_toboolean (L, -1))
+      {
+         if (path != NULL || lua_type (L, 1) != LUA_TSTRING)
+            luaL_argerror (L, 1, "lazy loading needs a string");
+         loader_new_lazy (L, loader, state);
+      }
+      lua_pop (L, 1);
+   }
+   loader_reset_anchors (L, state);
+
+   return loader;
+}
+
+/* Move the document just loaded from the state table to the stack. */
+static void
+loader_push_document (lua_State *L, int state)
+{
+   lua_rawgeti (L, state, STATE_DOCUMENT);
+   lua_pushnil (L);
+   lua_rawseti (L, state, STATE_DOCUMENT);
+}
+
+/* Load a proxy's range of the lazy source string, in the first argument
+   slot, with the lazy loading context, the base offset and the state
+   table to share anchors with, if any, as upvalues. */
+static int
+lazy_load (lua_State *L)
+{
+   lyaml_loader *loader = loader_new (L, NULL);
+   int state = lua_gettop (L);
+   int shared = lua_upvalueindex (3);
+
+   if (lua_isnil (L, shared))
+      loader_set_lazy (L, loader, state, lua_upvalueindex (1),
+                       (size_t) lua_tointeger (L, lua_upvalueindex (2)));
+   else
+   {
+      lua_rawgeti (L, shared, STATE_ANCHORS);
+      lua_rawseti (L, state, STATE_ANCHORS);
+      lua_rawgeti (L, shared, STATE_NODETYPES);
+      lua_rawseti (L, state, STATE_NODETYPES);
+   }
+
+   loader_next (L, loader, state);
+   loader_push_document (L, state);
+   return 1;
+}
+
+/* With the `threads` option, record a string or mapped file on a tape
+   with that many threads, and replay the tape instead of parsing the
+   input here.  Inputs that can't be split, or fail to parse, are left
+   to the usual parser, which reports any error in the usual way. */
+static void
+loader_parallel (lua_State *L, lyaml_loader *loader, int state)
+{
+   const unsigned char *s;
+   size_t len;
+   lua_Integer n;
+   double start;
+
+   lua_getfield (L, 2, "threads");
+   n = lua_tointeger (L, -1);
+   lua_pop (L, 1);
+   if (n < 2 || loader->tape != NULL || loader->lazy)
+      return;
+
+   if (loader->input.map != NULL)
+   {
+      s   = (const unsigned char *) loader->input.map;
+      len = loader->input.maplen;
+   }
+   else if (loader->input.source != LUA_NOREF &&
+            lua_type (L, 1) == LUA_TSTRING)
+      s = (const unsigned char *) lua_tolstring (L, 1, &len);
+   else
+      return;
+
+   start = loader->stats ? lyaml_clock () : 0;
+   loader->tape = lyaml_tape_parallel (L, s, len,
+                                       n > INT_MAX ? INT_MAX : (int) n);
+   if (loader->tape == NULL)
+      return;
+   lua_rawseti (L, state, STATE_TAPE);
+
+   if (loader->stats)
+   {
+      loader->stats->libyaml += lyaml_clock () - start;
+      loader->stats->bytes = len;
+   }
+}
+
+/* Replace the list of documents loaded on top of the stack with the
+   results of `yaml.load`: them all or just the first according to ALL,
+   and the scalar cache statistics if any; and return how many there are. */
+static int
+loader_results (lua_State *L, lyaml_loader *loader, int all)
+{
+   if (!all)
+   {
+      lua_rawgeti (L, -1, 1);
+      lua_replace (L, -2);
+   }
+   if (loader->cache_size == 0)
+      return 1;
+
+   /* the documents, and how well the scalar cache did */
+   loader_push_stats (L, loader);
+   return 2;
+}
+
+/* Load every document from LOADER, and return them all or just the
+   first according to the `all` option. */
+static int
+loader_load (lua_State *L, lyaml_loader *loader)
+{
+   int state = lua_gettop (L);
+   int all = 0;
+
+   loader->stats = lyaml_tostats (L);
+
+   if (lua_istable (L, 2))
+   {
+      lua_getfield (L, 2, "all");
+      all = lua_toboolean (L, -1);
+      lua_pop (L, 1);
+      loader_parallel (L, loader, state);
+   }
+
+   lua_newtable (L);
+   while (loader_next (L, loader, state))
+   {
+      loader_push_document (L, state);
+      lua_rawseti (L, -2, loader->document_count);
+   }
+   return loader_results (L, loader, all);
+}
+
+static int
+load_string (lua_State *L)
+{
+   return loader_load (L, loader_new (L, NULL));
+}
+
+static int
+load_file (lua_State *L)
+{
+   return loader_load (L, loader_new (L, luaL_checkstring (L, 1)));
+}
+
+int
+Pload (lua_State *L)
+{
+   return lyaml_stats_call (L, load_string);
+}
+
+int
+Pload_file (lua_State *L)
+{
+   return lyaml_stats_call (L, load_file);
+}
+
+/* Load up to yield_every more events, with the loader userdatum, its
+   state table, the list of documents loaded so far and the `all` option
+   as upvalues.  Return false if the stream isn't finished yet, or true
+   followed by the results of `yaml.load`. */
+static int
+load_step (lua_State *L)
+{
+   lyaml_loader *loader =
+      (lyaml_loader *) lua_touserdata (L, lua_upvalueindex (1));
+   int state, r;
+
+   /* the reader function must run in the calling thread */
+   loader->input.L = L;
+
+   lua_pushvalue (L, lua_upvalueindex (2));
+   state = lua_gettop (L);
+   lua_pushvalue (L, lua_upvalueindex (3));
+   loader->budget = loader->yield_every;
+   while ((r = loader_next (L, loader, state)) == 1)
+   {
+      loader_push_document (L, state);
+      lua_rawseti (L, -2, loader->document_count);
+   }
+   if (r == LOADER_PAUSED)
+   {
+      lua_pushboolean (L, 0);
+      return 1;
+   }
+
+   lua_pushboolean (L, 1);
+   lua_insert (L, -2);
+   return 1 + loader_results (L, loader,
+                              lua_toboolean (L, lua_upvalueindex (4)));
+}
+
+int
+Pload_steps (lua_State *L)
+{
+   lyaml_loader *loader = loader_new (L, NULL);
+
+   /* without the option, load everything in one step */
+   if (lua_istable (L, 2))
+      loader->yield_every = lyaml_checklimit (L, 2, "yield_every");
+   if (loader->yield_every < 0)
+      loader->yield_every = 0;
+
+   /* create and return the step function */
+   lua_newtable (L);
+   lua_pushboolean (L, 0);
+   if (lua_istable (L, 2))
+   {
+      lua_getfield (L, 2, "all");
+      lua_replace (L, -2);
+   }
+   lua_pushcclosure (L, load_step, 4);
+   return 1;
+}
+
+static int
+documents_iter (lua_State *L)
+{
+   lyaml_loader *loader =
+      (lyaml_loader *) lua_touserdata (L, lua_upvalueindex (1));
+   int state;
+
+   /* the reader function must run in the calling thread */
+   loader->input.L = L;
+
+   lua_pushvalue (L, lua_upvalueindex (2));
+   state = lua_gettop (L);
+   if (!loader_next (L, loader, state))
+      return 0;
+   loader_push_document (L, state);
+   if (loader->cache_size == 0)
+      return 1;
+
+   /* the document, and how well the scalar cache has done so far */
+   loader_push_stats (L, loader);
+   return 2;
+}
+
+int
+Pdocuments (lua_State *L)
+{
+   loader_new (L, NULL);
+
+   /* create and return the iterator function, with the loader userdatum
+      and its state table as upvalues */
+   lua_pushcclosure (L, documents_iter, 2);
+   return 1;
+}
+
+
+/* Path components for Pselect. */
+enum {
+   SELECT_KEY,		/* mapping value with key */
+   SELECT_INDEX,	/* sequence element at index */
+   SELECT_ANYKEY,	/* every mapping value */
+   SELECT_ANYINDEX	/* every sequence element */
+};
+
+typedef struct {
+   int		 kind;
+   const char	*key;	/* points into the path string */
+   size_t	 keylen;
+   lua_Integer	 index;
+} lyaml_component;
+
+typedef struct {
+   lyaml_component *comps;
+   int		    n;
+   int		    wildcard;	/* collect every match, not just the first */
+   int		    results;	/* stack index of the match list */
+   lua_Integer	    count;
+} lyaml_selector;
+
+/* Split PATH, at stack index IDX, into components of the form `key`,
+   `*`, `[n]`, `[*]` or `["key"]`, separated by dots before keys.  The
+   components are kept in a new userdatum pushed on the stack. */
+static void
+select_compile (lua_State *L, int idx, lyaml_selector *sel)
+{
+   const char *path = lua_tostring (L, idx), *p;
+   int n, ok = 0;
+
+   /* enough for every component, because each needs at least one byte */
+   sel->comps = (lyaml_component *)
+      lua_newuserdata (L, (strlen (path) + 1) * sizeof (*sel->comps));
+   sel->n = sel->wildcard = 0;
+
+   /* every break out of this loop is at an invalid component, with P
+      still within the path */
+   for (p = path, n = 0;; n++)
+   {
+      lyaml_component *c = sel->comps + n;
+
+      if (*p == '\0')
+      {
+         ok = 1;
+         break;
+      }
+
+      if (*p == '[')
+      {
+         p++;
+         if (*p == '"' || *p == '\'')
+         {
+            const char *e = strchr (p + 1, *p);
+
+            if (e == NULL || e[1] != ']')
+               break;
+            c->kind = SELECT_KEY;
+            c->key = p + 1;
+            c->keylen = (size_t) (e - p - 1);
+            p = e + 1;
+         }
+         else if (*p == '*')
+         {
+            c->kind = SELECT_ANYINDEX;
+            p++;
+         }
+         else
+         {
+            c->kind = SELECT_INDEX;
+            c->index = 0;
+            if (!isdigit ((unsigned char) *p))
+               break;
+            while (isdigit ((unsigned char) *p))
+               c->index = c->index * 10 + (*p++ - '0');
+            if (c->index == 0)
+               luaL_argerror (L, idx, "sequence indices start at 1");
+         }
+         if (*p != ']')
+            break;
+         p++;
+      }
+      else
+      {
+         if (n > 0)
+         {
+            if (*p != '.')
+               break;
+            p++;
+         }
+         c->key = p;
+         while (*p && *p != '.' && *p != '[')
+            p++;
+         c->keylen = (size_t) (p - c->key);
+         if (c->keylen == 0)
+            break;
+         c->kind = (c->keylen == 1 && *c->key == '*') ? SELECT_ANYKEY
+                                                       : SELECT_KEY;
+      }
+      sel->wildcard |= (c->kind == SELECT_ANYKEY || c->kind == SELECT_ANYINDEX);
+   }
+
+   if (!ok)
+   {
+      if (*p)
+         lua_pushfstring (L, "invalid path near '%s'", p);
+      else
+         lua_pushfstring (L, "invalid path '%s'", path);
+      luaL_argerror (L, idx, lua_tostring (L, -1));
+   }
+   sel->n = n;
+}
+
+/* Record the value on top of the stack as a match, and return 1 if the
+   search is over. */
+static int
+select_match (lua_State *L, lyaml_selector *sel)
+{
+   if (!sel->wildcard)
+      return 1;
+   lua_rawseti (L, sel->results, (int) ++sel->count);
+   return 0;
+}
+
+/* Build the node whose first event has just been parsed, and push it. */
+static void
+select_build (lua_State *L, lyaml_loader *loader, int state)
+{
+   for (;;)
+   {
+      switch (loader->event.type)
+      {
+         case YAML_SCALAR_EVENT:
+            load_SCALAR (L, loader, state);
+            break;
+         case YAML_ALIAS_EVENT:
+            load_ALIAS (L, loader, state);
+            break;
+         case YAML_SEQUENCE_START_EVENT:
+            load_SEQUENCE_START (L, loader, state);
+            break;
+         case YAML_MAPPING_START_EVENT:
+            load_MAPPING_START (L, loader, state);
+            break;
+         case YAML_SEQUENCE_END_EVENT:
+         case YAML_MAPPING_END_EVENT:
+            loader_pop_frame (L, loader, state);
+            break;
+         default:
+            loader_error (L, loader, "invalid event: %s",
+                          loader_typename (loader->event.type));
+      }
+      if (loader->depth == 0)
+         break;
+      loader_parse (L, loader);
+   }
+   loader_push_document (L, state);
+}
+
+/* Return the anchor of the event just parsed, if any. */
+static const yaml_char_t *
+select_anchor (lyaml_loader *loader)
+{
+   switch (loader->event.type)
+   {
+      case YAML_SCALAR_EVENT:
+         return loader->event.data.scalar.anchor;
+      case YAML_SEQUENCE_START_EVENT:
+         return loader->event.data.sequence_start.anchor;
+      case YAML_MAPPING_START_EVENT:
+         return loader->event.data.mapping_start.anchor;
+      default:
+         return NULL;
+   }
+}
+
+/* Skip over the node whose first event has just been parsed, without
+   building anything except anchored nodes, which later aliases in the
+   stream might select. */
+static void
+select_skip (lua_State *L, lyaml_loader *loader, int state)
+{
+   int nested = 0;
+
+   do
+   {
+      if (nested > 0)
+         loader_parse (L, loader);
+      if (select_anchor (loader) != NULL)
+      {
+         select_build (L, loader, state);
+         lua_pop (L, 1);
+         continue;
+      }
+      switch (loader->event.type)
+      {
+         case YAML_SEQUENCE_START_EVENT:
+         case YAML_MAPPING_START_EVENT:
+            nested++;
+            break;
+         case YAML_SEQUENCE_END_EVENT:
+         case YAML_MAPPING_END_EVENT:
+            nested--;
+            break;
+         default:
+            break;
+      }
+   }
+   while (nested > 0);
+}
+
+/* Match the already built value at IDX against the path from component
+   POS on, and return 1 if the search is over, with the match pushed. */
+static int
+select_table (lua_State *L, lyaml_selector *sel, int pos, int idx)
+{
+   lyaml_component *c = sel->comps + pos;
+   int top = lua_gettop (L), r = 0;
+
+   luaL_checkstack (L, 4, "path too long");
+   if (pos == sel->n)
+   {
+      lua_pushvalue (L, idx);
+      return select_match (L, sel);
+   }
+   if (lua_type (L, idx) != LUA_TTABLE || lyaml_isnull (L, idx))
+      return 0;
+
+   switch (c->kind)
+   {
+      case SELECT_KEY:
+         /* keys were resolved when the table was built */
+         lua_pushlstring (L, c->key, c->keylen);
+         lua_rawget      (L, idx);
+         if (lua_isnil (L, -1))
+         {
+            lua_pop (L, 1);
+            if (lyaml_resolve_implicit (L, c->key, c->keylen))
+               lua_rawget (L, idx);
+            else
+               lua_pushnil (L);
+         }
+         r = !lua_isnil (L, -1) && select_table (L, sel, pos + 1, top + 1);
+         break;
+
+      case SELECT_INDEX:
+         lua_rawgeti (L, idx, (int) c->index);
+         r = !lua_isnil (L, -1) && select_table (L, sel, pos + 1, top + 1);
+         break;
+
+      case SELECT_ANYINDEX:
+      {
+         int i, n = (int) lua_objlen (L, idx);
+
+         for (i = 1; !r && i <= n; i++)
+         {
+            lua_rawgeti (L, idx, i);
+            r = select_table (L, sel, pos + 1, top + 1);
+            lua_settop  (L, top);
+         }
+         break;
+      }
+
+      case SELECT_ANYKEY:
+         lua_pushnil (L);
+         while (!r && lua_next (L, idx) != 0)
+         {
+            r = select_table (L, sel, pos + 1, top + 2);
+            lua_settop (L, top + 1);
+         }
+         break;
+   }
+
+   /* leave just the match of a finished search */
+   if (r)
+      lua_replace (L, top + 1);
+   lua_settop (L, top + r);
+   return r;
+}
+
+/* Match the node whose first event has just been parsed against the
+   path from component POS on, consuming all of its events, and return 1
+   if the search is over.  The result of a finished search is left on
+   top of the stack. */
+static int
+select_node (lua_State *L, lyaml_loader *loader, int state,
+             lyaml_selector *sel, int pos)
+{
+   lyaml_component *c = sel->comps + pos;
+
+   if (pos == sel->n)
+   {
+      select_build (L, loader, state);
+      return select_match (L, sel);
+   }
+
+   /* follow aliases and anchored nodes through the built tables */
+   if (loader->event.type == YAML_ALIAS_EVENT ||
+       select_anchor (loader) != NULL)
+   {
+      int r;
+
+      select_build (L, loader, state);
+      r = select_table (L, sel, pos, lua_gettop (L));
+      if (r)
+         lua_remove (L, -2);
+      else
+         lua_pop (L, 1);
+      return r;
+   }
+
+   if (loader->event.type == YAML_SEQUENCE_START_EVENT)
+   {
+      lua_Integer n = 0;
+
+      for (;;)
+      {
+         loader_parse (L, loader);
+         if (loader->event.type == YAML_SEQUENCE_END_EVENT)
+            break;
+         n++;
+         if (c->kind == SELECT_ANYINDEX ||
+             (c->kind == SELECT_INDEX && c->index == n))
+         {
+            if (select_node (L, loader, state, sel, pos + 1))
+               return 1;
+         }
+         else
+            select_skip (L, loader, state);
+      }
+   }
+   else if (loader->event.type == YAML_MAPPING_START_EVENT)
+   {
+      for (;;)
+      {
+         int match;
+
+         loader_parse (L, loader);
+         if (loader->event.type == YAML_MAPPING_END_EVENT)
+            break;
+
+         match = c->kind == SELECT_ANYKEY ||
+            (c->kind == SELECT_KEY &&
+             loader->event.type == YAML_SCALAR_EVENT &&
+             loader->event.data.scalar.length == c->keylen &&
+             memcmp (loader->event.data.scalar.value, c->key, c->keylen) == 0);
+         select_skip (L, loader, state);
+
+         loader_parse (L, loader);
+         if (match)
+         {
+            if (select_node (L, loader, state, sel, pos + 1))
+               return 1;
+         }
+         else
+            select_skip (L, loader, state);
+      }
+   }
+   /* scalars have nothing to descend into */
+   return 0;
+}
+
+/* yaml.select (input, path, opts): return the node at PATH in the first
+   document of INPUT that has one, or with wildcards in PATH, a list of
+   every matching node in every document; building nothing else. */
+int
+Pselect (lua_State *L)
+{
+   lyaml_loader *loader;
+   lyaml_selector sel;
+   int state;
+
+   luaL_checkstring (L, 2);
+   lua_settop    (L, 3);
+   lua_pushvalue (L, 2);
+   lua_remove    (L, 2);	/* input, opts, path */
+
+   loader = loader_new (L, NULL);
+   state = lua_gettop (L);
+   select_compile (L, 3, &sel);
+   if (sel.wildcard)
+      lua_newtable (L);
+   sel.results = lua_gettop (L);
+   sel.count = 0;
+
+   loader_parse (L, loader);
+   if (loader->event.type != YAML_STREAM_START_EVENT)
+      loader_error (L, loader, "expecting STREAM_START event, but got %s",
+                    loader_typename (loader->event.type));
+
+   for (;;)
+   {
+      loader_parse (L, loader);
+      switch (loader->event.type)
+      {
+         case YAML_STREAM_END_EVENT:
+            if (sel.wildcard)
+               lua_settop (L, sel.results);
+            else
+               lua_pushnil (L);
+            return 1;
+
+         case YAML_DOCUMENT_START_EVENT:
+            load_DOCUMENT_START (L, loader, state);
+            break;
+
+         case YAML_DOCUMENT_END_EVENT:
+            load_DOCUMENT_END (L, loader, state);
+            break;
+
+         default:
+            if (select_node (L, loader, state, &sel, 0))
+               return 1;
+      }
+   }
+}
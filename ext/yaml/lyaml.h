@@ -26,6 +26,8 @@
 #ifndef LYAML_H
 #define LYAML_H 1
 
+#include <stdint.h>
+
 #include <yaml.h>
 
 #include <lua.h>
@@ -40,6 +42,10 @@
 #  define luaL_register(L,n,l) (luaL_newlib(L,l))
 #endif
 
+#ifndef LUA_MAXINTEGER
+#  define LUA_MAXINTEGER	PTRDIFF_MAX	/* lua_Integer before Lua 5.3 */
+#endif
+
 #ifndef STREQ
 #define STREQ !strcmp
 #endif
@@ -147,15 +153,146 @@
 	}
 
 
+/* Parser input source, see input.c.  Registry references to Lua values
+   are LUA_NOREF when unused. */
+typedef struct {
+   lua_State	*L;		/* thread calling the parser */
+   FILE		*fp;		/* file handle input */
+   int		 ownfp;		/* fp was opened by lyaml_input_set_file */
+   void		*map;		/* read-only mapping of a named file */
+   size_t	 maplen;
+   int		 source;	/* string, file handle or reader function */
+   int		 chunk;		/* last string returned by the reader */
+   size_t	 chunklen;
+   size_t	 offset;	/* bytes of chunk already consumed */
+   int		 error;		/* error value from the last read */
+   size_t	 total;		/* bytes handed to libyaml so far */
+   size_t	 limit;		/* max_input_bytes option, or SIZE_MAX */
+} lyaml_input;
+
+/* Emitter output sink, see output.c. */
+typedef struct {
+   lua_State	*L;		/* thread calling the emitter */
+   FILE		*fp;		/* file handle sink */
+   int		 sink;		/* sink function or file handle */
+   int		 error;		/* error value from the last write */
+   char		*buffer;	/* pending output, if flush_bytes > 0 */
+   size_t	 len;
+   size_t	 flush_bytes;
+   size_t	 bytes;		/* total written so far */
+} lyaml_output;
+
+/* Counters for the stats option, see stats.c. */
+typedef struct {
+   lua_Alloc	 allocf;	/* the allocator being counted */
+   void		*allocud;
+   size_t	 allocs;	/* blocks allocated */
+   size_t	 alloc_bytes;	/* bytes allocated, or blocks grown by */
+   size_t	 free_bytes;	/* bytes freed, or blocks shrunk by */
+   size_t	 bytes;		/* bytes parsed or emitted */
+   lua_Integer	 events[YAML_MAPPING_END_EVENT + 1];
+   lua_Integer	 anchors;
+   double	 libyaml;	/* seconds inside the parser or emitter */
+   double	 resolve;	/* seconds resolving scalars */
+} lyaml_stats;
+
+
+/* Events recorded from a parser, see tape.c. */
+typedef struct lyaml_tape lyaml_tape;
+
+
+/* from compiler.c */
+extern int	Pcompile	(lua_State *L);
+extern int	Pdigest		(lua_State *L);
+extern int	Pload_compiled	(lua_State *L);
+
+/* from dumper.c */
+extern void	dumper_init	(lua_State *L);
+extern int	Pdump		(lua_State *L);
+
 /* from emitter.c */
 extern int	Pemitter	(lua_State *L);
 
+/* from input.c */
+extern FILE *	lyaml_tofile		(lua_State *L, int idx);
+extern void	lyaml_input_set		(lua_State *L, int idx,
+					 yaml_parser_t *parser,
+					 lyaml_input *input);
+extern void	lyaml_input_set_file	(lua_State *L, const char *path,
+					 yaml_parser_t *parser,
+					 lyaml_input *input);
+extern void	lyaml_input_set_tape	(lua_State *L, int idx,
+					 lyaml_input *input);
+extern int	lyaml_input_error	(lua_State *L, lyaml_input *input);
+extern size_t	lyaml_checksize		(lua_State *L, const char *name);
+extern lua_Integer lyaml_checklimit	(lua_State *L, int idx,
+					 const char *name);
+extern void	lyaml_input_set_limit	(lua_State *L, int idx,
+					 lyaml_input *input);
+extern int	lyaml_input_overlimit	(const lyaml_input *input);
+extern void	lyaml_input_delete	(lua_State *L, lyaml_input *input);
+
+/* from loader.c */
+extern void	loader_init	(lua_State *L);
+extern void	lyaml_materialize	(lua_State *L, int idx);
+extern int	Pdocuments	(lua_State *L);
+extern int	Pload		(lua_State *L);
+extern int	Pload_file	(lua_State *L);
+extern int	Pload_steps	(lua_State *L);
+extern int	Pselect		(lua_State *L);
+
+/* from output.c */
+extern size_t	lyaml_flush_bytes	(lua_State *L, int idx);
+extern void	lyaml_output_set	(lua_State *L, int idx,
+					 yaml_emitter_t *emitter,
+					 lyaml_output *output,
+					 size_t flush_bytes);
+extern int	lyaml_output_flush	(lyaml_output *output);
+extern int	lyaml_output_error	(lua_State *L, lyaml_output *output);
+extern void	lyaml_output_delete	(lua_State *L, lyaml_output *output);
+
 /* from parser.c */
 extern void	parser_init	(lua_State *L);
 extern int	Pparser		(lua_State *L);
+extern int	Pparser_file	(lua_State *L);
+extern void	push_init	(lua_State *L);
+extern int	Ppush_parser	(lua_State *L);
+
+/* from resolver.c */
+extern void	lyaml_pushnull		(lua_State *L);
+extern int	lyaml_isnull		(lua_State *L, int idx);
+extern int	lyaml_resolve_implicit	(lua_State *L, const char *s,
+					 size_t len);
+extern int	lyaml_resolve_explicit	(lua_State *L, const char *tag,
+					 const char *s, size_t len);
+extern void	lyaml_push_implicit	(lua_State *L, int idx);
+extern int	Presolve_implicit	(lua_State *L);
+extern int	lyaml_scalar_style	(lua_State *L, const char *s,
+					 size_t len);
+extern int	Pscalar_style		(lua_State *L);
 
 /* from scanner.c */
 extern void	scanner_init	(lua_State *L);
 extern int	Pscanner	(lua_State *L);
 
+/* from stats.c */
+extern double	lyaml_clock		(void);
+extern void	lyaml_stats_event	(lyaml_stats *stats,
+					 const yaml_event_t *event);
+extern lyaml_stats *lyaml_tostats	(lua_State *L);
+extern int	lyaml_stats_call	(lua_State *L, lua_CFunction f);
+
+/* from tape.c */
+extern void	tape_init		(lua_State *L);
+extern lyaml_tape *lyaml_totape		(lua_State *L, int idx);
+extern size_t	lyaml_tape_length	(const lyaml_tape *tape);
+extern int	lyaml_tape_event	(const lyaml_tape *tape, size_t i,
+					 yaml_event_t *event);
+extern int	lyaml_tape_initialize_event (const lyaml_tape *tape, size_t i,
+					 yaml_event_t *event);
+extern lyaml_tape *lyaml_tape_parallel	(lua_State *L,
+					 const unsigned char *s, size_t len,
+					 int nthreads);
+extern int	Ptape			(lua_State *L);
+
 #endif
@@ -0,0 +1,178 @@
+/*
+ * output.c, libyaml emitter output sinks for lyaml
+ *
+ * Copyright (C) 2013-2020 Gary V. Vaughan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Pass libyaml emitter output on to an open Lua file handle, or to a sink
+   function called with each chunk, as it is written rather than gathering
+   the whole stream into one string.  libyaml flushes its own buffer at
+   the end of every document; with a non-zero flush_bytes, output is also
+   gathered here until at least that many bytes are pending. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lyaml.h"
+
+
+/* Save the error message on top of the stack, to be reported after
+   libyaml has given up on the write. */
+static int
+output_seterror (lua_State *L, lyaml_output *output)
+{
+   luaL_unref (L, LUA_REGISTRYINDEX, output->error);
+   output->error = luaL_ref (L, LUA_REGISTRYINDEX);
+   return 0;
+}
+
+/* Hand LEN bytes at BUFF straight to the sink. */
+static int
+output_send (lyaml_output *output, const char *buff, size_t len)
+{
+   lua_State *L = output->L;
+
+   if (len == 0)
+      return 1;
+
+   if (output->fp != NULL)
+   {
+      if (fwrite (buff, 1, len, output->fp) != len)
+      {
+         lua_pushfstring (L, "write error: %s", strerror (errno));
+         return output_seterror (L, output);
+      }
+      return 1;
+   }
+
+   lua_rawgeti     (L, LUA_REGISTRYINDEX, output->sink);
+   lua_pushlstring (L, buff, len);
+   if (lua_pcall (L, 1, 0, 0) != 0)
+      return output_seterror (L, output);
+   return 1;
+}
+
+static int
+output_write (void *data, unsigned char *buff, size_t len)
+{
+   lyaml_output *output = (lyaml_output *) data;
+
+   output->bytes += len;
+
+   /* too big to be worth copying, or nowhere to put it */
+   if (output->buffer == NULL ||
+       (output->len == 0 && len >= output->flush_bytes))
+      return output_send (output, (const char *) buff, len);
+
+   if (output->len + len > output->flush_bytes)
+   {
+      if (!lyaml_output_flush (output))
+         return 0;
+      if (len >= output->flush_bytes)
+         return output_send (output, (const char *) buff, len);
+   }
+
+   memcpy (output->buffer + output->len, buff, len);
+   output->len += len;
+   if (output->len == output->flush_bytes)
+      return lyaml_output_flush (output);
+   return 1;
+}
+
+
+/* Return the flush_bytes field of the options table at IDX, or 0. */
+size_t
+lyaml_flush_bytes (lua_State *L, int idx)
+{
+   size_t n = 0;
+
+   lua_getfield (L, idx, "flush_bytes");
+   if (!lua_isnil (L, -1))
+      n = lyaml_checksize (L, "flush_bytes");
+   lua_pop (L, 1);
+   return n;
+}
+
+/* Set the output of EMITTER to the sink function or file handle at IDX,
+   which is kept alive in the registry until lyaml_output_delete.  Output
+   is gathered into chunks of FLUSH_BYTES, or passed on as it comes
+   from libyaml if that is 0. */
+void
+lyaml_output_set (lua_State *L, int idx, yaml_emitter_t *emitter,
+                  lyaml_output *output, size_t flush_bytes)
+{
+   output->L           = L;
+   output->fp          = NULL;
+   output->sink        = LUA_NOREF;
+   output->error       = LUA_NOREF;
+   output->buffer      = NULL;
+   output->len         = 0;
+   output->flush_bytes = flush_bytes;
+   output->bytes       = 0;
+
+   if (!lua_isfunction (L, idx) && (output->fp = lyaml_tofile (L, idx)) == NULL)
+      luaL_error (L, "sink must be a function or file");
+
+   lua_pushvalue (L, idx);
+   output->sink = luaL_ref (L, LUA_REGISTRYINDEX);
+
+   if (flush_bytes > 0)
+   {
+      output->buffer = (char *) malloc (flush_bytes);
+      if (output->buffer == NULL)
+         luaL_error (L, "cannot allocate output buffer");
+   }
+   yaml_emitter_set_output (emitter, &output_write, output);
+}
+
+/* Send any pending output to the sink.  Return 0 on error. */
+int
+lyaml_output_flush (lyaml_output *output)
+{
+   size_t len = output->len;
+
+   output->len = 0;
+   return output_send (output, output->buffer, len);
+}
+
+/* If the last write failed, push the saved error value and return 1. */
+int
+lyaml_output_error (lua_State *L, lyaml_output *output)
+{
+   if (output->error == LUA_NOREF)
+      return 0;
+   lua_rawgeti (L, LUA_REGISTRYINDEX, output->error);
+   return 1;
+}
+
+/* Release the buffer and registry references held by OUTPUT. */
+void
+lyaml_output_delete (lua_State *L, lyaml_output *output)
+{
+   if (output->L == NULL)
+      return;	/* never set */
+   luaL_unref (L, LUA_REGISTRYINDEX, output->sink);
+   luaL_unref (L, LUA_REGISTRYINDEX, output->error);
+   output->sink = output->error = LUA_NOREF;
+   free (output->buffer);
+   output->buffer = NULL;
+}
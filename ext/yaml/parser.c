@@ -23,6 +23,14 @@
  * THE SOFTWARE.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#  include <pthread.h>
+#endif
+
 #include "lyaml.h"
 
 typedef struct {
@@ -31,6 +39,16 @@ typedef struct {
    yaml_event_t	  event;
    char		  validevent;
    int		  document_count;
+   lyaml_input	  input;
+
+   /* marks of the last event, for the mark method */
+   yaml_mark_t	  start_mark;
+   yaml_mark_t	  end_mark;
+
+   /* options */
+   char		  marks;	/* add start_mark and end_mark tables */
+   char		  reuse;	/* refill the same table for every event */
+   char		  codes;	/* integer type, style and encoding fields */
 } lyaml_parser;
 
 
@@ -44,33 +62,74 @@ parser_delete_event (lyaml_parser *parser)
    }
 }
 
-/* With the event result table on the top of the stack, insert
-   a mark entry. */
+/* Push a new mark table. */
 static void
-parser_set_mark (lua_State *L, const char *k, yaml_mark_t mark)
+parser_push_mark (lua_State *L, yaml_mark_t mark)
 {
-   lua_pushstring  (L, k);
    lua_createtable (L, 0, 3);
 #define MENTRY(_s)	RAWSET_INTEGER(#_s, mark._s)
         MENTRY( index	);
         MENTRY( line	);
         MENTRY( column	);
 #undef MENTRY
+}
+
+/* With the event result table on the top of the stack, insert
+   a mark entry. */
+static void
+parser_set_mark (lua_State *L, const char *k, yaml_mark_t mark)
+{
+   lua_pushstring   (L, k);
+   parser_push_mark (L, mark);
    lua_rawset (L, -3);
 }
 
-/* Push a new event table, pre-populated with shared elements. */
+/* With the event result table on the top of the stack, insert an
+   enumerated field K, as NAME or as its integer CODE. */
+static void
+parser_set_code (lyaml_parser *parser, const char *k, const char *name,
+                 int code)
+{
+   lua_State *L = parser->L;
+
+   lua_pushstring (L, k);
+   if (parser->codes)
+      lua_pushinteger (L, code);
+   else
+      lua_pushstring (L, name);
+   lua_rawset (L, -3);
+}
+
+/* Push an event table, pre-populated with shared elements.  With the
+   reuse option this is the iterator's own table, emptied first. */
 static void
 parser_push_eventtable (lyaml_parser *parser, const char *v, int n)
 {
    lua_State *L = parser->L;
 
-   lua_createtable (L, 0, n + 3);
-   RAWSET_STRING   ("type", v);
+   if (parser->reuse)
+   {
+      lua_pushvalue (L, lua_upvalueindex (2));
+      lua_pushnil (L);
+      while (lua_next (L, -2) != 0)
+      {
+         lua_pop       (L, 1);
+         lua_pushvalue (L, -1);
+         lua_pushnil   (L);
+         lua_rawset    (L, -4);
+      }
+   }
+   else
+      lua_createtable (L, 0, n + (parser->marks ? 3 : 1));
+
+   parser_set_code (parser, "type", v, parser->event.type);
+   if (parser->marks)
+   {
 #define MENTRY(_s)	parser_set_mark (L, #_s, parser->event._s)
         MENTRY( start_mark	);
         MENTRY( end_mark	);
 #undef MENTRY
+   }
 }
 
 static void
@@ -97,7 +156,7 @@ parse_STREAM_START (lyaml_parser *parser)
    }
 
    parser_push_eventtable (parser, "STREAM_START", 1);
-   RAWSET_STRING ("encoding", encoding);
+   parser_set_code (parser, "encoding", encoding, EVENTF (encoding));
 #undef EVENTF
 }
 
@@ -210,7 +269,7 @@ parse_SCALAR (lyaml_parser *parser)
 
    RAWSET_BOOLEAN ("plain_implicit", EVENTF (plain_implicit));
    RAWSET_BOOLEAN ("quoted_implicit", EVENTF (quoted_implicit));
-   RAWSET_STRING  ("style", style);
+   parser_set_code (parser, "style", style, EVENTF (style));
 #undef EVENTF
 }
 
@@ -240,7 +299,7 @@ parse_SEQUENCE_START (lyaml_parser *parser)
    RAWSET_EVENTF (anchor);
    RAWSET_EVENTF (tag);
    RAWSET_BOOLEAN ("implicit", EVENTF (implicit));
-   RAWSET_STRING ("style", style);
+   parser_set_code (parser, "style", style, EVENTF (style));
 #undef EVENTF
 }
 
@@ -270,7 +329,7 @@ parse_MAPPING_START (lyaml_parser *parser)
    RAWSET_EVENTF (anchor);
    RAWSET_EVENTF (tag);
    RAWSET_BOOLEAN ("implicit", EVENTF (implicit));
-   RAWSET_STRING ("style", style);
+   parser_set_code (parser, "style", style, EVENTF (style));
 #undef EVENTF
 }
 
@@ -307,23 +366,14 @@ parser_generate_error_message (lyaml_parser *parser)
    luaL_pushresult (&b);
 }
 
-static int
-event_iter (lua_State *L)
+/* Push a table for the event in PARSER. */
+static void
+parser_push_event (lyaml_parser *parser)
 {
-   lyaml_parser *parser = (lyaml_parser *)lua_touserdata(L, lua_upvalueindex(1));
-   char *str;
-
-   parser_delete_event (parser);
-   if (yaml_parser_parse (&parser->parser, &parser->event) != 1)
-   {
-      parser_generate_error_message (parser);
-      return lua_error (L);
-   }
-
-   parser->validevent = 1;
+   lua_State *L = parser->L;
 
-   lua_newtable    (L);
-   lua_pushliteral (L, "type");
+   parser->start_mark = parser->event.start_mark;
+   parser->end_mark   = parser->event.end_mark;
 
    switch (parser->event.type)
    {
@@ -351,10 +401,30 @@ event_iter (lua_State *L)
          lua_pushnil (L);
          break;
       default:
-         lua_pushfstring  (L, "invalid event %d", parser->event.type);
-         return lua_error (L);
+         lua_pushfstring (L, "invalid event %d", parser->event.type);
+         lua_error (L);
    }
+}
 
+static int
+event_iter (lua_State *L)
+{
+   lyaml_parser *parser = (lyaml_parser *)lua_touserdata(L, lua_upvalueindex(1));
+
+   /* the reuse table upvalue is only reachable from the calling thread */
+   parser->L = parser->input.L = L;
+   parser_delete_event (parser);
+   if (yaml_parser_parse (&parser->parser, &parser->event) != 1)
+   {
+      if (lyaml_input_overlimit (&parser->input))
+         lua_pushliteral (L, "input exceeds max_input_bytes");
+      else if (!lyaml_input_error (L, &parser->input))
+         parser_generate_error_message (parser);
+      return lua_error (L);
+   }
+
+   parser->validevent = 1;
+   parser_push_event (parser);
    return 1;
 }
 
@@ -367,32 +437,73 @@ parser_gc (lua_State *L)
    {
       parser_delete_event (parser);
       yaml_parser_delete (&parser->parser);
+      lyaml_input_delete (L, &parser->input);
    }
    return 0;
 }
 
+/* Return start_mark and end_mark tables for the last event, which are
+   left out of event tables with the `marks = false` option. */
+static int
+parser_mark (lua_State *L)
+{
+   lyaml_parser *parser =
+      (lyaml_parser *) luaL_checkudata (L, 1, "lyaml.parser");
+
+   parser_push_mark (L, parser->start_mark);
+   parser_push_mark (L, parser->end_mark);
+   return 2;
+}
+
 void
 parser_init (lua_State *L)
 {
    luaL_newmetatable(L, "lyaml.parser");
    lua_pushcfunction(L, parser_gc);
    lua_setfield(L, -2, "__gc");
+
+   lua_createtable(L, 0, 1);
+   lua_pushcfunction(L, parser_mark);
+   lua_setfield(L, -2, "mark");
+   lua_setfield(L, -2, "__index");
 }
 
-int
-Pparser (lua_State *L)
+/* Set the boolean options of PARSER from the table at IDX. */
+static void
+parser_set_options (lua_State *L, int idx, lyaml_parser *parser)
+{
+#define MENTRY(_s)					\
+   lua_getfield (L, idx, #_s);				\
+   if (!lua_isnil (L, -1))				\
+      parser->_s = lua_toboolean (L, -1);		\
+   lua_pop (L, 1)
+   MENTRY( marks	);
+   MENTRY( reuse	);
+   MENTRY( codes	);
+#undef MENTRY
+}
+
+/* Create a parser for the options table in the second argument slot,
+   reading from the file at PATH, or from the input in the first slot if
+   PATH is NULL; and return its iterator function and userdatum. */
+static int
+parser_new (lua_State *L, const char *path)
 {
    lyaml_parser *parser;
-   const unsigned char *str;
 
-   /* requires a single string type argument */
-   luaL_argcheck (L, lua_isstring (L, 1), 1, "must provide a string argument");
-   str = (const unsigned char *) lua_tostring (L, 1);
+   /* requires an input argument, and an optional options table */
+   if (!lua_isnoneornil (L, 2))
+      luaL_checktype (L, 2, LUA_TTABLE);
+   lua_settop (L, 2);
 
    /* create a user datum to store the parser */
    parser = (lyaml_parser *) lua_newuserdata (L, sizeof (*parser));
    memset ((void *) parser, 0, sizeof (*parser));
    parser->L = L;
+   parser->marks = 1;
+
+   if (lua_istable (L, 2))
+      parser_set_options (L, 2, parser);
 
    /* set its metatable */
    luaL_getmetatable (L, "lyaml.parser");
@@ -400,11 +511,387 @@ Pparser (lua_State *L)
 
    /* try to initialize the parser */
    if (yaml_parser_initialize (&parser->parser) == 0)
-      luaL_error (L, "cannot initialize parser for %s", str);
-   yaml_parser_set_input_string (&parser->parser, str, lua_strlen (L, 1));
+      luaL_error (L, "cannot initialize parser");
+
+   /* requires a file name, or a string, file handle or reader function */
+   if (path != NULL)
+      lyaml_input_set_file (L, path, &parser->parser, &parser->input);
+   else
+      lyaml_input_set (L, 1, &parser->parser, &parser->input);
+   if (lua_istable (L, 2))
+      lyaml_input_set_limit (L, 2, &parser->input);
+
+   /* create and return the iterator function, with the parser userdatum
+      and the reusable event table (if any) as upvalues; followed by the
+      userdatum itself, for the mark method */
+   lua_pushvalue (L, -1);
+   if (parser->reuse)
+      lua_createtable (L, 0, 10);
+   else
+      lua_pushnil (L);
+   lua_pushcclosure (L, event_iter, 2);
+   lua_insert (L, -2);
+   return 2;
+}
+
+int
+Pparser (lua_State *L)
+{
+   return parser_new (L, NULL);
+}
+
+int
+Pparser_file (lua_State *L)
+{
+   return parser_new (L, luaL_checkstring (L, 1));
+}
+
+
+/* A push parser is fed its input a chunk at a time, by a caller that
+   can't block waiting for the rest.  libyaml pulls its input through a
+   read handler and can't be suspended in the middle of an event, so the
+   parser runs on a thread of its own, and its read handler hands control
+   back to the feeding thread whenever the current chunk is used up.
+   Only one of the two threads runs at a time: each feed copies out the
+   events libyaml could finish with the bytes seen so far, and nothing is
+   scanned twice. */
+
+#define PUSH_NAME	"lyaml.push_parser"
+
+/* Stack size of each parser thread.  It only runs libyaml, which keeps
+   its own stacks on the heap, so a fraction of the usual default of
+   several megabytes is plenty. */
+#define PUSH_STACKSIZE	(64 * 1024)
+
+typedef struct {
+   lyaml_parser	  base;
+
+#ifndef _WIN32
+   pthread_t	  thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+#endif
+
+   /* the chunk being fed, while the parser thread reads it */
+   const unsigned char *chunk;
+   size_t	  len;
+
+   /* events parsed from the chunk, not yet returned */
+   yaml_event_t	 *events;
+   size_t	  head, n, size;
+
+   /* input fed so far, and the max_input_bytes option */
+   size_t	  total;
+   lua_Integer	  limit;
+
+   char		  started;	/* the parser thread was created */
+   char		  running;	/* it's the parser thread's turn */
+   char		  finished;	/* no more input: reads return EOF */
+   char		  abandoned;	/* collected early: reads fail */
+   char		  done;		/* the parser thread has returned */
+   char		  failed;	/* ...after a parse error */
+   char		  nomem;	/* ...or without memory for an event */
+} lyaml_push;
+
+
+#ifndef _WIN32
+/* Read handler, in the parser thread: return bytes of the current chunk,
+   waiting for the next once it is used up. */
+static int
+push_read (void *data, unsigned char *buffer, size_t size, size_t *size_read)
+{
+   lyaml_push *push = (lyaml_push *) data;
+   int ok = 1;
+
+   pthread_mutex_lock (&push->mutex);
+   while (push->len == 0 && !push->finished && !push->abandoned)
+   {
+      push->running = 0;
+      pthread_cond_signal (&push->cond);
+      while (!push->running)
+         pthread_cond_wait (&push->cond, &push->mutex);
+   }
+
+   *size_read = 0;
+   if (push->abandoned)
+      ok = 0;
+   else if (push->len > 0)
+   {
+      *size_read = size < push->len ? size : push->len;
+      memcpy (buffer, push->chunk, *size_read);
+      push->chunk += *size_read;
+      push->len   -= *size_read;
+   }
+   pthread_mutex_unlock (&push->mutex);
+   return ok;
+}
+
+/* Append EVENT to the events of PUSH, or return 0 if there's no memory. */
+static int
+push_queue (lyaml_push *push, yaml_event_t *event)
+{
+   if (push->n == push->size)
+   {
+      size_t size = push->size ? 2 * push->size : 64;
+      yaml_event_t *events =
+         (yaml_event_t *) realloc (push->events, size * sizeof (*events));
+
+      if (events == NULL)
+         return 0;
+      push->events = events;
+      push->size = size;
+   }
+   push->events[push->n++] = *event;
+   return 1;
+}
+
+/* The parser thread: parse events until the end of the stream or an
+   error, and then hand control back for good. */
+static void *
+push_run (void *arg)
+{
+   lyaml_push *push = (lyaml_push *) arg;
+   yaml_event_t event;
+   int ok;
+
+   do
+   {
+      ok = yaml_parser_parse (&push->base.parser, &event);
+      if (ok && !push_queue (push, &event))
+      {
+         yaml_event_delete (&event);
+         push->nomem = 1;
+         ok = 0;
+      }
+   }
+   while (ok && event.type != YAML_STREAM_END_EVENT);
+
+   pthread_mutex_lock (&push->mutex);
+   push->done    = 1;
+   push->failed  = !ok;
+   push->running = 0;
+   pthread_cond_signal (&push->cond);
+   pthread_mutex_unlock (&push->mutex);
+   return NULL;
+}
+
+/* Give the parser thread its turn, and wait until it needs more input or
+   has returned. */
+static void
+push_resume (lyaml_push *push)
+{
+   pthread_mutex_lock (&push->mutex);
+   push->running = 1;
+   pthread_cond_signal (&push->cond);
+   while (push->running)
+      pthread_cond_wait (&push->cond, &push->mutex);
+   pthread_mutex_unlock (&push->mutex);
+}
+#endif
+
+/* Free the events of PUSH that haven't been returned. */
+static void
+push_drop_events (lyaml_push *push)
+{
+   while (push->head < push->n)
+      yaml_event_delete (&push->events[push->head++]);
+   push->head = push->n = 0;
+}
+
+/* Return a list of the event tables parsed since the last call, or raise
+   the error that stopped the parser thread. */
+static int
+push_events (lua_State *L, lyaml_push *push)
+{
+   lyaml_parser *parser = &push->base;
+   int i = 0;
+
+   parser->L = L;
+   lua_createtable (L, (int) (push->n - push->head), 0);
+   while (push->head < push->n)
+   {
+      parser_delete_event (parser);
+      parser->event = push->events[push->head++];
+      parser->validevent = 1;
+      parser_push_event (parser);
+      lua_rawseti (L, -2, ++i);
+   }
+   parser_delete_event (parser);
+   push->head = push->n = 0;
+
+   if (push->nomem)
+      return luaL_error (L, "cannot allocate event");
+   if (push->failed)
+   {
+      parser_generate_error_message (parser);
+      return lua_error (L);
+   }
+   return 1;
+}
+
+/* Return the push parser at IDX, which must not be finished. */
+static lyaml_push *
+push_check (lua_State *L, int idx)
+{
+   lyaml_push *push = (lyaml_push *) luaL_checkudata (L, idx, PUSH_NAME);
+
+   if (push->finished)
+      luaL_error (L, "push parser is finished");
+   return push;
+}
+
+/* Parse the bytes of CHUNK, and return a list of the events that can be
+   decided from the input so far. */
+static int
+push_feed (lua_State *L)
+{
+   lyaml_push *push = push_check (L, 1);
+   size_t len;
+   const char *chunk = luaL_checklstring (L, 2, &len);
+
+   push->total += len;
+   if (push->limit >= 0 && push->total > (size_t) push->limit)
+      return luaL_error (L, "input exceeds max_input_bytes");
+
+#ifndef _WIN32
+   if (!push->done && len > 0)
+   {
+      /* the string stays on the stack until the parser thread returns */
+      push->chunk = (const unsigned char *) chunk;
+      push->len   = len;
+      push_resume (push);
+   }
+#endif
+   return push_events (L, push);
+}
+
+/* Mark the end of the input, and return a list of the remaining events. */
+static int
+push_finish (lua_State *L)
+{
+   lyaml_push *push = push_check (L, 1);
+
+   push->finished = 1;
+#ifndef _WIN32
+   if (!push->done)
+      push_resume (push);
+   if (push->started)
+   {
+      pthread_join (push->thread, NULL);
+      push->started = 0;
+   }
+#endif
+   return push_events (L, push);
+}
+
+static int
+push_gc (lua_State *L)
+{
+   lyaml_push *push = (lyaml_push *) lua_touserdata (L, 1);
+
+   if (push)
+   {
+#ifndef _WIN32
+      if (push->started)
+      {
+         /* fail the read the parser thread is waiting for */
+         pthread_mutex_lock (&push->mutex);
+         push->abandoned = 1;
+         push->running = 1;
+         pthread_cond_signal (&push->cond);
+         pthread_mutex_unlock (&push->mutex);
+         pthread_join (push->thread, NULL);
+         push->started = 0;
+      }
+      pthread_cond_destroy  (&push->cond);
+      pthread_mutex_destroy (&push->mutex);
+#endif
+      push_drop_events (push);
+      free (push->events);
+      push->events = NULL;
+      parser_delete_event (&push->base);
+      yaml_parser_delete (&push->base.parser);
+   }
+   return 0;
+}
+
+void
+push_init (lua_State *L)
+{
+   luaL_newmetatable (L, PUSH_NAME);
+   lua_pushcfunction (L, push_gc);
+   lua_setfield (L, -2, "__gc");
+
+   lua_createtable (L, 0, 2);
+   lua_pushcfunction (L, push_feed);
+   lua_setfield (L, -2, "feed");
+   lua_pushcfunction (L, push_finish);
+   lua_setfield (L, -2, "finish");
+   lua_setfield (L, -2, "__index");
+}
+
+/* Return a push parser for the options table in the first argument slot,
+   with `feed` and `finish` methods.  Each one has an OS thread of its own
+   until it is finished or collected, with a PUSH_STACKSIZE stack, so a
+   server should finish its parsers rather than keep thousands open. */
+int
+Ppush_parser (lua_State *L)
+{
+   lyaml_push *push;
+#ifndef _WIN32
+   pthread_attr_t attr;
+   int r;
+#endif
+
+   if (!lua_isnoneornil (L, 1))
+      luaL_checktype (L, 1, LUA_TTABLE);
+   lua_settop (L, 1);
+
+   push = (lyaml_push *) lua_newuserdata (L, sizeof (*push));
+   memset ((void *) push, 0, sizeof (*push));
+   push->base.L = L;
+   push->base.marks = 1;
+   push->limit = -1;
+   if (lua_istable (L, 1))
+   {
+      parser_set_options (L, 1, &push->base);
+      push->limit = lyaml_checklimit (L, 1, "max_input_bytes");
+   }
+   /* every feed returns a new list of new tables */
+   push->base.reuse = 0;
+
+#ifdef _WIN32
+   return luaL_error (L, "push_parser needs POSIX threads");
+#else
+   if (pthread_mutex_init (&push->mutex, NULL) != 0)
+      return luaL_error (L, "cannot initialize push parser");
+   if (pthread_cond_init (&push->cond, NULL) != 0)
+   {
+      pthread_mutex_destroy (&push->mutex);
+      return luaL_error (L, "cannot initialize push parser");
+   }
+   luaL_getmetatable (L, PUSH_NAME);
+   lua_setmetatable  (L, -2);
 
-   /* create and return the iterator function, with the loader userdatum as
-      its sole upvalue */
-   lua_pushcclosure (L, event_iter, 1);
+   if (yaml_parser_initialize (&push->base.parser) == 0)
+      return luaL_error (L, "cannot initialize parser");
+   yaml_parser_set_input (&push->base.parser, push_read, push);
+
+   /* let the parser thread run until it asks for the first chunk */
+   push->running = 1;
+   if (pthread_attr_init (&attr) != 0)
+      return luaL_error (L, "cannot start push parser thread");
+   /* below the system minimum, the default size is kept */
+   (void) pthread_attr_setstacksize (&attr, PUSH_STACKSIZE);
+   r = pthread_create (&push->thread, &attr, push_run, push);
+   pthread_attr_destroy (&attr);
+   if (r != 0)
+      return luaL_error (L, "cannot start push parser thread");
+   push->started = 1;
+   pthread_mutex_lock (&push->mutex);
+   while (push->running)
+      pthread_cond_wait (&push->cond, &push->mutex);
+   pthread_mutex_unlock (&push->mutex);
    return 1;
+#endif
 }
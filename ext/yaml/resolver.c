@@ -0,0 +1,729 @@
+/*
+ * resolver.c, default YAML 1.1 scalar resolution for lyaml
+ *
+ * Copyright (C) 2013-2020 Gary V. Vaughan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* The functions in this file mirror lib/lyaml/implicit.lua and
+   lib/lyaml/explicit.lua exactly, so that the C loader gives the same
+   results as the Lua loader when the caller has not overridden the
+   `implicit_scalar` or `explicit_scalar` options. */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lyaml.h"
+
+#define TAG_PREFIX	"tag:yaml.org,2002:"
+
+#define ISDIGIT(_c)	((_c) >= '0' && (_c) <= '9')
+#define ISODIGIT(_c)	((_c) >= '0' && (_c) <= '7')
+#define ISBDIGIT(_c)	((_c) == '0' || (_c) == '1')
+#define ISXDIGIT(_c)	(ISDIGIT (_c) || \
+			 ((_c) >= 'a' && (_c) <= 'f') || \
+			 ((_c) >= 'A' && (_c) <= 'F'))
+
+/* NOTE: Make sure s and n are in scope before using this macro. */
+#define MATCH(_lit)	(n == sizeof (_lit) - 1 && memcmp (s, _lit, n) == 0)
+
+/* Short numbers are copied here for conversion, longer ones are malloced. */
+#define NUMBUFSIZ	64
+
+
+/* Push `lyaml.null`, fetching it from lyaml.functional the first time. */
+void
+lyaml_pushnull (lua_State *L)
+{
+   lua_getfield (L, LUA_REGISTRYINDEX, "lyaml.null");
+   if (lua_isnil (L, -1))
+   {
+      lua_pop (L, 1);
+      lua_getglobal   (L, "require");
+      lua_pushliteral (L, "lyaml.functional");
+      lua_call        (L, 1, 1);
+      lua_getfield    (L, -1, "NULL");
+      lua_remove      (L, -2);
+      lua_pushvalue   (L, -1);
+      lua_setfield    (L, LUA_REGISTRYINDEX, "lyaml.null");
+   }
+}
+
+/* Equivalent to lyaml.functional.isnull. */
+int
+lyaml_isnull (lua_State *L, int idx)
+{
+   int r = 0;
+
+   if (lua_type (L, idx) == LUA_TTABLE && lua_getmetatable (L, idx))
+   {
+      lua_getfield (L, -1, "_type");
+      r = lua_type (L, -1) == LUA_TSTRING &&
+          STREQ (lua_tostring (L, -1), "LYAML null");
+      lua_pop (L, 2);
+   }
+   return r;
+}
+
+
+/* Consume an optional leading sign from *PS, returning 1 if negative. */
+static int
+skip_sign (const char **ps, size_t *pn)
+{
+   if (*pn > 0 && (**ps == '+' || **ps == '-'))
+   {
+      int neg = (**ps == '-');
+      (*ps)++, (*pn)--;
+      return neg;
+   }
+   return 0;
+}
+
+static int
+digitval (int c)
+{
+   if (ISDIGIT (c))
+      return c - '0';
+   if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+   return c - 'A' + 10;
+}
+
+/* Push the integer spelled by the digits in S in BASE, skipping any
+   underscores, and negated if NEG.  Like Lua arithmetic, values too
+   large for a lua_Integer wrap around. */
+static void
+push_digits (lua_State *L, const char *s, size_t n, int base, int neg)
+{
+   const char *e = s + n;
+#if LUA_VERSION_NUM >= 503
+   lua_Unsigned r = 0;
+
+   for (; s < e; s++)
+      if (*s != '_')
+         r = r * base + digitval (*s);
+   lua_pushinteger (L, (lua_Integer) (neg ? 0u - r : r));
+#else
+   lua_Number r = 0;
+
+   for (; s < e; s++)
+      if (*s != '_')
+         r = r * base + digitval (*s);
+   lua_pushnumber (L, neg ? -r : r);
+#endif
+}
+
+/* Push the number spelled by S, ignoring underscores, with the same
+   rules as Lua's own `tonumber`.  Return 0 and push nothing if S is
+   not a valid number. */
+static int
+push_number (lua_State *L, const char *s, size_t n)
+{
+   char buf[NUMBUFSIZ], *b = buf;
+   size_t i, j;
+   int r;
+
+   if (n >= sizeof (buf) && (b = (char *) malloc (n + 1)) == NULL)
+      return luaL_error (L, "cannot allocate number buffer");
+
+   for (i = j = 0; i < n; i++)
+      if (s[i] != '_')
+         b[j++] = s[i];
+   b[j] = '\0';
+
+#if LUA_VERSION_NUM >= 503
+   {
+      size_t z = lua_stringtonumber (L, b);
+      r = (z == j + 1);
+      if (z != 0 && !r)
+         lua_pop (L, 1);	/* embedded NUL */
+   }
+#else
+   lua_pushlstring (L, b, j);
+   r = lua_isnumber (L, -1);
+   if (r)
+   {
+      lua_Number v = lua_tonumber (L, -1);
+      lua_pop (L, 1);
+      lua_pushnumber (L, v);
+   }
+   else
+      lua_pop (L, 1);
+#endif
+
+   if (b != buf)
+      free (b);
+   return r;
+}
+
+/* Replace the integer on top of the stack with its float equivalent. */
+static void
+tofloat (lua_State *L)
+{
+   lua_Number v = lua_tonumber (L, -1);
+   lua_pop (L, 1);
+   lua_pushnumber (L, v);
+}
+
+
+/* Each of the following pushes the value of its token and returns 1
+   if S is recognized, or pushes nothing and returns 0 otherwise. */
+
+static int
+implicit_null (lua_State *L, const char *s, size_t n)
+{
+   if (n == 0 || MATCH ("~") ||
+       MATCH ("null") || MATCH ("Null") || MATCH ("NULL"))
+   {
+      lyaml_pushnull (L);
+      return 1;
+   }
+   return 0;
+}
+
+static const struct {
+   const char	*s;
+   int		 v;
+} to_bool[] = {
+   {"true",  1}, {"True",  1}, {"TRUE",  1},
+   {"false", 0}, {"False", 0}, {"FALSE", 0},
+   {"yes",   1}, {"Yes",   1}, {"YES",   1},
+   {"no",    0}, {"No",    0}, {"NO",    0},
+   {"on",    1}, {"On",    1}, {"ON",    1},
+   {"off",   0}, {"Off",   0}, {"OFF",   0},
+   {NULL,    0}
+};
+
+static int
+implicit_bool (lua_State *L, const char *s, size_t n)
+{
+   int i;
+
+   if (n < 2 || n > 5)
+      return 0;
+   for (i = 0; to_bool[i].s; i++)
+      if (strlen (to_bool[i].s) == n && memcmp (to_bool[i].s, s, n) == 0)
+      {
+         lua_pushboolean (L, to_bool[i].v);
+         return 1;
+      }
+   return 0;
+}
+
+/* ^([+-]?)0_*([0-7][0-7_]*)$ */
+static int
+implicit_octal (lua_State *L, const char *s, size_t n)
+{
+   int neg = skip_sign (&s, &n);
+   size_t i = 0;
+
+   if (n == 0 || s[i++] != '0')
+      return 0;
+   while (i < n && s[i] == '_')
+      i++;
+   if (i == n || !ISODIGIT (s[i]))
+      return 0;
+   s += i, n -= i;
+   for (i = 0; i < n; i++)
+      if (!ISODIGIT (s[i]) && s[i] != '_')
+         return 0;
+   push_digits (L, s, n, 8, neg);
+   return 1;
+}
+
+/* ^([+-]?)_*([0-9][0-9_]*)$.  Like `tonumber`, digits too many for an
+   integer are read as a float, which is kept as long as it is finite
+   since the Lua resolver accepts any whole number. */
+static int
+implicit_decimal (lua_State *L, const char *s, size_t n)
+{
+   int neg = skip_sign (&s, &n);
+   const char *e = s + n, *p;
+   lua_Number v;
+#if LUA_VERSION_NUM >= 503
+   lua_Unsigned r = 0;
+#endif
+
+   while (s < e && *s == '_')
+      s++;
+   if (s == e || !ISDIGIT (*s))
+      return 0;
+   for (p = s; p < e; p++)
+      if (!ISDIGIT (*p) && *p != '_')
+         return 0;
+
+#if LUA_VERSION_NUM >= 503
+   for (p = s; p < e; p++)
+   {
+      if (*p == '_')
+         continue;
+      if (r > ((lua_Unsigned) LUA_MAXINTEGER - (*p - '0')) / 10)
+         break;
+      r = r * 10 + (*p - '0');
+   }
+   if (p == e)
+   {
+      lua_pushinteger (L, neg ? - (lua_Integer) r : (lua_Integer) r);
+      return 1;
+   }
+#endif
+
+   if (!push_number (L, s, e - s))
+      return 0;
+   v = lua_tonumber (L, -1);
+   lua_pop (L, 1);
+   if (v - floor (v) != 0)
+      return 0;	/* too large even for a float */
+   lua_pushnumber (L, neg ? -v : v);
+   return 1;
+}
+
+/* Any `tonumber` compatible string containing one of '.', 'e' or 'E'. */
+static int
+implicit_float (lua_State *L, const char *s, size_t n)
+{
+   size_t i;
+
+   for (i = 0; i < n; i++)
+      if (s[i] == '.' || s[i] == 'e' || s[i] == 'E')
+         return push_number (L, s, n);
+   return 0;
+}
+
+static int
+implicit_inf (lua_State *L, const char *s, size_t n)
+{
+   int neg = 0;
+
+   if (n == 5 && (*s == '+' || *s == '-'))
+   {
+      neg = (*s == '-');
+      s++, n--;
+   }
+   if (MATCH (".inf") || MATCH (".Inf") || MATCH (".INF"))
+   {
+      lua_pushnumber (L, neg ? -HUGE_VAL : HUGE_VAL);
+      return 1;
+   }
+   return 0;
+}
+
+static int
+implicit_nan (lua_State *L, const char *s, size_t n)
+{
+   if (MATCH (".nan") || MATCH (".NaN") || MATCH (".NAN"))
+   {
+      lua_pushnumber (L, (lua_Number) (HUGE_VAL - HUGE_VAL));
+      return 1;
+   }
+   return 0;
+}
+
+/* ^([+-]?)0x_*[0-9a-fA-F][0-9a-fA-F_]*$ */
+static int
+implicit_hexadecimal (lua_State *L, const char *s, size_t n)
+{
+   int neg = skip_sign (&s, &n);
+   size_t i = 2;
+
+   if (n < 3 || s[0] != '0' || s[1] != 'x')
+      return 0;
+   while (i < n && s[i] == '_')
+      i++;
+   if (i == n || !ISXDIGIT (s[i]))
+      return 0;
+   s += i, n -= i;
+   for (i = 0; i < n; i++)
+      if (!ISXDIGIT (s[i]) && s[i] != '_')
+         return 0;
+   push_digits (L, s, n, 16, neg);
+   return 1;
+}
+
+/* ^([+-]?)0b_*[01][01_]+$ */
+static int
+implicit_binary (lua_State *L, const char *s, size_t n)
+{
+   int neg = skip_sign (&s, &n);
+   size_t i = 2;
+
+   if (n < 3 || s[0] != '0' || s[1] != 'b')
+      return 0;
+   while (i < n && s[i] == '_')
+      i++;
+   if (n - i < 2 || !ISBDIGIT (s[i]))
+      return 0;
+   s += i, n -= i;
+   for (i = 0; i < n; i++)
+      if (!ISBDIGIT (s[i]) && s[i] != '_')
+         return 0;
+   push_digits (L, s, n, 2, neg);
+   return 1;
+}
+
+/* Return the length of the longest prefix of S matching the pattern
+   [0-9]+:[0-5]?[0-9][:0-9]*, or 0 if there is none.  Because the
+   trailing [:0-9]* can absorb a second digit, this is equivalent to
+   [0-9]+:[0-9][:0-9]*. */
+static size_t
+sexagesimal_span (const char *s, size_t n)
+{
+   size_t i = 0;
+
+   while (i < n && ISDIGIT (s[i]))
+      i++;
+   if (i == 0 || i + 1 >= n || s[i] != ':' || !ISDIGIT (s[i + 1]))
+      return 0;
+   for (i += 2; i < n && (ISDIGIT (s[i]) || s[i] == ':'); i++)
+      ;
+   return i;
+}
+
+/* Fold each run of digits in the first N bytes of S in base 60. */
+static void
+push_sexagesimal (lua_State *L, const char *s, size_t n, int neg)
+{
+   const char *e = s + n;
+#if LUA_VERSION_NUM >= 503
+   lua_Unsigned r = 0, digits;
+#else
+   lua_Number r = 0, digits;
+#endif
+
+   while (s < e)
+   {
+      if (*s == ':')
+      {
+         s++;
+         continue;
+      }
+      for (digits = 0; s < e && ISDIGIT (*s); s++)
+         digits = digits * 10 + (*s - '0');
+      r = r * 60 + digits;
+   }
+#if LUA_VERSION_NUM >= 503
+   lua_pushinteger (L, (lua_Integer) (neg ? 0u - r : r));
+#else
+   lua_pushnumber (L, neg ? -r : r);
+#endif
+}
+
+/* ^([+-]?)([0-9]+:[0-5]?[0-9][:0-9]*)$ */
+static int
+implicit_sexagesimal (lua_State *L, const char *s, size_t n)
+{
+   int neg = skip_sign (&s, &n);
+
+   if (n == 0 || sexagesimal_span (s, n) != n)
+      return 0;
+   push_sexagesimal (L, s, n, neg);
+   return 1;
+}
+
+/* ^([+-]?)([0-9]+:[0-5]?[0-9][:0-9]*)(%.[0-9]+)$ */
+static int
+implicit_sexfloat (lua_State *L, const char *s, size_t n)
+{
+   int neg = skip_sign (&s, &n);
+   size_t i = sexagesimal_span (s, n), j;
+   lua_Number r;
+
+   if (i == 0 || i + 1 >= n || s[i] != '.')
+      return 0;
+   for (j = i + 1; j < n; j++)
+      if (!ISDIGIT (s[j]))
+         return 0;
+
+   push_sexagesimal (L, s, i, 0);
+   r = lua_tonumber (L, -1);
+   lua_pop (L, 1);
+   if (!push_number (L, s + i, n - i))
+      return 0;
+   r += lua_tonumber (L, -1);
+   lua_pop (L, 1);
+   lua_pushnumber (L, neg ? -r : r);
+   return 1;
+}
+
+
+/* Character classes seen while scanning a plain scalar. */
+#define C_DIGIT		0x001	/* 0-9 */
+#define C_SIGN		0x002	/* + - */
+#define C_DOT		0x004	/* . */
+#define C_EXP		0x008	/* e E */
+#define C_HEX		0x010	/* other hex digits, and x X p P */
+#define C_UNDER		0x020	/* _ */
+#define C_COLON		0x040	/* : */
+#define C_ALPHA		0x080	/* any other ASCII letter */
+#define C_SPACE		0x100	/* whitespace, which `tonumber` trims */
+#define C_OTHER		0x200	/* anything else */
+
+#define C_LETTER	(C_EXP | C_HEX | C_ALPHA)
+#define C_INTEGER	(C_DIGIT | C_SIGN | C_EXP | C_HEX | C_UNDER | C_COLON)
+#define C_FLOAT		(C_INTEGER | C_DOT | C_SPACE)
+
+/* NOTE: Make sure seen is in scope before using this macro. */
+#define ONLY(_c)	((seen & ~(_c)) == 0)
+
+static unsigned
+char_class (int c)
+{
+   if (ISDIGIT (c))
+      return C_DIGIT;
+   else if (c == 'e' || c == 'E')
+      return C_EXP;
+   else if (ISXDIGIT (c) || c == 'x' || c == 'X' || c == 'p' || c == 'P')
+      return C_HEX;
+   else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+      return C_ALPHA;
+   switch (c)
+   {
+      case '+': case '-':		return C_SIGN;
+      case '.':				return C_DOT;
+      case '_':				return C_UNDER;
+      case ':':				return C_COLON;
+      case ' ': case '\t': case '\n':
+      case '\v': case '\f': case '\r':	return C_SPACE;
+      default:				return C_OTHER;
+   }
+}
+
+static unsigned
+classify (const char *s, size_t n)
+{
+   unsigned seen = 0;
+   const char *e = s + n;
+
+   for (; s < e; s++)
+      seen |= char_class ((unsigned char) *s);
+   return seen;
+}
+
+/* Push the value of plain scalar S, whose character classes are SEEN,
+   as lyaml_resolve_implicit does. */
+static int
+resolve_seen (lua_State *L, const char *s, size_t n, unsigned seen)
+{
+   int integer = (seen & C_DIGIT) && ONLY (C_INTEGER);
+
+   if (n <= 4 && implicit_null (L, s, n))
+      return 1;
+   if (integer && !(seen & C_COLON))
+   {
+      if (implicit_octal (L, s, n) || implicit_decimal (L, s, n))
+         return 1;
+   }
+   if ((seen & (C_DOT | C_EXP)) && ONLY (C_FLOAT) &&
+       implicit_float (L, s, n))
+      return 1;
+   if (n >= 2 && n <= 5 && ONLY (C_LETTER) && implicit_bool (L, s, n))
+      return 1;
+   if ((n == 4 || n == 5) && (seen & C_DOT) &&
+       (implicit_inf (L, s, n) || implicit_nan (L, s, n)))
+      return 1;
+   if (integer)
+   {
+      if (seen & C_COLON)
+         return implicit_sexagesimal (L, s, n);
+      return implicit_hexadecimal (L, s, n) || implicit_binary (L, s, n);
+   }
+   if ((seen & C_COLON) && (seen & C_DOT) &&
+       ONLY (C_DIGIT | C_SIGN | C_COLON | C_DOT))
+      return implicit_sexfloat (L, s, n);
+   return 0;
+}
+
+/* Push the value of plain scalar S according to the default implicit
+   schema, with the same results as the default `implicit_scalar` chain
+   in lib/lyaml/init.lua.  A single scan of S rules out every token type
+   it can't be, and the rest are tried in the order of that chain.
+   Return 0 and push nothing if S is just a string. */
+int
+lyaml_resolve_implicit (lua_State *L, const char *s, size_t n)
+{
+   return resolve_seen (L, s, n, classify (s, n));
+}
+
+#define ISBLANKZ(_s, _n, _i)	((_i) >= (_n) || (_s)[_i] == ' ' || \
+				 (_s)[_i] == '\t' || (_s)[_i] == '\n')
+
+/* Return the cheapest style that writes string S so that it loads back
+   as itself under the default schema, deciding from a single scan of S
+   the cases where libyaml would not accept plain style anyway:
+
+      DOUBLE_QUOTED	ASCII control characters, which need escapes
+      SINGLE_QUOTED	S resolves to some other value when plain, or has
+			leading or trailing spaces or an indicator that
+			rules out plain style in any context
+      LITERAL		S has newlines
+      PLAIN		otherwise, leaving libyaml to quote the cases
+			that depend on context, such as `,` inside a
+			flow collection
+
+   The choices are those libyaml itself falls back to, so the output is
+   the same as asking for plain style and checking with the resolver. */
+int
+lyaml_scalar_style (lua_State *L, const char *s, size_t n)
+{
+   unsigned seen = 0;
+   int breaks = 0, special = 0, indicator = 0;
+   size_t i;
+
+   for (i = 0; i < n; i++)
+   {
+      int c = (unsigned char) s[i];
+
+      seen |= char_class (c);
+      if (c == '\n')
+         breaks = 1;
+      else if (c < 0x20 || c == 0x7f)
+         special = 1;
+      else if (c == ':' && ISBLANKZ (s, n, i + 1))
+         indicator = 1;
+      else if (c == '#' && i > 0 && (s[i - 1] == ' ' || s[i - 1] == '\t'))
+         indicator = 1;
+   }
+   if (special)
+      return YAML_DOUBLE_QUOTED_SCALAR_STYLE;
+
+   if (resolve_seen (L, s, n, seen))
+   {
+      lua_pop (L, 1);
+      return YAML_SINGLE_QUOTED_SCALAR_STYLE;
+   }
+   if (breaks)
+      return YAML_LITERAL_SCALAR_STYLE;
+
+   if (s[0] == ' ' || s[n - 1] == ' ' || indicator ||
+       strchr ("#,[]{}&*!|>'\"%@`", s[0]) != NULL ||
+       (strchr ("-?", s[0]) != NULL && ISBLANKZ (s, n, 1)) ||
+       (n >= 3 && (memcmp (s, "---", 3) == 0 || memcmp (s, "...", 3) == 0) &&
+        ISBLANKZ (s, n, 3)))
+      return YAML_SINGLE_QUOTED_SCALAR_STYLE;
+   return YAML_PLAIN_SCALAR_STYLE;
+}
+
+/* yaml.scalar_style (s): return the style code, such as `yaml.PLAIN`,
+   that the dumpers write string S in with the default schema. */
+int
+Pscalar_style (lua_State *L)
+{
+   size_t len;
+   const char *s = luaL_checklstring (L, 1, &len);
+
+   lua_pushinteger (L, lyaml_scalar_style (L, s, len));
+   return 1;
+}
+
+/* yaml.resolve_implicit (s): return the value of plain scalar S
+   according to the default implicit schema, or S itself if it is just
+   a string.  This is the default `implicit_scalar` function. */
+int
+Presolve_implicit (lua_State *L)
+{
+   size_t len;
+   const char *s = luaL_checklstring (L, 1, &len);
+
+   if (!lyaml_resolve_implicit (L, s, len))
+      lua_settop (L, 1);
+   return 1;
+}
+
+/* Push the implicit_scalar field of the options table at IDX, or nil if
+   it is unset or is the default yaml.resolve_implicit, in which case
+   callers can skip the Lua call and use lyaml_resolve_implicit. */
+void
+lyaml_push_implicit (lua_State *L, int idx)
+{
+   lua_getfield (L, idx, "implicit_scalar");
+   if (lua_tocfunction (L, -1) == Presolve_implicit)
+   {
+      lua_pop (L, 1);
+      lua_pushnil (L);
+   }
+}
+
+
+/* Like explicit.maybefloat in lib/lyaml/explicit.lua. */
+static int
+maybefloat (lua_State *L, int r)
+{
+   if (r)
+      tofloat (L);
+   return r;
+}
+
+/* Push the value of scalar S tagged with TAG according to the default
+   explicit schema.  Return 1 on success, 0 if TAG has no default
+   conversion, or -1 if S is not a valid value for TAG. */
+int
+lyaml_resolve_explicit (lua_State *L, const char *tag, const char *s,
+			size_t n)
+{
+   int r;
+
+   if (tag == NULL || strncmp (tag, TAG_PREFIX, sizeof (TAG_PREFIX) - 1))
+      return 0;
+   tag += sizeof (TAG_PREFIX) - 1;
+
+   if (STREQ (tag, "str"))
+   {
+      lua_pushlstring (L, s, n);
+      return 1;
+   }
+   else if (STREQ (tag, "null"))
+   {
+      lyaml_pushnull (L);
+      return 1;
+   }
+   else if (STREQ (tag, "bool"))
+   {
+      r = implicit_bool (L, s, n);
+      if (!r && n == 1 && *s && strchr ("yYnN", *s))
+      {
+         lua_pushboolean (L, *s == 'y' || *s == 'Y');
+         r = 1;
+      }
+   }
+   else if (STREQ (tag, "float"))
+   {
+      r = implicit_float (L, s, n)
+         || implicit_nan (L, s, n)
+         || implicit_inf (L, s, n)
+         || maybefloat (L, implicit_octal (L, s, n))
+         || maybefloat (L, implicit_decimal (L, s, n))
+         || maybefloat (L, implicit_hexadecimal (L, s, n))
+         || maybefloat (L, implicit_binary (L, s, n))
+         || implicit_sexfloat (L, s, n);
+   }
+   else if (STREQ (tag, "int"))
+   {
+      r = implicit_octal (L, s, n)
+         || implicit_decimal (L, s, n)
+         || implicit_hexadecimal (L, s, n)
+         || implicit_binary (L, s, n)
+         || implicit_sexagesimal (L, s, n);
+   }
+   else
+      return 0;
+
+   return r ? 1 : -1;
+}
@@ -32,6 +32,8 @@ typedef struct {
    yaml_token_t	  token;
    char		  validtoken;
    int		  document_count;
+   lyaml_input	  input;
+   char		  codes;	/* integer type, style and encoding fields */
 } lyaml_scanner;
 
 
@@ -60,14 +62,30 @@ scanner_set_mark (lua_State *L, const char *k, yaml_mark_t mark)
    lua_rawset (L, -3);
 }
 
+/* With the token result table on the top of the stack, insert an
+   enumerated field K, as NAME or as its integer CODE. */
+static void
+scanner_set_code (lyaml_scanner *scanner, const char *k, const char *name,
+                  int code)
+{
+   lua_State *L = scanner->L;
+
+   lua_pushstring (L, k);
+   if (scanner->codes)
+      lua_pushinteger (L, code);
+   else
+      lua_pushstring (L, name);
+   lua_rawset (L, -3);
+}
+
 /* Push a new token table, pre-populated with shared elements. */
 static void
 scanner_push_tokentable (lyaml_scanner *scanner, const char *v, int n)
 {
    lua_State *L = scanner->L;
 
-   lua_createtable (L, 0, n + 3);
-   RAWSET_STRING   ("type", v);
+   lua_createtable  (L, 0, n + 3);
+   scanner_set_code (scanner, "type", v, scanner->token.type);
 
 #define MENTRY(_s)	scanner_set_mark (L, #_s, scanner->token._s)
          MENTRY( start_mark	);
@@ -97,7 +115,7 @@ scan_STREAM_START (lyaml_scanner *scanner)
    }
 
    scanner_push_tokentable (scanner, "STREAM_START", 1);
-   RAWSET_STRING ("encoding", encoding);
+   scanner_set_code (scanner, "encoding", encoding, EVENTF (encoding));
 #undef EVENTF
 }
 
@@ -189,7 +207,7 @@ scan_SCALAR (lyaml_scanner *scanner)
    scanner_push_tokentable (scanner, "SCALAR", 3);
    RAWSET_EVENTF  (value);
    RAWSET_INTEGER ("length", EVENTF (length));
-   RAWSET_STRING  ("style", style);
+   scanner_set_code (scanner, "style", style, EVENTF (style));
 #undef EVENTF
 }
 
@@ -232,10 +250,13 @@ token_iter (lua_State *L)
    lyaml_scanner *scanner = (lyaml_scanner *)lua_touserdata(L, lua_upvalueindex(1));
    char *str;
 
+   /* the reader function must run in the calling thread */
+   scanner->L = scanner->input.L = L;
    scanner_delete_token (scanner);
    if (yaml_parser_scan (&scanner->parser, &scanner->token) != 1)
    {
-      scanner_generate_error_message (scanner);
+      if (!lyaml_input_error (L, &scanner->input))
+         scanner_generate_error_message (scanner);
       return lua_error (L);
    }
 
@@ -297,6 +318,7 @@ scanner_gc (lua_State *L)
    {
       scanner_delete_token (scanner);
       yaml_parser_delete (&scanner->parser);
+      lyaml_input_delete (L, &scanner->input);
    }
    return 0;
 }
@@ -313,25 +335,34 @@ int
 Pscanner (lua_State *L)
 {
    lyaml_scanner *scanner;
-   const unsigned char *str;
 
-   /* requires a single string type argument */
-   luaL_argcheck (L, lua_isstring (L, 1), 1, "must provide a string argument");
-   str = (const unsigned char *) lua_tostring (L, 1);
+   /* requires an input argument, and an optional options table */
+   if (!lua_isnoneornil (L, 2))
+      luaL_checktype (L, 2, LUA_TTABLE);
+   lua_settop (L, 2);
 
    /* create a user datum to store the scanner */
    scanner = (lyaml_scanner *) lua_newuserdata (L, sizeof (*scanner));
    memset ((void *) scanner, 0, sizeof (*scanner));
    scanner->L = L;
 
+   if (lua_istable (L, 2))
+   {
+      lua_getfield (L, 2, "codes");
+      scanner->codes = lua_toboolean (L, -1);
+      lua_pop (L, 1);
+   }
+
    /* set its metatable */
    luaL_getmetatable (L, "lyaml.scanner");
    lua_setmetatable  (L, -2);
 
    /* try to initialize the scanner */
    if (yaml_parser_initialize (&scanner->parser) == 0)
-      luaL_error (L, "cannot initialize parser for %s", str);
-   yaml_parser_set_input_string (&scanner->parser, str, lua_strlen (L, 1));
+      luaL_error (L, "cannot initialize parser");
+
+   /* requires a string, file handle or reader function argument */
+   lyaml_input_set (L, 1, &scanner->parser, &scanner->input);
 
    /* create and return the iterator function, with the loader userdatum as
       its sole upvalue */
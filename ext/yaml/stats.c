@@ -0,0 +1,197 @@
+/*
+ * stats.c, load and dump instrumentation for lyaml
+ *
+ * Copyright (C) 2013-2020 Gary V. Vaughan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* With a `stats` table in its options, `yaml.load`, `yaml.load_file` or
+   `yaml.dump` runs in a protected call with the Lua allocator wrapped to
+   count memory use, and the loader or dumper counts events and times the
+   libyaml calls as it goes.  The results are written into the table when
+   the call returns, even if it raised an error.  Without the option, the
+   only cost is looking it up, and a NULL check for each event. */
+
+#include <string.h>
+#include <time.h>
+
+#include "lyaml.h"
+
+
+/* Return a timestamp in seconds, from a monotonic clock if possible. */
+double
+lyaml_clock (void)
+{
+#ifdef CLOCK_MONOTONIC
+   struct timespec ts;
+
+   if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+      return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#endif
+   return (double) clock () / CLOCKS_PER_SEC;
+}
+
+/* Count memory allocated and released through the wrapped allocator. */
+static void *
+stats_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+   lyaml_stats *stats = (lyaml_stats *) ud;
+   /* Lua 5.2 and newer pass the type of a new object in osize */
+   size_t old = ptr == NULL ? 0 : osize;
+
+   if (nsize > old)
+   {
+      if (old == 0)
+         stats->allocs++;
+      stats->alloc_bytes += nsize - old;
+   }
+   else
+      stats->free_bytes += old - nsize;
+   return stats->allocf (stats->allocud, ptr, osize, nsize);
+}
+
+/* Count EVENT, before it is handed to the emitter or after it is
+   returned by the parser. */
+void
+lyaml_stats_event (lyaml_stats *stats, const yaml_event_t *event)
+{
+   const yaml_char_t *anchor = NULL;
+
+   if (event->type > YAML_MAPPING_END_EVENT)
+      return;
+   stats->events[event->type]++;
+
+   switch (event->type)
+   {
+      case YAML_SCALAR_EVENT:
+         anchor = event->data.scalar.anchor;
+         break;
+      case YAML_SEQUENCE_START_EVENT:
+         anchor = event->data.sequence_start.anchor;
+         break;
+      case YAML_MAPPING_START_EVENT:
+         anchor = event->data.mapping_start.anchor;
+         break;
+      default:
+         break;
+   }
+   if (anchor != NULL)
+      stats->anchors++;
+}
+
+/* Return the counters of the call in progress, or NULL if the running
+   function wasn't called by lyaml_stats_call. */
+lyaml_stats *
+lyaml_tostats (lua_State *L)
+{
+   return (lyaml_stats *) lua_touserdata (L, lua_upvalueindex (1));
+}
+
+#define RAWSET_NUMBER(_k, _v)				\
+        lua_pushstring  (L, _k);			\
+        lua_pushnumber  (L, (lua_Number) (_v));		\
+        lua_rawset      (L, -3)
+
+/* Write STATS into the table on top of the stack. */
+static void
+stats_push (lua_State *L, const lyaml_stats *stats, double seconds)
+{
+   const lua_Integer *n = stats->events;
+
+   RAWSET_INTEGER ("bytes",       stats->bytes);
+   RAWSET_INTEGER ("documents",   n[YAML_DOCUMENT_START_EVENT]);
+   RAWSET_INTEGER ("nodes",       n[YAML_SCALAR_EVENT] +
+                                  n[YAML_SEQUENCE_START_EVENT] +
+                                  n[YAML_MAPPING_START_EVENT]);
+   RAWSET_INTEGER ("anchors",     stats->anchors);
+   RAWSET_INTEGER ("aliases",     n[YAML_ALIAS_EVENT]);
+   RAWSET_INTEGER ("allocs",      stats->allocs);
+   RAWSET_INTEGER ("alloc_bytes", stats->alloc_bytes);
+   RAWSET_INTEGER ("free_bytes",  stats->free_bytes);
+
+   RAWSET_NUMBER ("seconds",         seconds);
+   RAWSET_NUMBER ("libyaml_seconds", stats->libyaml);
+   RAWSET_NUMBER ("resolve_seconds", stats->resolve);
+   RAWSET_NUMBER ("build_seconds",
+                  seconds - stats->libyaml - stats->resolve);
+
+   lua_pushliteral (L, "events");
+   lua_createtable (L, 0, YAML_MAPPING_END_EVENT);
+#define MENTRY(_s)	RAWSET_INTEGER (#_s, n[YAML_##_s##_EVENT])
+   MENTRY( STREAM_START		);
+   MENTRY( STREAM_END		);
+   MENTRY( DOCUMENT_START	);
+   MENTRY( DOCUMENT_END		);
+   MENTRY( ALIAS		);
+   MENTRY( SCALAR		);
+   MENTRY( SEQUENCE_START	);
+   MENTRY( SEQUENCE_END		);
+   MENTRY( MAPPING_START	);
+   MENTRY( MAPPING_END		);
+#undef MENTRY
+   lua_rawset (L, -3);
+}
+
+/* Call F with the arguments on the stack, and return its results.  If
+   the second argument is an options table with a `stats` field, F runs
+   as a closure whose first upvalue is a fresh lyaml_stats, found with
+   lyaml_tostats; and the counters are written into the stats table after
+   F returns or raises an error. */
+int
+lyaml_stats_call (lua_State *L, lua_CFunction f)
+{
+   lyaml_stats *stats;
+   double start;
+   int nargs = lua_gettop (L), i, r;
+
+   if (!lua_istable (L, 2))
+      return f (L);
+   lua_getfield (L, 2, "stats");
+   if (lua_isnil (L, -1))
+   {
+      lua_pop (L, 1);
+      return f (L);
+   }
+   if (!lua_istable (L, -1))
+      return luaL_error (L, "stats must be a table");
+
+   stats = (lyaml_stats *) lua_newuserdata (L, sizeof (*stats));
+   memset ((void *) stats, 0, sizeof (*stats));
+
+   lua_pushlightuserdata (L, stats);
+   lua_pushcclosure      (L, f, 1);
+   for (i = 1; i <= nargs; i++)
+      lua_pushvalue (L, i);
+
+   /* nothing may raise an error until the allocator is put back */
+   stats->allocf = lua_getallocf (L, &stats->allocud);
+   lua_setallocf (L, stats_alloc, stats);
+   start = lyaml_clock ();
+   r = lua_pcall (L, nargs, LUA_MULTRET, 0);
+   lua_setallocf (L, stats->allocf, stats->allocud);
+
+   lua_pushvalue (L, nargs + 1);
+   stats_push    (L, stats, lyaml_clock () - start);
+   lua_pop       (L, 1);
+
+   if (r != 0)
+      return lua_error (L);
+   return lua_gettop (L) - (nargs + 2);
+}
@@ -0,0 +1,1035 @@
+/*
+ * tape.c, recorded libyaml parser events for lyaml
+ *
+ * Copyright (C) 2013-2020 Gary V. Vaughan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* A tape holds every event of a YAML stream, parsed once, in a single
+   userdatum.  Each field of the events is kept in an array of its own,
+   and anchors, tags and scalar values are copied one after another into
+   a string pool, so that walking the tape again and again touches no
+   Lua tables at all.  Every start event records the index of its end
+   event, and every end event the index of its start, so a whole node
+   can be stepped over at once.
+
+   A tape can be passed to `yaml.load`, `yaml.documents` and `yaml.select`
+   in place of a YAML stream, and to `yaml.dump` in place of a list of
+   documents, to replay its events.  %YAML and %TAG directives are not
+   recorded; the tags of recorded nodes are already fully resolved.
+
+   Recording never touches the Lua state, so lyaml_tape_parallel can
+   split a long string at document boundaries, record each part on a
+   worker thread, and splice the parts together into a single tape. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#  include <pthread.h>
+#endif
+
+#include "lyaml.h"
+
+
+#define TAPE_NAME	"lyaml.tape"
+#define TAPE_NONE	SIZE_MAX	/* no anchor, tag or value */
+
+/* bits in the flags of each event */
+#define TAPE_IMPLICIT		1	/* implicit, or plain_implicit */
+#define TAPE_QUOTED_IMPLICIT	2
+
+struct lyaml_tape {
+   size_t	  n;		/* events recorded */
+   size_t	  size;		/* room in each array */
+   unsigned char *type;		/* yaml_event_type_t of each event */
+   unsigned char *style;	/* scalar or collection style, or encoding */
+   unsigned char *flags;
+   size_t	 *anchor;	/* offsets into pool, or TAPE_NONE */
+   size_t	 *tag;
+   size_t	 *value;
+   size_t	 *length;	/* of each value */
+   size_t	 *match;	/* index of the matching start or end event */
+   yaml_mark_t	 *start_mark;
+   yaml_mark_t	 *end_mark;
+
+   /* anchors, tags and values, each followed by a NUL */
+   char		 *pool;
+   size_t	  poollen;
+   size_t	  poolsize;
+
+   /* indices of the start events still waiting for their end */
+   size_t	 *open;
+   size_t	  depth;
+   size_t	  opensize;
+
+   /* options */
+   char		  codes;	/* integer type and style results */
+
+   /* an allocation failed while recording */
+   char		  nomem;
+
+   /* the parser, while the tape is being recorded */
+   char		  parsing;
+   yaml_parser_t  parser;
+   yaml_event_t	  event;
+   char		  validevent;
+   lyaml_input	  input;
+};
+
+
+/* Release the parser, while the tape is being recorded. */
+static void
+tape_delete_parser (lua_State *L, lyaml_tape *tape)
+{
+   if (!tape->parsing)
+      return;
+   if (tape->validevent)
+      yaml_event_delete (&tape->event);
+   yaml_parser_delete (&tape->parser);
+   lyaml_input_delete (L, &tape->input);
+   tape->validevent = tape->parsing = 0;
+}
+
+/* Release the recorded events. */
+static void
+tape_free (lyaml_tape *tape)
+{
+   free (tape->type);
+   free (tape->style);
+   free (tape->flags);
+   free (tape->anchor);
+   free (tape->tag);
+   free (tape->value);
+   free (tape->length);
+   free (tape->match);
+   free (tape->start_mark);
+   free (tape->end_mark);
+   free (tape->pool);
+   free (tape->open);
+   memset ((void *) tape, 0, sizeof (*tape));
+}
+
+static int
+tape_gc (lua_State *L)
+{
+   lyaml_tape *tape = (lyaml_tape *) lua_touserdata (L, 1);
+
+   if (tape)
+   {
+      tape_delete_parser (L, tape);
+      tape_free (tape);
+   }
+   return 0;
+}
+
+/* Grow *P, an array of SIZE elements of ELEMSIZE bytes each, to NSIZE
+   elements; return 0 and note it in TAPE if there isn't enough memory. */
+static int
+tape_grow (lyaml_tape *tape, void **p, size_t nsize, size_t elemsize)
+{
+   void *np = NULL;
+
+   if (nsize <= SIZE_MAX / elemsize)
+      np = realloc (*p, nsize * elemsize);
+   if (np == NULL)
+   {
+      tape->nomem = 1;
+      return 0;
+   }
+   *p = np;
+   return 1;
+}
+
+/* Make room for NSIZE events, or one more if NSIZE is 0. */
+static int
+tape_reserve (lyaml_tape *tape, size_t nsize)
+{
+   size_t size = nsize;
+
+   if (size == 0)
+   {
+      if (tape->n < tape->size)
+         return 1;
+      size = tape->size ? 2 * tape->size : 64;
+   }
+
+#define MENTRY(_s)	\
+   if (!tape_grow (tape, (void **) &tape->_s, size, sizeof (*tape->_s))) \
+      return 0
+   MENTRY( type		);
+   MENTRY( style	);
+   MENTRY( flags	);
+   MENTRY( anchor	);
+   MENTRY( tag		);
+   MENTRY( value	);
+   MENTRY( length	);
+   MENTRY( match	);
+   MENTRY( start_mark	);
+   MENTRY( end_mark	);
+#undef MENTRY
+   tape->size = size;
+   return 1;
+}
+
+/* Copy LEN bytes at S into the pool, and return their offset. */
+static size_t
+tape_intern (lyaml_tape *tape, const yaml_char_t *s, size_t len)
+{
+   size_t offset = tape->poollen;
+
+   if (s == NULL)
+      return TAPE_NONE;
+   if (tape->poolsize - tape->poollen <= len)
+   {
+      size_t size = tape->poolsize ? tape->poolsize : 1024;
+
+      while (size - tape->poollen <= len)
+      {
+         if (size > SIZE_MAX / 2)
+         {
+            tape->nomem = 1;
+            return TAPE_NONE;
+         }
+         size *= 2;
+      }
+      if (!tape_grow (tape, (void **) &tape->pool, size, 1))
+         return TAPE_NONE;
+      tape->poolsize = size;
+   }
+   memcpy (tape->pool + offset, s, len);
+   tape->pool[offset + len] = '\0';
+   tape->poollen += len + 1;
+   return offset;
+}
+
+#define tape_string(tape, s) \
+   tape_intern (tape, s, (s) ? strlen ((const char *) (s)) : 0)
+
+/* Append EVENT to TAPE, pairing end events with their starts.  Return 0
+   if there isn't enough memory. */
+static int
+tape_record (lyaml_tape *tape, const yaml_event_t *event)
+{
+   size_t i = tape->n;
+
+   if (!tape_reserve (tape, 0))
+      return 0;
+   tape->type[i]       = (unsigned char) event->type;
+   tape->style[i]      = 0;
+   tape->flags[i]      = 0;
+   tape->anchor[i]     = tape->tag[i] = tape->value[i] = TAPE_NONE;
+   tape->length[i]     = 0;
+   tape->match[i]      = i;
+   tape->start_mark[i] = event->start_mark;
+   tape->end_mark[i]   = event->end_mark;
+
+   switch (event->type)
+   {
+      case YAML_STREAM_START_EVENT:
+         tape->style[i] = (unsigned char) event->data.stream_start.encoding;
+         break;
+
+      case YAML_DOCUMENT_START_EVENT:
+         if (event->data.document_start.implicit)
+            tape->flags[i] |= TAPE_IMPLICIT;
+         break;
+
+      case YAML_DOCUMENT_END_EVENT:
+         if (event->data.document_end.implicit)
+            tape->flags[i] |= TAPE_IMPLICIT;
+         break;
+
+      case YAML_ALIAS_EVENT:
+         tape->anchor[i] = tape_string (tape, event->data.alias.anchor);
+         break;
+
+      case YAML_SCALAR_EVENT:
+#define EVENTF(_f)	(event->data.scalar._f)
+         tape->style[i]  = (unsigned char) EVENTF (style);
+         tape->anchor[i] = tape_string (tape, EVENTF (anchor));
+         tape->tag[i]    = tape_string (tape, EVENTF (tag));
+         tape->value[i]  = tape_intern (tape, EVENTF (value), EVENTF (length));
+         tape->length[i] = EVENTF (length);
+         if (EVENTF (plain_implicit))
+            tape->flags[i] |= TAPE_IMPLICIT;
+         if (EVENTF (quoted_implicit))
+            tape->flags[i] |= TAPE_QUOTED_IMPLICIT;
+#undef EVENTF
+         break;
+
+      case YAML_SEQUENCE_START_EVENT:
+#define EVENTF(_f)	(event->data.sequence_start._f)
+         tape->style[i]  = (unsigned char) EVENTF (style);
+         tape->anchor[i] = tape_string (tape, EVENTF (anchor));
+         tape->tag[i]    = tape_string (tape, EVENTF (tag));
+         if (EVENTF (implicit))
+            tape->flags[i] |= TAPE_IMPLICIT;
+#undef EVENTF
+         break;
+
+      case YAML_MAPPING_START_EVENT:
+#define EVENTF(_f)	(event->data.mapping_start._f)
+         tape->style[i]  = (unsigned char) EVENTF (style);
+         tape->anchor[i] = tape_string (tape, EVENTF (anchor));
+         tape->tag[i]    = tape_string (tape, EVENTF (tag));
+         if (EVENTF (implicit))
+            tape->flags[i] |= TAPE_IMPLICIT;
+#undef EVENTF
+         break;
+
+      default:
+         break;
+   }
+
+   switch (event->type)
+   {
+      case YAML_STREAM_START_EVENT:
+      case YAML_DOCUMENT_START_EVENT:
+      case YAML_SEQUENCE_START_EVENT:
+      case YAML_MAPPING_START_EVENT:
+         if (tape->depth == tape->opensize)
+         {
+            size_t size = tape->opensize ? 2 * tape->opensize : 16;
+
+            if (!tape_grow (tape, (void **) &tape->open, size,
+                            sizeof (*tape->open)))
+               return 0;
+            tape->opensize = size;
+         }
+         tape->open[tape->depth++] = i;
+         break;
+
+      case YAML_STREAM_END_EVENT:
+      case YAML_DOCUMENT_END_EVENT:
+      case YAML_SEQUENCE_END_EVENT:
+      case YAML_MAPPING_END_EVENT:
+         /* libyaml only produces properly nested streams */
+         if (tape->depth > 0)
+         {
+            size_t start = tape->open[--tape->depth];
+
+            tape->match[start] = i;
+            tape->match[i]     = start;
+         }
+         break;
+
+      default:
+         break;
+   }
+
+   tape->n++;
+   return !tape->nomem;
+}
+
+/* Parse the whole input into TAPE. */
+static void
+tape_parse (lua_State *L, lyaml_tape *tape)
+{
+   do
+   {
+      if (tape->validevent)
+      {
+         yaml_event_delete (&tape->event);
+         tape->validevent = 0;
+      }
+      if (yaml_parser_parse (&tape->parser, &tape->event) != 1)
+      {
+         yaml_parser_t *P = &tape->parser;
+
+         /* pass errors from the input source through untouched */
+         if (lyaml_input_error (L, &tape->input))
+            lua_error (L);
+         luaL_error (L, "%d:%d: %s", (int) P->problem_mark.line + 1,
+                     (int) P->problem_mark.column + 1,
+                     P->problem ? P->problem : "A problem");
+      }
+      tape->validevent = 1;
+      if (!tape_record (tape, &tape->event))
+         luaL_error (L, "cannot allocate tape");
+   }
+   while (tape->event.type != YAML_STREAM_END_EVENT);
+}
+
+#ifndef _WIN32
+
+#define TAPE_MIN_PART	65536	/* bytes, not worth a thread for less */
+#define TAPE_MAX_PARTS	64
+
+/* A part of a string to be recorded on a thread of its own. */
+typedef struct {
+   const unsigned char *s;
+   size_t	  len;
+   lyaml_tape	  tape;
+   int		  ok;		/* recorded to the end of the stream */
+} tape_part;
+
+/* Record every event of PART on its tape, without touching any Lua
+   state, as the start routine of a thread. */
+static void *
+tape_record_part (void *arg)
+{
+   tape_part *part = (tape_part *) arg;
+   yaml_parser_t parser;
+   yaml_event_t event;
+   yaml_event_type_t type;
+
+   part->ok = 0;
+   if (yaml_parser_initialize (&parser) == 0)
+      return NULL;
+   yaml_parser_set_input_string (&parser, part->s, part->len);
+   do
+   {
+      if (yaml_parser_parse (&parser, &event) != 1)
+      {
+         part->ok = 0;
+         break;
+      }
+      type = event.type;
+      part->ok = tape_record (&part->tape, &event);
+      yaml_event_delete (&event);
+   }
+   while (part->ok && type != YAML_STREAM_END_EVENT);
+   yaml_parser_delete (&parser);
+   return NULL;
+}
+
+/* Return 1 if S starts a line, after byte 0 of the LEN bytes at BASE. */
+#define STARTS_LINE(_base, _s)	((_s) == (_base) || (_s)[-1] == '\n')
+
+/* Return 0 if splitting the LEN bytes at S at document boundaries might
+   change how they parse: if they are not UTF-8, or have %YAML or %TAG
+   directives, which belong to the following document. */
+static int
+tape_splittable (const unsigned char *s, size_t len)
+{
+   const unsigned char *p = s, *end = s + len;
+
+   if (len >= 2 && (s[0] == '\0' || s[1] == '\0' ||
+                    (s[0] == 0xfe && s[1] == 0xff) ||
+                    (s[0] == 0xff && s[1] == 0xfe)))
+      return 0;
+   while ((p = (const unsigned char *) memchr (p, '%', end - p)) != NULL)
+   {
+      if (STARTS_LINE (s, p))
+         return 0;
+      p++;
+   }
+   return 1;
+}
+
+/* Return the offset of the first document start marker at or after byte
+   FROM of the LEN bytes at S, or LEN if there is none.  A line starting
+   with `---` and a blank always starts a document, wherever libyaml
+   meets it, unless the stream is invalid anyway. */
+static size_t
+tape_next_document (const unsigned char *s, size_t len, size_t from)
+{
+   const unsigned char *p = s + from, *end = s + len;
+
+   while (p < end)
+   {
+      if (STARTS_LINE (s, p) && end - p >= 3 && memcmp (p, "---", 3) == 0 &&
+          (end - p == 3 || p[3] == ' ' || p[3] == '\t' || p[3] == '\r' ||
+           p[3] == '\n'))
+         return p - s;
+      p = (const unsigned char *) memchr (p, '\n', end - p);
+      if (p == NULL)
+         break;
+      p++;
+   }
+   return len;
+}
+
+/* Splice the tapes of N consecutive PARTS into TAPE, dropping the stream
+   end and start events between them, and moving the marks of each part
+   to where it starts in the whole string.  Return 0 if there isn't
+   enough memory. */
+static int
+tape_splice (lyaml_tape *tape, tape_part *parts, size_t n)
+{
+   size_t total = 0, poollen = 0, out = 0, line = 0, index = 0, j, k;
+
+   for (k = 0; k < n; k++)
+   {
+      total += parts[k].tape.n;
+      poollen += parts[k].tape.poollen;
+   }
+   total -= 2 * (n - 1);
+   if (!tape_reserve (tape, total) ||
+       !tape_grow (tape, (void **) &tape->pool, poollen + 1, 1))
+      return 0;
+   tape->poolsize = poollen + 1;
+
+   for (k = 0; k < n; k++)
+   {
+      const lyaml_tape *t = &parts[k].tape;
+      size_t first = k > 0 ? 1 : 0;
+      size_t last  = k + 1 < n ? t->n - 1 : t->n;
+      size_t base  = out - first;
+
+      for (j = first; j < last; j++, out++)
+      {
+#define MOVE(_f)	\
+         (t->_f[j] == TAPE_NONE ? TAPE_NONE : t->_f[j] + tape->poollen)
+         tape->type[out]   = t->type[j];
+         tape->style[out]  = t->style[j];
+         tape->flags[out]  = t->flags[j];
+         tape->anchor[out] = MOVE (anchor);
+         tape->tag[out]    = MOVE (tag);
+         tape->value[out]  = MOVE (value);
+         tape->length[out] = t->length[j];
+         tape->match[out]  = t->match[j] + base;
+#undef MOVE
+         tape->start_mark[out] = t->start_mark[j];
+         tape->start_mark[out].line  += line;
+         tape->start_mark[out].index += index;
+         tape->end_mark[out] = t->end_mark[j];
+         tape->end_mark[out].line  += line;
+         tape->end_mark[out].index += index;
+      }
+      if (t->poollen > 0)
+         memcpy (tape->pool + tape->poollen, t->pool, t->poollen);
+      tape->poollen += t->poollen;
+
+      /* each part ends with a line break, just before the next starts */
+      line  += t->start_mark[t->n - 1].line;
+      index += t->start_mark[t->n - 1].index;
+   }
+
+   tape->n = out;
+   tape->match[0] = out - 1;
+   tape->match[out - 1] = 0;
+   return 1;
+}
+
+#endif
+
+/* Record the LEN bytes at S on a new tape, and push it.  The bytes are
+   split at document boundaries into as many as NTHREADS parts, of at
+   least TAPE_MIN_PART bytes each, and each part is recorded on a thread
+   of its own.  Return NULL, pushing nothing, if the stream can't be
+   split or any part fails to parse, so that the caller can parse it in
+   one piece and report the error exactly as usual. */
+lyaml_tape *
+lyaml_tape_parallel (lua_State *L, const unsigned char *s, size_t len,
+                     int nthreads)
+{
+#ifdef _WIN32
+   return NULL;
+#else
+   tape_part parts[TAPE_MAX_PARTS];
+   pthread_t threads[TAPE_MAX_PARTS];
+   char started[TAPE_MAX_PARTS];
+   lyaml_tape *tape;
+   size_t n = 0, from = 0, step, k;
+   int ok = 1, nomem = 0;
+
+   if (nthreads > TAPE_MAX_PARTS)
+      nthreads = TAPE_MAX_PARTS;
+   if (nthreads < 2 || !tape_splittable (s, len))
+      return NULL;
+
+   step = len / nthreads;
+   if (step < TAPE_MIN_PART)
+      step = TAPE_MIN_PART;
+   while (from < len && n < (size_t) nthreads)
+   {
+      size_t to = len;
+
+      if (n + 1 < (size_t) nthreads && len - from > step)
+         to = tape_next_document (s, len, from + step);
+      memset ((void *) &parts[n], 0, sizeof (parts[n]));
+      parts[n].s   = s + from;
+      parts[n].len = to - from;
+      n++;
+      from = to;
+   }
+   if (n < 2)
+      return NULL;
+
+   /* nothing may raise an error while the threads are running */
+   tape = (lyaml_tape *) lua_newuserdata (L, sizeof (*tape));
+   memset ((void *) tape, 0, sizeof (*tape));
+   luaL_getmetatable (L, TAPE_NAME);
+   lua_setmetatable  (L, -2);
+
+   for (k = 1; k < n; k++)
+      started[k] = pthread_create (&threads[k], NULL, tape_record_part,
+                                   &parts[k]) == 0;
+   tape_record_part (&parts[0]);
+   for (k = 1; k < n; k++)
+   {
+      if (started[k])
+         pthread_join (threads[k], NULL);
+      else
+         tape_record_part (&parts[k]);
+   }
+
+   for (k = 0; k < n; k++)
+      ok = ok && parts[k].ok;
+   if (ok)
+      nomem = !tape_splice (tape, parts, n);
+   for (k = 0; k < n; k++)
+      tape_free (&parts[k].tape);
+
+   if (nomem)
+      luaL_error (L, "cannot allocate tape");
+   if (!ok)
+   {
+      lua_pop (L, 1);
+      return NULL;
+   }
+   return tape;
+#endif
+}
+
+/* Return the tape at IDX, or NULL if it isn't one. */
+lyaml_tape *
+lyaml_totape (lua_State *L, int idx)
+{
+   void *p = lua_touserdata (L, idx);
+   int istape;
+
+   if (p == NULL || !lua_getmetatable (L, idx))
+      return NULL;
+   luaL_getmetatable (L, TAPE_NAME);
+   istape = lua_rawequal (L, -1, -2);
+   lua_pop (L, 2);
+   return istape ? (lyaml_tape *) p : NULL;
+}
+
+size_t
+lyaml_tape_length (const lyaml_tape *tape)
+{
+   return tape->n;
+}
+
+#define POOL(_f)	\
+   ((yaml_char_t *) (tape->_f[i] == TAPE_NONE ? NULL : tape->pool + tape->_f[i]))
+
+/* Fill in EVENT with the Ith event (from 0) on TAPE, pointing into the
+   tape rather than owning copies, so it must not be passed to
+   yaml_event_delete.  Return 0 if there is no such event. */
+int
+lyaml_tape_event (const lyaml_tape *tape, size_t i, yaml_event_t *event)
+{
+   if (i >= tape->n)
+      return 0;
+
+   memset ((void *) event, 0, sizeof (*event));
+   event->type       = (yaml_event_type_t) tape->type[i];
+   event->start_mark = tape->start_mark[i];
+   event->end_mark   = tape->end_mark[i];
+
+   switch (event->type)
+   {
+      case YAML_STREAM_START_EVENT:
+         event->data.stream_start.encoding =
+            (yaml_encoding_t) tape->style[i];
+         break;
+
+      case YAML_DOCUMENT_START_EVENT:
+         event->data.document_start.implicit = tape->flags[i] & TAPE_IMPLICIT;
+         break;
+
+      case YAML_DOCUMENT_END_EVENT:
+         event->data.document_end.implicit = tape->flags[i] & TAPE_IMPLICIT;
+         break;
+
+      case YAML_ALIAS_EVENT:
+         event->data.alias.anchor = POOL (anchor);
+         break;
+
+      case YAML_SCALAR_EVENT:
+#define EVENTF(_f)	(event->data.scalar._f)
+         EVENTF (anchor) = POOL (anchor);
+         EVENTF (tag)    = POOL (tag);
+         EVENTF (value)  = POOL (value);
+         EVENTF (length) = tape->length[i];
+         EVENTF (style)  = (yaml_scalar_style_t) tape->style[i];
+         EVENTF (plain_implicit)  = (tape->flags[i] & TAPE_IMPLICIT) != 0;
+         EVENTF (quoted_implicit) = (tape->flags[i] & TAPE_QUOTED_IMPLICIT) != 0;
+#undef EVENTF
+         break;
+
+      case YAML_SEQUENCE_START_EVENT:
+#define EVENTF(_f)	(event->data.sequence_start._f)
+         EVENTF (anchor)   = POOL (anchor);
+         EVENTF (tag)      = POOL (tag);
+         EVENTF (implicit) = tape->flags[i] & TAPE_IMPLICIT;
+         EVENTF (style)    = (yaml_sequence_style_t) tape->style[i];
+#undef EVENTF
+         break;
+
+      case YAML_MAPPING_START_EVENT:
+#define EVENTF(_f)	(event->data.mapping_start._f)
+         EVENTF (anchor)   = POOL (anchor);
+         EVENTF (tag)      = POOL (tag);
+         EVENTF (implicit) = tape->flags[i] & TAPE_IMPLICIT;
+         EVENTF (style)    = (yaml_mapping_style_t) tape->style[i];
+#undef EVENTF
+         break;
+
+      default:
+         break;
+   }
+   return 1;
+}
+
+/* Initialize EVENT with a copy of the Ith event on TAPE, for handing over
+   to yaml_emitter_emit.  Return 0 on failure, like the libyaml
+   initializers. */
+int
+lyaml_tape_initialize_event (const lyaml_tape *tape, size_t i,
+                             yaml_event_t *event)
+{
+   yaml_event_t e;
+
+   if (!lyaml_tape_event (tape, i, &e))
+      return 0;
+
+   switch (e.type)
+   {
+      case YAML_STREAM_START_EVENT:
+         return yaml_stream_start_event_initialize (event,
+                   e.data.stream_start.encoding);
+      case YAML_STREAM_END_EVENT:
+         return yaml_stream_end_event_initialize (event);
+      case YAML_DOCUMENT_START_EVENT:
+         return yaml_document_start_event_initialize (event, NULL, NULL, NULL,
+                   e.data.document_start.implicit);
+      case YAML_DOCUMENT_END_EVENT:
+         return yaml_document_end_event_initialize (event,
+                   e.data.document_end.implicit);
+      case YAML_ALIAS_EVENT:
+         return yaml_alias_event_initialize (event, e.data.alias.anchor);
+      case YAML_SCALAR_EVENT:
+#define EVENTF(_f)	(e.data.scalar._f)
+         return yaml_scalar_event_initialize (event, EVENTF (anchor),
+                   EVENTF (tag), EVENTF (value), (int) EVENTF (length),
+                   EVENTF (plain_implicit), EVENTF (quoted_implicit),
+                   EVENTF (style));
+#undef EVENTF
+      case YAML_SEQUENCE_START_EVENT:
+#define EVENTF(_f)	(e.data.sequence_start._f)
+         return yaml_sequence_start_event_initialize (event, EVENTF (anchor),
+                   EVENTF (tag), EVENTF (implicit), EVENTF (style));
+#undef EVENTF
+      case YAML_SEQUENCE_END_EVENT:
+         return yaml_sequence_end_event_initialize (event);
+      case YAML_MAPPING_START_EVENT:
+#define EVENTF(_f)	(e.data.mapping_start._f)
+         return yaml_mapping_start_event_initialize (event, EVENTF (anchor),
+                   EVENTF (tag), EVENTF (implicit), EVENTF (style));
+#undef EVENTF
+      case YAML_MAPPING_END_EVENT:
+         return yaml_mapping_end_event_initialize (event);
+      default:
+         return 0;
+   }
+}
+
+
+/* Return the tape in the first argument slot, and the index in the
+   second converted from 1-based to 0-based. */
+static lyaml_tape *
+tape_check (lua_State *L, size_t *i)
+{
+   lyaml_tape *tape = (lyaml_tape *) luaL_checkudata (L, 1, TAPE_NAME);
+   lua_Integer n = luaL_checkinteger (L, 2);
+
+   luaL_argcheck (L, n >= 1 && (size_t) n <= tape->n, 2,
+                  "event index out of range");
+   *i = (size_t) n - 1;
+   return tape;
+}
+
+static const char *
+tape_typename (yaml_event_type_t type)
+{
+   switch (type)
+   {
+#define MENTRY(_s)	case YAML_##_s##_EVENT: return #_s
+      MENTRY( STREAM_START	);
+      MENTRY( STREAM_END	);
+      MENTRY( DOCUMENT_START	);
+      MENTRY( DOCUMENT_END	);
+      MENTRY( ALIAS		);
+      MENTRY( SCALAR		);
+      MENTRY( SEQUENCE_START	);
+      MENTRY( SEQUENCE_END	);
+      MENTRY( MAPPING_START	);
+      MENTRY( MAPPING_END	);
+#undef MENTRY
+      default:
+         return "NO";
+   }
+}
+
+/* Return the name of a style or encoding of the given event TYPE. */
+static const char *
+tape_stylename (yaml_event_type_t type, int style)
+{
+   switch (type)
+   {
+      case YAML_STREAM_START_EVENT:
+         switch (style)
+         {
+#define MENTRY(_s)	case YAML_##_s##_ENCODING: return #_s
+            MENTRY( UTF8	);
+            MENTRY( UTF16LE	);
+            MENTRY( UTF16BE	);
+#undef MENTRY
+         }
+         break;
+
+      case YAML_SCALAR_EVENT:
+         switch (style)
+         {
+#define MENTRY(_s)	case YAML_##_s##_SCALAR_STYLE: return #_s
+            MENTRY( PLAIN		);
+            MENTRY( SINGLE_QUOTED	);
+            MENTRY( DOUBLE_QUOTED	);
+            MENTRY( LITERAL		);
+            MENTRY( FOLDED		);
+#undef MENTRY
+         }
+         break;
+
+      case YAML_SEQUENCE_START_EVENT:
+      case YAML_MAPPING_START_EVENT:
+         /* sequences and mappings share the values of their styles */
+         switch (style)
+         {
+#define MENTRY(_s)	case YAML_##_s##_SEQUENCE_STYLE: return #_s
+            MENTRY( BLOCK	);
+            MENTRY( FLOW	);
+#undef MENTRY
+         }
+         break;
+
+      default:
+         break;
+   }
+   return "ANY";
+}
+
+/* Number of events on the tape. */
+static int
+tape_len (lua_State *L)
+{
+   lyaml_tape *tape = (lyaml_tape *) luaL_checkudata (L, 1, TAPE_NAME);
+
+   lua_pushinteger (L, (lua_Integer) tape->n);
+   return 1;
+}
+
+/* Type of event I, as a name or with `codes = true` an integer code. */
+static int
+tape_type (lua_State *L)
+{
+   size_t i;
+   lyaml_tape *tape = tape_check (L, &i);
+
+   if (tape->codes)
+      lua_pushinteger (L, tape->type[i]);
+   else
+      lua_pushstring (L, tape_typename ((yaml_event_type_t) tape->type[i]));
+   return 1;
+}
+
+/* Style of scalar or collection event I, or encoding of STREAM_START;
+   nil for other events. */
+static int
+tape_style (lua_State *L)
+{
+   size_t i;
+   lyaml_tape *tape = tape_check (L, &i);
+   yaml_event_type_t type = (yaml_event_type_t) tape->type[i];
+
+   switch (type)
+   {
+      case YAML_STREAM_START_EVENT:
+      case YAML_SCALAR_EVENT:
+      case YAML_SEQUENCE_START_EVENT:
+      case YAML_MAPPING_START_EVENT:
+         if (tape->codes)
+            lua_pushinteger (L, tape->style[i]);
+         else
+            lua_pushstring (L, tape_stylename (type, tape->style[i]));
+         break;
+      default:
+         lua_pushnil (L);
+   }
+   return 1;
+}
+
+#define TAPE_STRING(_f, _len)						\
+static int								\
+tape_##_f (lua_State *L)						\
+{									\
+   size_t i;								\
+   lyaml_tape *tape = tape_check (L, &i);				\
+									\
+   if (tape->_f[i] == TAPE_NONE)					\
+      lua_pushnil (L);							\
+   else									\
+      lua_pushlstring (L, tape->pool + tape->_f[i], (_len));		\
+   return 1;								\
+}
+
+/* Anchor, tag and value of event I, or nil where it has none. */
+TAPE_STRING (anchor, strlen (tape->pool + tape->anchor[i]))
+TAPE_STRING (tag,    strlen (tape->pool + tape->tag[i]))
+TAPE_STRING (value,  tape->length[i])
+#undef TAPE_STRING
+
+/* The implicit flag of event I; for scalars plain_implicit followed by
+   quoted_implicit. */
+static int
+tape_implicit (lua_State *L)
+{
+   size_t i;
+   lyaml_tape *tape = tape_check (L, &i);
+
+   lua_pushboolean (L, (tape->flags[i] & TAPE_IMPLICIT) != 0);
+   if (tape->type[i] != YAML_SCALAR_EVENT)
+      return 1;
+   lua_pushboolean (L, (tape->flags[i] & TAPE_QUOTED_IMPLICIT) != 0);
+   return 2;
+}
+
+/* Start and end mark of event I: line, column and character index of
+   each, counting from 0 as in event tables from `yaml.parser`. */
+static int
+tape_mark (lua_State *L)
+{
+   size_t i;
+   lyaml_tape *tape = tape_check (L, &i);
+
+   lua_pushinteger (L, (lua_Integer) tape->start_mark[i].line);
+   lua_pushinteger (L, (lua_Integer) tape->start_mark[i].column);
+   lua_pushinteger (L, (lua_Integer) tape->start_mark[i].index);
+   lua_pushinteger (L, (lua_Integer) tape->end_mark[i].line);
+   lua_pushinteger (L, (lua_Integer) tape->end_mark[i].column);
+   lua_pushinteger (L, (lua_Integer) tape->end_mark[i].index);
+   return 6;
+}
+
+/* Index of the end event matching start event I, of the start event
+   matching end event I, or I itself for other events. */
+static int
+tape_match (lua_State *L)
+{
+   size_t i;
+   lyaml_tape *tape = tape_check (L, &i);
+
+   lua_pushinteger (L, (lua_Integer) tape->match[i] + 1);
+   return 1;
+}
+
+/* Index of the first event after the node that starts at event I. */
+static int
+tape_skip (lua_State *L)
+{
+   size_t i;
+   lyaml_tape *tape = tape_check (L, &i);
+
+   if (tape->match[i] > i)
+      i = tape->match[i];
+   lua_pushinteger (L, (lua_Integer) i + 2);
+   return 1;
+}
+
+void
+tape_init (lua_State *L)
+{
+   luaL_newmetatable (L, TAPE_NAME);
+   lua_pushcfunction (L, tape_gc);
+   lua_setfield      (L, -2, "__gc");
+   lua_pushcfunction (L, tape_len);
+   lua_setfield      (L, -2, "__len");
+
+   lua_createtable (L, 0, 10);
+#define MENTRY(_s)			\
+   lua_pushcfunction (L, tape_##_s);	\
+   lua_setfield      (L, -2, #_s)
+   MENTRY( anchor	);
+   MENTRY( implicit	);
+   MENTRY( len		);
+   MENTRY( mark		);
+   MENTRY( match	);
+   MENTRY( skip		);
+   MENTRY( style	);
+   MENTRY( tag		);
+   MENTRY( type		);
+   MENTRY( value	);
+#undef MENTRY
+   lua_setfield (L, -2, "__index");
+   lua_pop (L, 1);
+}
+
+/* Record every event of the input in the first argument slot on a new
+   tape, with the options table in the second. */
+int
+Ptape (lua_State *L)
+{
+   lyaml_tape *tape;
+
+   /* requires an input argument, and an optional options table */
+   if (!lua_isnoneornil (L, 2))
+      luaL_checktype (L, 2, LUA_TTABLE);
+   lua_settop (L, 2);
+
+   /* create a user datum to store the tape */
+   tape = (lyaml_tape *) lua_newuserdata (L, sizeof (*tape));
+   memset ((void *) tape, 0, sizeof (*tape));
+
+   if (lua_istable (L, 2))
+   {
+      lua_getfield (L, 2, "codes");
+      tape->codes = lua_toboolean (L, -1);
+      lua_pop (L, 1);
+   }
+
+   /* set its metatable */
+   luaL_getmetatable (L, TAPE_NAME);
+   lua_setmetatable  (L, -2);
+
+   /* try to initialize the parser */
+   if (yaml_parser_initialize (&tape->parser) == 0)
+      luaL_error (L, "cannot initialize parser");
+   tape->parsing = 1;
+
+   /* requires a string, file handle or reader function */
+   lyaml_input_set (L, 1, &tape->parser, &tape->input);
+
+   tape_parse (L, tape);
+
+   /* the parser is no longer needed */
+   tape_delete_parser (L, tape);
+   free (tape->open);
+   tape->open = NULL;
+   tape->opensize = 0;
+
+   return 1;
+}
@@ -44,23 +44,111 @@
 static const luaL_Reg R[] =
 {
 #define MENTRY(_s) {LYAML_STR_1(_s), (_s)}
+	MENTRY( Pcompile	),
+	MENTRY( Pdigest	),
+	MENTRY( Pdocuments	),
+	MENTRY( Pdump		),
 	MENTRY( Pemitter	),
+	MENTRY( Pload		),
+	MENTRY( Pload_compiled	),
+	MENTRY( Pload_file	),
+	MENTRY( Pload_steps	),
 	MENTRY( Pparser		),
+	MENTRY( Pparser_file	),
+	MENTRY( Ppush_parser	),
+	MENTRY( Presolve_implicit	),
+	MENTRY( Pscalar_style	),
+	MENTRY( Pselect		),
 	MENTRY( Pscanner	),
+	MENTRY( Ptape		),
 #undef MENTRY
 	{NULL, NULL}
 };
 
+/* Integer codes for event tables from `yaml.parser` with `codes = true`,
+   also accepted by `yaml.emitter`. */
+static const struct {
+   const char *name;
+   int	       value;
+} K[] =
+{
+#define MENTRY(_s, _v) {#_s, (_v)}
+	MENTRY( STREAM_START,	YAML_STREAM_START_EVENT		),
+	MENTRY( STREAM_END,	YAML_STREAM_END_EVENT		),
+	MENTRY( DOCUMENT_START,	YAML_DOCUMENT_START_EVENT	),
+	MENTRY( DOCUMENT_END,	YAML_DOCUMENT_END_EVENT		),
+	MENTRY( ALIAS,		YAML_ALIAS_EVENT		),
+	MENTRY( SCALAR,		YAML_SCALAR_EVENT		),
+	MENTRY( SEQUENCE_START,	YAML_SEQUENCE_START_EVENT	),
+	MENTRY( SEQUENCE_END,	YAML_SEQUENCE_END_EVENT		),
+	MENTRY( MAPPING_START,	YAML_MAPPING_START_EVENT	),
+	MENTRY( MAPPING_END,	YAML_MAPPING_END_EVENT		),
+
+	/* styles and encodings; ANY is 0 for all of them, and sequences
+	   and mappings share BLOCK and FLOW */
+	MENTRY( ANY,		YAML_ANY_SCALAR_STYLE		),
+	MENTRY( PLAIN,		YAML_PLAIN_SCALAR_STYLE		),
+	MENTRY( SINGLE_QUOTED,	YAML_SINGLE_QUOTED_SCALAR_STYLE	),
+	MENTRY( DOUBLE_QUOTED,	YAML_DOUBLE_QUOTED_SCALAR_STYLE	),
+	MENTRY( LITERAL,	YAML_LITERAL_SCALAR_STYLE	),
+	MENTRY( FOLDED,		YAML_FOLDED_SCALAR_STYLE	),
+	MENTRY( BLOCK,		YAML_BLOCK_SEQUENCE_STYLE	),
+	MENTRY( FLOW,		YAML_FLOW_SEQUENCE_STYLE	),
+	MENTRY( UTF8,		YAML_UTF8_ENCODING		),
+	MENTRY( UTF16LE,	YAML_UTF16LE_ENCODING		),
+	MENTRY( UTF16BE,	YAML_UTF16BE_ENCODING		),
+
+	/* token types from `yaml.scanner` with `codes = true`, which are
+	   numbered separately from event types */
+#define TENTRY(_s) {#_s "_TOKEN", YAML_##_s##_TOKEN}
+	TENTRY( STREAM_START		),
+	TENTRY( STREAM_END		),
+	TENTRY( VERSION_DIRECTIVE	),
+	TENTRY( TAG_DIRECTIVE		),
+	TENTRY( DOCUMENT_START		),
+	TENTRY( DOCUMENT_END		),
+	TENTRY( BLOCK_SEQUENCE_START	),
+	TENTRY( BLOCK_MAPPING_START	),
+	TENTRY( BLOCK_END		),
+	TENTRY( FLOW_SEQUENCE_START	),
+	TENTRY( FLOW_SEQUENCE_END	),
+	TENTRY( FLOW_MAPPING_START	),
+	TENTRY( FLOW_MAPPING_END	),
+	TENTRY( BLOCK_ENTRY		),
+	TENTRY( FLOW_ENTRY		),
+	TENTRY( KEY			),
+	TENTRY( VALUE			),
+	TENTRY( ALIAS			),
+	TENTRY( ANCHOR			),
+	TENTRY( TAG			),
+	TENTRY( SCALAR			),
+#undef TENTRY
+#undef MENTRY
+	{NULL, 0}
+};
+
 LUALIB_API int
 luaopen_yaml (lua_State *L)
 {
+   int i;
+
+   dumper_init (L);
+   loader_init (L);
    parser_init (L);
+   push_init (L);
    scanner_init (L);
+   tape_init (L);
 
    luaL_register(L, "yaml", R);
 
    lua_pushliteral(L, MYVERSION);
    lua_setfield(L, -2, "version");
 
+   for (i = 0; K[i].name != NULL; i++)
+   {
+      lua_pushinteger(L, K[i].value);
+      lua_setfield(L, -2, K[i].name);
+   }
+
    return 1;
 }
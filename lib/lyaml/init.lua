@@ -30,27 +30,115 @@
 
 local explicit = require 'lyaml.explicit'
 local functional = require 'lyaml.functional'
-local implicit = require 'lyaml.implicit'
 local yaml = require 'yaml'
 
 local NULL = functional.NULL
-local anyof = functional.anyof
+local byte = string.byte
 local find = string.find
 local format = string.format
 local gsub = string.gsub
-local id = functional.id
 local isnull = functional.isnull
 local match = string.match
+local rawlen = rawlen or function(t) return #t end
 
 
 local TAG_PREFIX = 'tag:yaml.org,2002:'
 
+-- Number of events queued by a Dumper before passing them to the
+-- LibYAML emitter in one call.
+local EMIT_BATCH = 256
+
 
 local function tag(name)
    return TAG_PREFIX .. name
 end
 
 
+-- Order of the types of mapping keys with the sort_keys option, as in
+-- the C dumper; keys of other types sort last, in `pairs` order.
+local KEY_RANK = {boolean=1, number=2, string=3}
+
+
+-- Default sort_keys order: booleans, then numbers, then strings compared
+-- byte by byte whatever the locale.
+local function keyorder(a, b)
+   local ra, rb = KEY_RANK[type(a)] or 4, KEY_RANK[type(b)] or 4
+   if ra ~= rb then
+      return ra < rb
+   elseif ra == 1 then
+      return not a and b
+   elseif ra == 2 then
+      return a < b
+   elseif ra == 3 then
+      for i = 1, math.min(#a, #b) do
+         local x, y = byte(a, i), byte(b, i)
+         if x ~= y then
+            return x < y
+         end
+      end
+      return #a < #b
+   end
+   return false
+end
+
+
+-- Dumped table shapes, and the metatables that `seq` and `map` give to
+-- tables without one.
+local SHAPE_MT = {
+   flow_map = {__yaml = 'flow_map'},
+   flow_seq = {__yaml = 'flow_seq'},
+   map = {__yaml = 'map'},
+   seq = {__yaml = 'seq'},
+}
+
+
+-- Return the shape of table T and its border, as the C dumper does: from
+-- a __yaml metatable field, or else 'seq' if its keys are distinct whole
+-- numbers from 1 up to the border, and there are as many of them as that.
+local function shapeof(t)
+   local mt, n = getmetatable(t), rawlen(t)
+   local shape = type(mt) == 'table' and rawget(mt, '__yaml') or nil
+   if shape ~= nil then
+      if SHAPE_MT[shape] == nil then
+         error("__yaml must be 'seq', 'map', 'flow_seq' or 'flow_map'", 3)
+      end
+      return shape, n
+   end
+
+   local count = 0
+   for k in next, t do
+      if type(k) ~= 'number' or k < 1 or k > n or k ~= math.floor(k) then
+         return 'map', n
+      end
+      count = count + 1
+   end
+   return count == n and 'seq' or 'map', n
+end
+
+
+-- Format number VALUE with the same digits on every Lua version, as the
+-- C dumper does with the canonical option.
+local function canonical_number(value)
+   local s
+   if math.type and math.type(value) == 'integer' then
+      return tostring(value)
+   elseif value == math.floor(value) and math.abs(value) < 2^53 then
+      s = format('%.0f', value)
+   else
+      s = format('%.17g', value)
+      for prec = 15, 16 do
+         local t = format('%.' .. prec .. 'g', value)
+         if tonumber(t) == value then
+            s = t
+            break
+         end
+      end
+   end
+   -- whatever the decimal point of the current locale
+   return (gsub(s, '[^%d%-+e]', '.'))
+end
+
+
 local default = {
    -- Tag table to lookup explicit scalar conversions.
    explicit_scalar = {
@@ -60,31 +148,49 @@ local default = {
       [tag 'null'] = explicit.null,
       [tag 'str'] = explicit.str,
    },
-   -- Order is important, so we put most likely and fastest nearer
-   -- the top to reduce average number of comparisons and funcalls.
-   implicit_scalar = anyof {
-      implicit.null,
-      implicit.octal,	-- subset of decimal, must come earlier
-      implicit.decimal,
-      implicit.float,
-      implicit.bool,
-      implicit.inf,
-      implicit.nan,
-      implicit.hexadecimal,
-      implicit.binary,
-      implicit.sexagesimal,
-      implicit.sexfloat,
-      id,
-   },
+   -- Same results as anyof {implicit.null, implicit.octal,
+   -- implicit.decimal, implicit.float, implicit.bool, implicit.inf,
+   -- implicit.nan, implicit.hexadecimal, implicit.binary,
+   -- implicit.sexagesimal, implicit.sexfloat, id}, but classifies each
+   -- scalar in a single scan in C.
+   implicit_scalar = yaml.resolve_implicit,
 }
 
 
+-- Count the references to each table reachable from VALUE in COUNTS,
+-- descending into each table only once.
+local function countrefs(value, counts)
+   if type(value) == 'table' and not isnull(value) then
+      local n = (counts[value] or 0) + 1
+      counts[value] = n
+      if n == 1 then
+         for k, v in pairs(value) do
+            countrefs(k, counts)
+            countrefs(v, counts)
+         end
+      end
+   end
+   return counts
+end
+
+
 -- Metatable for Dumper objects.
 local dumper_mt = {
    __index = {
-      -- Emit EVENT to the LibYAML emitter.
+      -- Queue EVENT for the LibYAML emitter.
       emit = function(self, event)
-         return self.emitter.emit(event)
+         if self.n == EMIT_BATCH then
+            self:flush()
+         end
+         local n = self.n + 1
+         self.events[n], self.n = event, n
+      end,
+
+      -- Pass the queued events to the LibYAML emitter in one call.
+      flush = function(self)
+         local ok, result = self.emitter.emit_batch(self.events, 1, self.n)
+         self.n = 0
+         return ok, result
       end,
 
       -- Look up an anchor for a repeated document element.
@@ -92,68 +198,100 @@ local dumper_mt = {
          local r = self.anchors[value]
          if r then
             self.aliased[value], self.anchors[value] = self.anchors[value], nil
+         elseif self.counts and (self.counts[value] or 0) > 1 then
+            -- generate a name not given in opts.anchors
+            repeat
+               self.autoid = self.autoid + 1
+               r = format('id%03d', self.autoid)
+            until self.names[r] == nil
+            self.generated[value] = r
          end
          return r
       end,
 
       -- Look up an already anchored repeated document element.
       get_alias = function(self, value)
-         return self.aliased[value]
+         return self.aliased[value] or self.generated[value]
       end,
 
       -- Dump ALIAS into the event stream.
       dump_alias = function(self, alias)
          return self:emit {
-            type = 'ALIAS',
+            type = yaml.ALIAS,
             anchor = alias,
          }
       end,
 
-      -- Dump MAP into the event stream.
-      dump_mapping = function(self, map)
+      -- Dump MAP into the event stream, in STYLE.
+      dump_mapping = function(self, map, style)
          local alias = self:get_alias(map)
          if alias then
             return self:dump_alias(alias)
          end
 
          self:emit {
-            type = 'MAPPING_START',
+            type = yaml.MAPPING_START,
             anchor = self:get_anchor(map),
-            style = 'BLOCK',
+            style = style,
          }
-         for k, v in pairs(map) do
-            self:dump_node(k)
-            self:dump_node(v)
+         if self.sort_keys then
+            local keys, pos, less = {}, {}, self.sort_keys
+            for k in pairs(map) do
+               keys[#keys + 1] = k
+               pos[k] = #keys
+            end
+            -- break ties by position, to match the stable C sort
+            table.sort(keys, function(a, b)
+               if less(a, b) then
+                  return true
+               end
+               return not less(b, a) and pos[a] < pos[b]
+            end)
+            for _, k in ipairs(keys) do
+               self:dump_node(k)
+               self:dump_node(rawget(map, k))
+            end
+         else
+            for k, v in pairs(map) do
+               self:dump_node(k)
+               self:dump_node(v)
+            end
          end
-         return self:emit {type='MAPPING_END'}
+         return self:emit {type=yaml.MAPPING_END}
       end,
 
-      -- Dump SEQUENCE into the event stream.
-      dump_sequence = function(self, sequence)
+      -- Dump elements 1 to N of SEQUENCE into the event stream, in
+      -- STYLE, with nulls for any holes left by a __yaml shape.
+      dump_sequence = function(self, sequence, n, style)
          local alias = self:get_alias(sequence)
          if alias then
             return self:dump_alias(alias)
          end
 
          self:emit {
-            type   = 'SEQUENCE_START',
+            type   = yaml.SEQUENCE_START,
             anchor = self:get_anchor(sequence),
-            style  = 'BLOCK',
+            style  = style,
          }
-         for _, v in ipairs(sequence) do
-            self:dump_node(v)
+         for i = 1, n do
+            local v = rawget(sequence, i)
+            if v == nil then
+               self:dump_null()
+            else
+               self:dump_node(v)
+            end
          end
-         return self:emit {type='SEQUENCE_END'}
+         return self:emit {type=yaml.SEQUENCE_END}
       end,
 
       -- Dump a null into the event stream.
       dump_null = function(self)
          return self:emit {
-            type = 'SCALAR',
+            type = yaml.SCALAR,
             value = '~',
             plain_implicit = true,
             quoted_implicit = true,
-            style = 'PLAIN',
+            style = yaml.PLAIN,
          }
       end,
 
@@ -166,23 +304,29 @@ local dumper_mt = {
 
          local anchor = self:get_anchor(value)
          local itsa = type(value)
-         local style = 'PLAIN'
-         if itsa == 'string' and self.implicit_scalar(value) ~= value then
+         local style = yaml.PLAIN
+         if itsa == 'string' and self.implicit_scalar == yaml.resolve_implicit
+         then
+            -- one pass in C for the default schema
+            style = yaml.scalar_style(value)
+         elseif itsa == 'string' and self.implicit_scalar(value) ~= value then
             -- take care to round-trip strings that look like scalars
-            style = 'SINGLE_QUOTED'
+            style = yaml.SINGLE_QUOTED
          elseif value == math.huge then
             value = '.inf'
          elseif value == -math.huge then
             value = '-.inf'
          elseif value ~= value then
             value = '.nan'
+         elseif itsa == 'number' and self.canonical then
+            value = canonical_number(value)
          elseif itsa == 'number' or itsa == 'boolean' then
             value = tostring(value)
          elseif itsa == 'string' and find(value, '\n') then
-            style = 'LITERAL'
+            style = yaml.LITERAL
          end
          return self:emit {
-            type = 'SCALAR',
+            type = yaml.SCALAR,
             anchor = anchor,
             value = value,
             plain_implicit = true,
@@ -199,26 +343,15 @@ local dumper_mt = {
          elseif itsa == 'string' or itsa == 'boolean' or itsa == 'number' then
             return self:dump_scalar(node)
          elseif itsa == 'table' then
-            -- Something is only a sequence if its keys start at 1
-            -- and are consecutive integers without any jumps.
-            local prior_key = 0
-            local is_pure_sequence = true
-            local i, v = next(node, nil)
-            while i and is_pure_sequence do
-              if type(i) ~= "number" or (prior_key + 1 ~= i) then
-                is_pure_sequence = false -- breaks the loop
-              else
-                prior_key = i
-                i, v = next(node, prior_key)
-              end
-            end
-            if is_pure_sequence then
-               -- Only sequentially numbered integer keys starting from 1.
-               return self:dump_sequence(node)
-            else
-               -- Table contains non sequential integer keys or mixed keys.
-               return self:dump_mapping(node)
+            local shape, n = shapeof(node)
+            if shape == 'seq' then
+               return self:dump_sequence(node, n, yaml.BLOCK)
+            elseif shape == 'flow_seq' then
+               return self:dump_sequence(node, n, yaml.FLOW)
+            elseif shape == 'flow_map' then
+               return self:dump_mapping(node, yaml.FLOW)
             end
+            return self:dump_mapping(node, yaml.BLOCK)
          else -- unsupported Lua type
             error("cannot dump object of type '" .. itsa .. "'", 2)
          end
@@ -226,9 +359,15 @@ local dumper_mt = {
 
       -- Dump DOCUMENT into the event stream.
       dump_document = function(self, document)
-         self:emit {type='DOCUMENT_START'}
+         if self.auto_anchors then
+            -- generated anchors only last until the end of the document
+            self.counts, self.generated, self.autoid =
+               countrefs(document, {}), {}, 0
+         end
+         self:emit {type=yaml.DOCUMENT_START}
          self:dump_node(document)
-         return self:emit {type='DOCUMENT_END'}
+         self:emit {type=yaml.DOCUMENT_END}
+         return self:flush()
       end,
    },
 }
@@ -243,9 +382,23 @@ local function Dumper(opts)
    local object = {
       aliased = {},
       anchors = anchors,
-      emitter = yaml.emitter(),
+      auto_anchors = opts.auto_anchors,
+      canonical = opts.canonical,
+      generated = {},
+      names = opts.anchors,
+      emitter = yaml.emitter {
+         sink = opts.sink,
+         flush_bytes = opts.flush_bytes,
+      },
+      events = {},
       implicit_scalar = opts.implicit_scalar,
+      n = 0,
    }
+   if type(opts.sort_keys) == 'function' then
+      object.sort_keys = opts.sort_keys
+   elseif opts.sort_keys or opts.canonical then
+      object.sort_keys = keyorder
+   end
    return setmetatable(object, dumper_mt)
 end
 
@@ -253,32 +406,135 @@ end
 --- Dump options table.
 -- @table dumper_opts
 -- @tfield table anchors map initial anchor names to values
+-- @tfield[opt=false] boolean auto_anchors give a generated anchor, such
+--    as `id001`, to each table referred to more than once in a document,
+--    and dump later references as aliases; so shared and recursive
+--    tables can be dumped
+-- @tfield[opt=false] boolean|function sort_keys dump the keys of each
+--    mapping in order: booleans, then numbers, then strings byte by byte;
+--    or in the order of this function, called with two keys and
+--    returning true if the first goes before the second
+-- @tfield[opt=false] boolean canonical sort keys, and write numbers with
+--    the same digits on every Lua version, so that equal documents always
+--    dump to the same bytes
 -- @tfield function implicit_scalar parse implicit scalar values
+-- @tfield[opt=true] boolean native write the stream with the C dumper
+--    from `yaml.dump`, rather than from `yaml.emitter` events in Lua
+-- @tfield[opt] function|file sink pass the stream to this function, or
+--    write it to this open file handle, a chunk at a time, rather than
+--    returning it as a string
+-- @tfield[opt=0] int flush_bytes with *sink*, gather output into chunks of
+--    at least this many bytes before passing them on
+-- @tfield[opt] table stats with the C dumper, fill this table with
+--    counters and timings for the call, as for `loader_opts`
+
+
+-- Write a YAML stream from events passed to `yaml.emitter`.
+local function dumpevents(documents, opts)
+   local dumper = Dumper {
+      anchors = opts.anchors or {},
+      auto_anchors = opts.auto_anchors,
+      canonical = opts.canonical,
+      implicit_scalar = opts.implicit_scalar or default.implicit_scalar,
+      sink = opts.sink,
+      flush_bytes = opts.flush_bytes,
+      sort_keys = opts.sort_keys,
+   }
+
+   dumper:emit {type=yaml.STREAM_START, encoding=yaml.UTF8}
+   for _, document in ipairs(documents) do
+      dumper:dump_document(document)
+   end
+   dumper:emit {type=yaml.STREAM_END}
+   local ok, stream = dumper:flush()
+   return stream
+end
+
+
+-- Types of the values of each `dumper_opts` field.
+local DUMP_OPTION_TYPES = {
+   anchors = {table=true},
+   auto_anchors = {boolean=true},
+   canonical = {boolean=true},
+   flush_bytes = {number=true},
+   implicit_scalar = {['function']=true},
+   native = {boolean=true},
+   sink = {['function']=true, userdata=true},
+   sort_keys = {boolean=true, ['function']=true},
+   stats = {table=true},
+}
+
+
+-- Whether OPTS is a `dumper_opts` table rather than the anchors table
+-- that `dump` used to take in its place: it is if any option is set to
+-- a value of a type that option takes.  So an anchor named like an
+-- option is only mistaken for one when the anchored value has such a
+-- type too, as a table anchored as `anchors` or `stats` does.
+local function isdumpopts(opts)
+   for k, v in pairs(opts) do
+      local types = DUMP_OPTION_TYPES[k]
+      if types and types[type(v)] then
+         return true
+      end
+   end
+   return false
+end
 
 
 --- Dump a list of Lua tables to an equivalent YAML stream.
 -- @tparam table documents a sequence of Lua tables.
 -- @tparam[opt] dumper_opts opts initialisation options
--- @treturn string equivalest YAML stream
+-- @treturn string equivalest YAML stream, or nothing if *opts.sink* was
+--    given
 local function dump(documents, opts)
    opts = opts or {}
 
    -- backwards compatibility
-   if opts.anchors == nil and opts.implicit_scalar == nil then
+   if not isdumpopts(opts) then
       opts = {anchors=opts}
    end
 
-   local dumper = Dumper {
-      anchors = opts.anchors or {},
-      implicit_scalar = opts.implicit_scalar or default.implicit_scalar,
-   }
+   if opts.native == false then
+      return dumpevents(documents, opts)
+   end
+   return yaml.dump(documents, opts)
+end
 
-   dumper:emit {type='STREAM_START', encoding='UTF8'}
-   for _, document in ipairs(documents) do
-      dumper:dump_document(document)
+
+-- Give table T, or a new empty table, the metatable for SHAPE, or its
+-- flow style variant if FLOW is set.
+local function shaped(t, shape, flow)
+   t = t or {}
+   local mt = getmetatable(t)
+   if flow then
+      shape = 'flow_' .. shape
    end
-   local ok, stream = dumper:emit {type='STREAM_END'}
-   return stream
+   if mt ~= nil and mt ~= SHAPE_MT[rawget(mt, '__yaml') or false] then
+      error('table already has a metatable; set its __yaml field instead', 3)
+   end
+   return setmetatable(t, SHAPE_MT[shape])
+end
+
+
+--- Mark a table to be dumped as a sequence of its elements from 1 up
+-- to its border, even if it is empty or has other keys.
+-- @tparam[opt={}] table t a table without a metatable
+-- @tparam[opt=false] boolean flow dump it in flow style, as `[1, 2]`
+-- @treturn table *t*
+-- @usage lyaml.dump {{list = lyaml.seq {}}} --> "---\nlist: []\n...\n"
+local function seq(t, flow)
+   return shaped(t, 'seq', flow)
+end
+
+
+--- Mark a table to be dumped as a mapping, even if it is empty or its
+-- keys are all integers from 1 up.
+-- @tparam[opt={}] table t a table without a metatable
+-- @tparam[opt=false] boolean flow dump it in flow style, as `{a: 1}`
+-- @treturn table *t*
+-- @usage lyaml.dump {{map = lyaml.map {}}} --> "---\nmap: {}\n...\n"
+local function map(t, flow)
+   return shaped(t, 'map', flow)
 end
 
 
@@ -307,13 +563,43 @@ local parser_mt = {
                       self.mark.column, ...), 0)
       end,
 
-      -- Save node in the anchor table for reference in future ALIASes.
+      -- Save node in the anchor table for reference in future ALIASes,
+      -- and return its entry.
       add_anchor = function(self, node)
          if self.event.anchor ~= nil then
-            self.anchors[self.event.anchor] = {
+            local anchor = {
                type = alias_type[self.event.type],
                value = node,
+               size = 1,
             }
+            self.anchors[self.event.anchor] = anchor
+            return anchor
+         end
+      end,
+
+      -- Raise an error if the current event takes the stream past one
+      -- of the limits in the options.
+      check_limits = function(self, event)
+         local itsa = event.type
+         if itsa == 'SCALAR' then
+            if self.max_scalar_bytes and #event.value > self.max_scalar_bytes
+            then
+               self:error 'scalar exceeds max_scalar_bytes'
+            end
+         elseif itsa == 'SEQUENCE_START' or itsa == 'MAPPING_START' then
+            self.level = self.level + 1
+            if self.max_depth and self.level > self.max_depth then
+               self:error 'nesting exceeds max_depth'
+            end
+         else
+            if itsa == 'SEQUENCE_END' or itsa == 'MAPPING_END' then
+               self.level = self.level - 1
+            end
+            return
+         end
+         self.nodes = self.nodes + 1
+         if self.max_nodes and self.nodes > self.max_nodes then
+            self:error 'node count exceeds max_nodes'
          end
       end,
 
@@ -329,13 +615,16 @@ local parser_mt = {
             line = self.event.start_mark.line + 1,
             column = self.event.start_mark.column + 1,
          }
+         if self.limited then
+            self:check_limits(event)
+         end
          return self:type()
       end,
 
       -- Construct a Lua hash table from following events.
       load_map = function(self)
          local map = {}
-         self:add_anchor(map)
+         local anchor, size = self:add_anchor(map), self.size
          while true do
             local key = self:load_node()
             local tag = self.event.tag
@@ -382,13 +671,16 @@ local parser_mt = {
                map[key] = value
             end
          end
+         if anchor then
+            anchor.size = self.size - size + 1
+         end
          return map, self:type()
       end,
 
       -- Construct a Lua array table from following events.
       load_sequence = function(self)
          local sequence = {}
-         self:add_anchor(sequence)
+         local anchor, size = self:add_anchor(sequence), self.size
          while true do
             local node = self:load_node()
             if node == nil then
@@ -396,6 +688,9 @@ local parser_mt = {
             end
             sequence[#sequence + 1] = node
          end
+         if anchor then
+            anchor.size = self.size - size + 1
+         end
          return sequence, self:type()
       end,
 
@@ -426,6 +721,14 @@ local parser_mt = {
          if event == nil then
             self:error('invalid reference: %s', tostring(anchor))
          end
+         if self.max_alias_expansions then
+            -- charge for every node the alias repeats
+            self.expansions = self.expansions + event.size
+            if self.expansions > self.max_alias_expansions then
+               self:error 'alias expansion exceeds max_alias_expansions'
+            end
+            self.size = self.size + event.size
+         end
          return event.value, event.type
       end,
 
@@ -444,21 +747,52 @@ local parser_mt = {
          if dispatch[event] == nil then
             self:error('invalid event: %s', self:type())
          end
+         if self.max_alias_expansions and
+            (event == 'SCALAR' or event == 'MAPPING_START' or
+             event == 'SEQUENCE_START')
+         then
+            self.size = self.size + 1
+         end
        return dispatch[event](self)
       end,
    },
 }
 
 
+-- Return the limit option NAME from OPTS, or nil if it isn't set.
+local function checklimit(opts, name)
+   local n = opts[name]
+   if n ~= nil then
+      if tonumber(n) == nil or tonumber(n) ~= tonumber(n) then
+         error(name .. ' must be a number', 3)
+      elseif tonumber(n) < 0 then
+         error(name .. ' must not be negative', 3)
+      end
+      return tonumber(n)
+   end
+end
+
+
 -- Parser object constructor.
 local function Parser(s, opts)
    local object = {
       anchors = {},
+      expansions = 0,
       explicit_scalar = opts.explicit_scalar,
       implicit_scalar = opts.implicit_scalar,
+      level = 0,
       mark = {line=0, column=0},
-      next = yaml.parser(s),
+      max_alias_expansions = checklimit(opts, 'max_alias_expansions'),
+      max_depth = checklimit(opts, 'max_depth'),
+      max_nodes = checklimit(opts, 'max_nodes'),
+      max_scalar_bytes = checklimit(opts, 'max_scalar_bytes'),
+      next = opts.next or
+         yaml.parser(s, {max_input_bytes = opts.max_input_bytes}),
+      nodes = 0,
+      size = 0,
    }
+   object.limited = object.max_depth or object.max_nodes or
+      object.max_scalar_bytes
    return setmetatable(object, parser_mt)
 end
 
@@ -468,32 +802,78 @@ end
 -- @tfield boolean all load all documents from the stream
 -- @tfield table explicit_scalar map full tag-names to parser functions
 -- @tfield function implicit_scalar parse implicit scalar values
-
-
---- Load a YAML stream into a Lua table.
--- @tparam string s YAML stream
--- @tparam[opt] loader_opts opts initialisation options
--- @treturn table Lua table equivalent of stream *s*
-local function load(s, opts)
-   opts = opts or {}
-   local documents = {}
-   local all = false
-
-   -- backwards compatibility
-   if opts == true then
-      opts = {all=true}
-   end
-
+-- @tfield[opt=true] boolean native build tables with the C loader from
+--    `yaml.load`, rather than from `yaml.parser` events in Lua
+-- @tfield[opt=0] int scalar_cache reuse the values resolved for up to
+--    this many distinct scalars, instead of resolving each repeat again;
+--    the C loader then also returns a table of cache `hits`, `misses`,
+--    `count` and `size` after the result
+-- @tfield[opt=false] boolean lazy with a string stream, return empty
+--    proxy tables in place of the collections nested in each document,
+--    which load their contents from the stream the first time they are
+--    indexed, iterated or measured (`pairs` and `#` need Lua 5.2 or newer;
+--    `next` and `rawget` don't load proxies)
+-- @tfield string cache_dir `lyaml.load_file` keeps the compiled form of
+--    each file it loads in this directory, named after a hash of the file
+--    contents, and loads that instead of parsing the file again while the
+--    contents are unchanged, and for the same Lua version; ignored with
+--    custom scalar functions or any `max_` limit
+-- @tfield[opt] int max_depth raise an error if collections nest deeper
+--    than this
+-- @tfield[opt] int max_nodes raise an error after more than this many
+--    scalars and collections in the whole stream
+-- @tfield[opt] int max_alias_expansions raise an error if the aliases in
+--    the stream repeat more than this many nodes between them, so that
+--    walking the result is bounded too; `0` allows no aliases
+-- @tfield[opt] int max_scalar_bytes raise an error at any scalar longer
+--    than this
+-- @tfield[opt] int max_input_bytes raise an error after reading more
+--    than this many bytes of the stream, or straight away for a longer
+--    string
+-- @tfield[opt=1] int threads with the C loader and a string or file
+--    stream of many documents, parse large streams with this many
+--    threads at once, splitting them where a line starts with `---`;
+--    the result, and any error, are the same as with one thread
+-- @tfield[opt] int yield_every with the C loader, `lyaml.load` calls
+--    `coroutine.yield` after every this many events when it is called
+--    from a coroutine, so that a large load can share a cooperative
+--    scheduler; not with *stats*
+-- @tfield[opt] number deadline with the C loader, raise an error once
+--    loading has taken more than this many seconds, counting any time
+--    spent yielding
+-- @tfield[opt] table stats with the C loader, fill this table with
+--    counters and timings for the call, even if it fails: `bytes` parsed,
+--    `events` of each type, `documents`, `nodes`, `anchors` and `aliases`;
+--    total `seconds`, split into `libyaml_seconds` spent in the parser,
+--    `resolve_seconds` spent resolving scalars and `build_seconds` spent
+--    building tables; and `allocs`, `alloc_bytes` and `free_bytes`
+--    counted by the Lua allocator
+
+
+-- Return an iterator over the documents of stream *s*, building tables
+-- in Lua from the events returned by `yaml.parser`.
+local function eachevents(s, opts)
    local parser = Parser(s, {
       explicit_scalar = opts.explicit_scalar or default.explicit_scalar,
       implicit_scalar = opts.implicit_scalar or default.implicit_scalar,
+      max_alias_expansions = opts.max_alias_expansions,
+      max_depth = opts.max_depth,
+      max_input_bytes = opts.max_input_bytes,
+      max_nodes = opts.max_nodes,
+      max_scalar_bytes = opts.max_scalar_bytes,
    })
 
    if parser:parse() ~= 'STREAM_START' then
       error('expecting STREAM_START event, but got ' .. parser:type(), 2)
    end
 
-   while parser:parse() ~= 'STREAM_END' do
+   local finished = false
+   return function()
+      if finished or parser:parse() == 'STREAM_END' then
+         finished = true
+         return nil
+      end
+
       local document = parser:load_node()
       if document == nil then
          error('unexpected ' .. parser:type() .. ' event')
@@ -503,17 +883,372 @@ local function load(s, opts)
          error('expecting DOCUMENT_END event, but got ' .. parser:type(), 2)
       end
 
-      -- save document
-      documents[#documents + 1] = document
-
       -- reset anchor table
       parser.anchors = {}
+
+      return document
    end
+end
 
+
+-- Build tables in Lua from the events returned by `yaml.parser`.
+local function loadevents(s, opts)
+   local documents = {}
+   for document in eachevents(s, opts) do
+      documents[#documents + 1] = document
+   end
    return opts.all and documents or documents[1]
 end
 
 
+--- Iterate over the documents in a YAML stream.
+-- Each document is returned as soon as it has been loaded, and nothing
+-- refers to it afterwards, so memory use does not grow with the number
+-- of documents in the stream.
+-- @tparam string|file|function s YAML stream, an open file handle to
+--    read it from, or a reader function returning successive chunks of it
+--    and `nil` at the end
+-- @tparam[opt] loader_opts opts initialisation options, except *all*
+-- @treturn function iterator returning the Lua table equivalent of each
+--    document in turn
+-- @usage for doc in lyaml.documents(io.open 'log.yaml') do print(doc.id) end
+local function documents(s, opts)
+   opts = opts or {}
+
+   if opts.native == false then
+      return eachevents(s, opts)
+   end
+   return yaml.documents(s, opts)
+end
+
+
+-- Load with `yaml.load_steps`, yielding between steps when called from a
+-- coroutine.
+local function loadsteps(s, opts)
+   local step = yaml.load_steps(s, opts)
+   local co, main = coroutine.running()
+   local yield = co and not main and coroutine.yield or function() end
+
+   local function resume(done, ...)
+      if done then
+         return ...
+      end
+      yield()
+      return resume(step())
+   end
+   return resume(step())
+end
+
+
+--- Load a YAML stream into a Lua table.
+-- @tparam string|file|function s YAML stream, an open file handle to
+--    read it from, or a reader function returning successive chunks of it
+--    and `nil` at the end
+-- @tparam[opt] loader_opts opts initialisation options
+-- @treturn table Lua table equivalent of stream *s*
+-- @treturn[opt] table scalar cache statistics, with *opts.scalar_cache*
+-- @usage docs, stats = lyaml.load(s, {all=true, scalar_cache=1024})
+local function load(s, opts)
+   opts = opts or {}
+
+   -- backwards compatibility
+   if opts == true then
+      opts = {all=true}
+   end
+
+   if opts.native == false then
+      return loadevents(s, opts)
+   elseif opts.yield_every ~= nil then
+      return loadsteps(s, opts)
+   end
+
+   -- Without custom scalar functions, the C loader falls back to its own
+   -- copy of the default schema.
+   return yaml.load(s, opts)
+end
+
+
+--- Compile a YAML stream into a compact binary string.
+-- Every document in the stream is loaded and written out with a string
+-- table and pre-resolved scalars, from which `lyaml.load_compiled`
+-- rebuilds the same tables without parsing any YAML.  Tables shared
+-- through aliases are still shared when they are rebuilt.
+-- @tparam string|file|function s YAML stream, an open file handle to
+--    read it from, or a reader function returning successive chunks of it
+--    and `nil` at the end
+-- @tparam[opt] loader_opts opts initialisation options, except *all*
+-- @treturn string compiled form of stream *s*
+-- @usage blob = lyaml.compile(io.open 'config.yaml')
+local function compile(s, opts)
+   local loadopts = {}
+   for k, v in pairs(opts or {}) do
+      loadopts[k] = v
+   end
+   loadopts.all, loadopts.lazy = true, false
+
+   return yaml.compile((load(s, loadopts)))
+end
+
+
+--- Load a stream compiled by `lyaml.compile` into a Lua table.
+-- @string blob compiled YAML stream
+-- @tparam[opt] table opts *all* to return every document in the stream
+-- @treturn table Lua table equivalent of the compiled stream
+-- @usage config = lyaml.load_compiled(blob)
+local function load_compiled(blob, opts)
+   opts = opts or {}
+
+   if opts == true then
+      opts = {all=true}
+   end
+
+   local documents = yaml.load_compiled(blob)
+   return opts.all and documents or documents[1]
+end
+
+
+-- Return the contents of *path*, or nil and an error message.
+local function readfile(path)
+   local h, errmsg = io.open(path, 'rb')
+   if h == nil then
+      return nil, errmsg
+   end
+   local s = h:read '*a'
+   h:close()
+   return s
+end
+
+
+-- Version tags in compiled cache file names: the lyaml release from the
+-- end of `yaml.version`, such as `6.2.8`, and the Lua version, such as
+-- `Lua53i`.  Both are cut down to characters safe in a file name.
+local CACHE_LYAML = gsub(match(yaml.version, '[^/]*$'), '[^%w.]', '')
+local CACHE_LUA = gsub(_VERSION, '%W', '') .. (math.type and 'i' or 'f')
+
+
+-- Options that act while parsing, such as custom scalar functions,
+-- limits on what a load accepts and statistics about it, and so can't be
+-- applied to a cached compiled form.
+local LOAD_UNCACHED = {
+   'explicit_scalar', 'implicit_scalar', 'max_depth', 'max_nodes',
+   'max_alias_expansions', 'max_scalar_bytes', 'max_input_bytes', 'stats',
+   'scalar_cache',
+}
+
+
+-- Load *path* from its compiled form in *opts.cache_dir*, compiling the
+-- contents and saving them there first if they haven't been seen before.
+local function load_cached(path, opts)
+   local s, errmsg = readfile(path)
+   if s == nil then
+      error('cannot open ' .. errmsg, 3)
+   end
+
+   -- the lyaml version is part of the name, as resolving may change with
+   -- it, and so is the Lua version, as whole floats are compiled as
+   -- integers where Lua has no integer subtype
+   local cachefile = format('%s/%s-%x-%s-%s.lyc', opts.cache_dir,
+                            yaml.digest(s), #s, CACHE_LYAML, CACHE_LUA)
+   local blob = readfile(cachefile)
+   if blob ~= nil then
+      local ok, documents = pcall(yaml.load_compiled, blob)
+      if ok then
+         return opts.all and documents or documents[1]
+      end
+   end
+
+   local loadopts = {}
+   for k, v in pairs(opts) do
+      loadopts[k] = v
+   end
+   loadopts.all, loadopts.lazy = true, false
+   local documents = load(s, loadopts)
+
+   -- The cache is only an optimisation, so documents that fail to
+   -- compile are returned uncached, and failing to write it is not an
+   -- error; writing aside and renaming means no reader sees a partial file.
+   local ok
+   ok, blob = pcall(yaml.compile, documents)
+   if not ok then
+      return opts.all and documents or documents[1]
+   end
+   local h = io.open(cachefile .. '.tmp', 'wb')
+   if h ~= nil then
+      local ok = h:write(blob)
+      h:close()
+      if not ok or not os.rename(cachefile .. '.tmp', cachefile) then
+         os.remove(cachefile .. '.tmp')
+      end
+   end
+
+   return load_compiled(blob, opts)
+end
+
+
+--- Load a YAML file into a Lua table.
+-- A regular file is mapped into memory and parsed in place rather than
+-- being read into a Lua string first; pipes and other files that can't
+-- be mapped are read in chunks instead.
+-- With *opts.cache_dir*, the compiled form of the file is kept in that
+-- directory, and reused for as long as the file contents are unchanged;
+-- options that act while parsing, such as limits, *stats* and
+-- *scalar_cache*, load the file afresh instead.
+-- @string path name of the file to load
+-- @tparam[opt] loader_opts opts initialisation options
+-- @treturn table Lua table equivalent of the YAML stream in *path*
+-- @usage config = lyaml.load_file('/etc/app/config.yaml', {cache_dir='/var/cache/app'})
+local function load_file(path, opts)
+   opts = opts or {}
+
+   if opts == true then
+      opts = {all=true}
+   end
+
+   local cached = opts.cache_dir ~= nil
+   for _, k in ipairs(LOAD_UNCACHED) do
+      cached = cached and opts[k] == nil
+   end
+   if cached then
+      return load_cached(path, opts)
+   end
+
+   if opts.native == false then
+      local h, errmsg = io.open(path, 'rb')
+      if h == nil then
+         error('cannot open ' .. errmsg, 2)
+      end
+      local ok, result = pcall(loadevents, h, opts)
+      h:close()
+      if not ok then
+         error(result, 0)
+      end
+      return result
+   end
+
+   return yaml.load_file(path, opts)
+end
+
+
+--- Select values from a YAML stream by path, without loading the rest.
+-- *path* is a sequence of mapping keys separated by dots, and 1-based
+-- sequence indices in brackets, such as `services.api.replicas` or
+-- `items[3].id`; keys containing dots or brackets can be quoted, as in
+-- `["a.b"]`.  A `*` key matches every value in a mapping, and `[*]`
+-- every element of a sequence.  Nodes off the path are skipped over
+-- without building any tables, and merge keys are not followed.
+-- @tparam string|file|function s YAML stream, an open file handle to
+--    read it from, or a reader function returning successive chunks of it
+--    and `nil` at the end
+-- @string path path to the wanted node in each document
+-- @tparam[opt] loader_opts opts initialisation options, except *all*
+-- @return the first node at *path*, or with wildcards in *path*, a
+--    list of every matching node in the stream
+-- @usage ids = lyaml.select(io.open 'dump.yaml', 'items[*].id')
+local function select(s, path, opts)
+   return yaml.select(s, path, opts)
+end
+
+
+--- Load a YAML stream that arrives a chunk at a time.
+-- The stream is parsed by `yaml.push_parser` as each chunk is fed in,
+-- keeping its state in between, and every document that has been
+-- completed is returned straight away.  Tables are always built in Lua,
+-- as with *opts.native* set to `false`.  Each loader holds a thread with
+-- a small stack until `finish` is called or it is garbage collected.
+-- @tparam[opt] loader_opts opts initialisation options, except *all*
+-- @treturn table loader with `feed(chunk)` and `finish()` methods, which
+--    each return a list of the documents completed by the input so far
+-- @usage
+-- loader = lyaml.push_loader()
+-- for chunk in body_chunks do handle(loader:feed(chunk)) end
+-- handle(loader:finish())
+local function push_loader(opts)
+   opts = opts or {}
+
+   -- events fed but not yet loaded, and how many DOCUMENT_ENDs among them
+   local queue, head, tail, ends = {}, 0, 0, 0
+   local push = yaml.push_parser {max_input_bytes = opts.max_input_bytes}
+   local parser = Parser(nil, {
+      explicit_scalar = opts.explicit_scalar or default.explicit_scalar,
+      implicit_scalar = opts.implicit_scalar or default.implicit_scalar,
+      max_alias_expansions = opts.max_alias_expansions,
+      max_depth = opts.max_depth,
+      max_nodes = opts.max_nodes,
+      max_scalar_bytes = opts.max_scalar_bytes,
+      next = function()
+         head = head + 1
+         local event = queue[head]
+         queue[head] = nil
+         if type(event) == 'string' then
+            error(event, 0)
+         end
+         return event
+      end,
+   })
+   local started = false
+
+   -- Queue the events from a feed, or the error it raised, and return a
+   -- list of the documents they complete.
+   local function take(ok, events)
+      if ok then
+         for _, event in ipairs(events) do
+            tail = tail + 1
+            queue[tail] = event
+            if event.type == 'DOCUMENT_END' then
+               ends = ends + 1
+            end
+         end
+      else
+         -- load up to the error, so that it is raised by the parser
+         tail = tail + 1
+         queue[tail] = events
+         ends = ends + 1
+      end
+
+      if not started and tail > head then
+         started = true
+         if parser:parse() ~= 'STREAM_START' then
+            error('expecting STREAM_START event, but got ' .. parser:type(),
+                  3)
+         end
+      end
+
+      local documents = {}
+      while ends > 0 do
+         ends = ends - 1
+         parser:parse()
+         local document = parser:load_node()
+         if document == nil then
+            error('unexpected ' .. parser:type() .. ' event', 3)
+         end
+         if parser:parse() ~= 'DOCUMENT_END' then
+            error('expecting DOCUMENT_END event, but got ' .. parser:type(),
+                  3)
+         end
+
+         -- reset anchor table
+         parser.anchors = {}
+         documents[#documents + 1] = document
+      end
+      return documents
+   end
+
+   return {
+      feed = function(self, chunk)
+         return take(pcall(push.feed, push, chunk))
+      end,
+
+      finish = function(self)
+         local documents = take(pcall(push.finish, push))
+         if parser:parse() ~= 'STREAM_END' then
+            error('expecting STREAM_END event, but got ' .. parser:type(), 2)
+         end
+         return documents
+      end,
+   }
+end
+
+
 --[[ ----------------- ]]--
 --[[ Public Interface. ]]--
 --[[ ----------------- ]]--
@@ -521,8 +1256,16 @@ end
 
 --- @export
 return {
+   compile = compile,
+   documents = documents,
    dump = dump,
    load = load,
+   load_compiled = load_compiled,
+   load_file = load_file,
+   map = map,
+   push_loader = push_loader,
+   select = select,
+   seq = seq,
 
    --- `lyaml.null` value.
    -- @table null